@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "access_log.h"
+
+bool access_log::s_enabled = false;
+char access_log::s_dir[256];
+access_log::ring access_log::s_rings[MAX_RINGS];
+std::atomic<int> access_log::s_ring_count(0);
+std::atomic<long> access_log::s_dropped(0);
+pthread_t access_log::s_thread;
+
+static const size_t SEGMENT_BYTES = sizeof(access_record) * access_log::SEGMENT_RECORDS;
+
+// 每个线程领取的环, 第一次写日志时领取
+static thread_local int t_ring = -1;
+
+// 以下变量只由后台线程访问
+static gzFile s_out = NULL;  // 当前的日志文件
+static size_t s_out_bytes = 0;  // 当前日志文件已写入的字节数(压缩前)
+
+// 文件中是否有记录(时间戳不为0的槽位)
+static bool has_records(int fd) {
+    access_record buf[256];
+    off_t off = 0;
+    ssize_t n;
+    while ((n = pread(fd, buf, sizeof(buf), off)) > 0) {
+        for (size_t i = 0; i < n / sizeof(access_record); i++) {
+            if (buf[i].timestamp != 0) {
+                return true;
+            }
+        }
+        off += n;
+    }
+    return false;
+}
+
+bool access_log::open(const char* dir) {
+    if (strlen(dir) >= sizeof(s_dir) - 32) {
+        return false;
+    }
+    strcpy(s_dir, dir);
+    mkdir(dir, 0755);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct tm tm;
+    localtime_r(&ts.tv_sec, &tm);
+    char stamp[32];
+    int stamp_len = strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(stamp + stamp_len, sizeof(stamp) - stamp_len, ".%03ld", ts.tv_nsec / 1000000);
+    // 1.为每个环创建并映射一个文件. 映射时预先分配好物理页, 写日志时不会发生缺页
+    for (int i = 0; i < MAX_RINGS; i++) {
+        char path[sizeof(s_dir) + 32];
+        snprintf(path, sizeof(path), "%s/ring.%d.seg", dir, i);
+        // 1-1 上次运行留下的环文件中可能有还没被压缩的记录(进程崩溃, 或平滑升级时旧进程还在写), 不能截断:
+        // 有记录的文件改名为ring.<n>.<时间>.seg保留下来, 没有记录的删除. 这样本进程总是映射一个新文件
+        int fd = ::open(path, O_RDONLY);
+        if (fd != -1) {
+            bool keep = has_records(fd);
+            close(fd);
+            char kept[sizeof(s_dir) + 64];
+            snprintf(kept, sizeof(kept), "%s/ring.%d.%s.seg", dir, i, stamp);
+            if (keep ? rename(path, kept) == -1 : unlink(path) == -1) {
+                perror(keep ? "rename(ring)" : "unlink(ring)");
+                return false;
+            }
+        }
+        // 1-2 创建新的环文件
+        fd = ::open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd == -1) {
+            perror("open(ring)");
+            return false;
+        }
+        size_t size = SEGMENT_BYTES * SEGMENTS;
+        if (ftruncate(fd, size) == -1) {
+            perror("ftruncate(ring)");
+            close(fd);
+            return false;
+        }
+        void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            perror("mmap(ring)");
+            return false;
+        }
+        ring& r = s_rings[i];
+        for (int j = 0; j < SEGMENTS; j++) {
+            r.segs[j].committed.store(0);
+            r.segs[j].state.store(j == 0 ? ACTIVE : FREE);
+            r.segs[j].flushed = 0;
+            r.segs[j].records = (access_record*)((char*)addr + SEGMENT_BYTES * j);
+        }
+        r.current = 0;
+        r.flushing = 0;
+    }
+    // 2.打开第一个日志文件, 启动后台线程
+    if (!rotate()) {
+        return false;
+    }
+    if (pthread_create(&s_thread, NULL, worker, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(s_thread);
+    s_enabled = true;
+    return true;
+}
+
+void access_log::append(const access_record& rec) {
+    // 1.领取本线程的环
+    if (t_ring < 0) {
+        int i = s_ring_count.fetch_add(1, std::memory_order_relaxed);
+        if (i >= MAX_RINGS) {
+            s_ring_count.fetch_sub(1, std::memory_order_relaxed);
+            s_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        t_ring = i;
+    }
+    ring& r = s_rings[t_ring];
+    segment* s = r.segs + r.current;
+    uint32_t n = s->committed.load(std::memory_order_relaxed);
+    // 2.当前段已满: 封存它, 换到下一段. 下一段还没被后台线程交还时丢弃这条记录
+    if (n == (uint32_t)SEGMENT_RECORDS) {
+        if (s->state.load(std::memory_order_relaxed) == ACTIVE) {
+            s->state.store(SEALED, std::memory_order_release);
+        }
+        int next = (r.current + 1) % SEGMENTS;
+        if (r.segs[next].state.load(std::memory_order_acquire) != FREE) {
+            s_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        r.segs[next].state.store(ACTIVE, std::memory_order_relaxed);
+        r.current = next;
+        s = r.segs + next;
+        n = 0;
+    }
+    // 3.写入记录, 再发布新的记录数, 后台线程读到记录数时记录内容一定已经写好
+    s->records[n] = rec;
+    s->committed.store(n + 1, std::memory_order_release);
+}
+
+void* access_log::worker(void* arg) {
+    while (true) {
+        usleep(FLUSH_MS * 1000);
+        flush();
+    }
+    return NULL;
+}
+
+// 把所有环中新写入的记录压缩到日志文件中
+void access_log::flush() {
+    int rings = s_ring_count.load(std::memory_order_acquire);
+    bool wrote = false;
+    for (int i = 0; i < rings; i++) {
+        ring& r = s_rings[i];
+        while (true) {
+            segment& s = r.segs[r.flushing];
+            // 先读状态再读记录数: 看到SEALED时, 封存前写入的记录数一定也能看到
+            int state = s.state.load(std::memory_order_acquire);
+            uint32_t n = s.committed.load(std::memory_order_acquire);
+            if (n > s.flushed) {
+                write_records(s.records + s.flushed, n - s.flushed);
+                s.flushed = n;
+                wrote = true;
+            }
+            if (state != SEALED) {
+                break;
+            }
+            // 段已封存并全部压缩, 清空后交还给写入线程
+            memset(s.records, 0, SEGMENT_BYTES);
+            s.flushed = 0;
+            s.committed.store(0, std::memory_order_relaxed);
+            s.state.store(FREE, std::memory_order_release);
+            r.flushing = (r.flushing + 1) % SEGMENTS;
+        }
+    }
+    if (wrote) {
+        gzflush(s_out, Z_SYNC_FLUSH);  // 让已写入的记录尽快可以被解码
+    }
+}
+
+void access_log::write_records(const access_record* recs, uint32_t count) {
+    size_t len = sizeof(access_record) * count;
+    if (s_out_bytes + len > ROTATE_BYTES) {
+        rotate();
+    }
+    if (s_out) {
+        gzwrite(s_out, recs, len);
+        s_out_bytes += len;
+    }
+}
+
+// 关闭当前日志文件, 以当前时间命名新的日志文件, 并写入文件头
+bool access_log::rotate() {
+    if (s_out) {
+        gzclose(s_out);
+        s_out = NULL;
+    }
+    char path[sizeof(s_dir) + 64];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct tm tm;
+    localtime_r(&ts.tv_sec, &tm);
+    int len = snprintf(path, sizeof(path), "%s/access.", s_dir);
+    len += strftime(path + len, sizeof(path) - len, "%Y%m%d-%H%M%S", &tm);
+    snprintf(path + len, sizeof(path) - len, ".%03ld.log.gz", ts.tv_nsec / 1000000);
+    s_out = gzopen(path, "wb6");
+    if (!s_out) {
+        printf("无法创建访问日志文件: %s\n", path);
+        return false;
+    }
+    access_log_header header;
+    memcpy(header.magic, "WSACCLOG", 8);
+    header.version = VERSION;
+    header.record_size = sizeof(access_record);
+    gzwrite(s_out, &header, sizeof(header));
+    s_out_bytes = sizeof(header);
+    return true;
+}
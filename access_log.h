@@ -0,0 +1,102 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+
+/*
+ * 二进制访问日志.
+ * 1.每条记录是固定布局的128字节结构体(access_record), 请求结束时直接写入当前线程的环形缓冲区,
+ *   不格式化字符串, 不加锁, 也不做系统调用(时间戳来自vDSO中的clock_gettime);
+ * 2.每个线程一个环(ring), 环由SEGMENTS个段组成, 映射自日志目录下的ring.<n>.seg文件. 进程
+ *   崩溃时还没有被压缩的记录仍然留在这些文件中, 下次启动时有记录的环文件被改名为
+ *   ring.<n>.<时间>.seg保留下来, 可以用解码工具的-r选项读出来;
+ * 3.后台线程定期把各个环中新写入的记录用zlib压缩追加到access.<时间>.log.gz, 文件的未压缩
+ *   大小超过ROTATE_BYTES时轮转到新文件. 段写满后由后台线程清空并交还给写入线程;
+ * 4.若后台线程跟不上, 写入线程的下一个段还没有被交还, 新记录会被丢弃并计数, 请求不会被阻塞.
+ * 解码工具见tools/access_log_decode.cpp, 链接时需要-lz.
+ */
+
+// 日志文件(压缩前)的文件头
+struct access_log_header {
+    char magic[8];  // "WSACCLOG"
+    uint32_t version;
+    uint32_t record_size;  // sizeof(access_record)
+};
+
+// 一条访问记录
+struct access_record {
+    static const int URL_LEN = 96;  // 记录中保存的URL的最大长度, 超出部分被截断
+
+    uint64_t timestamp;  // 请求结束的时间, 自1970-01-01以来的纳秒数
+    uint64_t bytes;  // 发给客户端的字节数
+    uint32_t latency;  // 从读到请求的第一个字节到应答发完的时间, 单位微秒
+    uint32_t addr;  // 客户端IPv4地址(网络字节序)
+    uint16_t port;  // 客户端端口(网络字节序)
+    uint16_t status;  // 应答状态码
+    uint8_t method;  // http_conn::METHOD
+    uint8_t protocol;  // 1: HTTP/1.1, 2: HTTP/2
+    uint16_t url_len;  // URL的原始长度(可能大于URL_LEN)
+    char url[URL_LEN];  // URL, 不以'\0'结尾
+};
+
+static_assert(sizeof(access_record) == 128, "access_record的布局应为128字节");
+
+class access_log {
+public:
+    static const uint32_t VERSION = 1;
+    static const int MAX_RINGS = 16;  // 环的数量, 即最多能写日志的线程数
+    static const int SEGMENTS = 4;  // 每个环的段数
+    static const int SEGMENT_RECORDS = 2048;  // 每段的记录数(256KB)
+    static const size_t ROTATE_BYTES = 64 * 1024 * 1024;  // 日志文件轮转的大小(压缩前)
+    static const int FLUSH_MS = 200;  // 后台线程的检查间隔
+
+    // 在dir目录下创建环文件并启动后台线程, 失败返回false
+    static bool open(const char* dir);
+    static bool enabled() {
+        return s_enabled;
+    }
+    // 写入一条记录. 可以在任何线程中调用, 每个线程第一次调用时领取一个环
+    static void append(const access_record& rec);
+    // 当前时间(CLOCK_REALTIME), 单位纳秒
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+    static long dropped() {
+        return s_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    enum SEGMENT_STATE { FREE = 0, ACTIVE, SEALED };
+
+    struct segment {
+        std::atomic<uint32_t> committed;  // 已写入的记录数, 写入线程更新
+        std::atomic<int> state;
+        uint32_t flushed;  // 已被后台线程压缩的记录数, 只由后台线程访问
+        access_record* records;
+    };
+
+    struct ring {
+        segment segs[SEGMENTS];
+        int current;  // 写入线程正在写的段, 只由写入线程访问
+        int flushing;  // 后台线程正在压缩的段, 只由后台线程访问
+    };
+
+    static void* worker(void* arg);
+    static void flush();
+    static void write_records(const access_record* recs, uint32_t count);
+    static bool rotate();
+
+    static bool s_enabled;
+    static char s_dir[256];
+    static ring s_rings[MAX_RINGS];
+    static std::atomic<int> s_ring_count;  // 已被线程领取的环数
+    static std::atomic<long> s_dropped;
+    static pthread_t s_thread;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+#include <stdint.h>
+
+/*
+ * 资源包(asset pack)的文件格式. 资源包把整个网站打包成一个文件, 由tools/pack_build.cpp生成,
+ * 服务器启动时(以及收到SIGHUP时)把它整个mmap进来, 作为资源仓库(asset_store)使用.
+ * 部署时先生成新的包, 再rename替换旧包并发送SIGHUP, 替换是原子的.
+ * 文件布局(整数都是小端序):
+ *   pack_header                 文件头, 64字节
+ *   pack_entry[count]           索引, 按URL排序
+ *   字符串区                    URL和MIME类型, 都以'\0'结尾
+ *   内容块                      每个文件的内容(以及可选的gzip预压缩版本), 每块都从页边界开始
+ */
+
+static const char PACK_MAGIC[8] = {'W', 'S', 'A', 'S', 'P', 'A', 'C', 'K'};
+static const uint32_t PACK_VERSION = 1;
+static const uint64_t PACK_ALIGN = 4096;  // 内容块的对齐
+
+struct pack_header {
+    char magic[8];  // PACK_MAGIC
+    uint32_t version;  // PACK_VERSION
+    uint32_t count;  // 索引的项数
+    uint64_t strings;  // 字符串区的偏移
+    uint64_t strings_len;  // 字符串区的长度
+    uint64_t data;  // 第一个内容块的偏移
+    uint64_t size;  // 整个文件的大小, 用于发现被截断的文件
+    uint8_t reserved[16];
+};
+
+struct pack_entry {
+    uint64_t offset;  // 内容块的偏移
+    uint64_t length;  // 文件大小
+    uint64_t gz_offset;  // gzip预压缩版本的偏移, 没有时为0
+    uint64_t gz_length;
+    int64_t mtime;  // 文件的修改时间(自1970-01-01以来的秒数)
+    uint32_t url;  // URL在字符串区中的偏移, 例如"/images/image1.jpg"
+    uint32_t url_len;
+    uint32_t mime;  // MIME类型在字符串区中的偏移
+    uint32_t reserved;
+};
+
+static_assert(sizeof(pack_header) == 64, "pack_header的布局应为64字节");
+static_assert(sizeof(pack_entry) == 56, "pack_entry的布局应为56字节");
+
+#endif
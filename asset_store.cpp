@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <string>
+#include "asset_store.h"
+#include "asset_pack.h"
+#include "mime.h"
+
+std::atomic<asset_store*> asset_store::s_current(NULL);
+std::vector<asset_store*> asset_store::s_retired;
+asset_store::counter asset_store::s_readers[READERS];
+std::atomic<int> asset_store::s_next_reader(0);
+locker asset_store::s_reload_lock;
+bool asset_store::s_reloading = false;
+bool asset_store::s_reload_again = false;
+asset_store::reload_args asset_store::s_reload_args;
+asset_store* asset_store::s_reloaded = NULL;
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static const int HEADERS_MAX = 128;  // 预生成首部行的最大长度
+static const int PACK_HEADERS_MAX = 256;  // 资源包中的资源还有Last-Modified、Vary等首部
+
+static inline size_t align_up(size_t n, size_t a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+// 遍历时收集到的文件
+struct file_entry {
+    std::string path;  // 文件的完整路径
+    std::string url;  // 对应的URL
+    size_t size;
+};
+
+// 递归遍历目录, 收集符合条件的普通文件
+static void collect(const std::string& dir, const std::string& url, size_t max_file_size, std::vector<file_entry>& out) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        std::string path = dir + "/" + ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            collect(path, url + "/" + ent->d_name, max_file_size, out);
+        } else if (S_ISREG(st.st_mode) && (st.st_mode & S_IROTH) && (size_t)st.st_size <= max_file_size) {
+            // 与do_request一致: 只有Others可读的文件才能被访问
+            file_entry e;
+            e.path = path;
+            e.url = url + "/" + ent->d_name;
+            e.size = st.st_size;
+            out.push_back(e);
+        }
+    }
+    closedir(d);
+}
+
+asset_store::asset_store():
+    m_arena(NULL),
+    m_arena_size(0),
+    m_arena_used(0),
+    m_locked(false),
+    m_text(NULL),
+    m_assets(NULL),
+    m_count(0),
+    m_slots(NULL),
+    m_mask(0),
+    m_quiesced(false)
+{
+    for (int i = 0; i < READERS; i++) {
+        m_refs[i].n.store(0, std::memory_order_relaxed);
+    }
+}
+
+asset_store::~asset_store() {
+    if (m_arena) {
+        if (m_locked) {
+            munlock(m_arena, m_arena_size);
+        }
+        munmap(m_arena, m_arena_size);
+    }
+    delete[] m_text;
+    delete[] m_assets;
+    delete[] m_slots;
+}
+
+uint64_t asset_store::hash(const char* s, size_t len) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+asset_store* asset_store::load(const char* root, size_t max_file_size, bool huge, bool lock) {
+    // 1.遍历目录, 收集文件并计算arena的大小
+    std::vector<file_entry> files;
+    collect(root, "", max_file_size, files);
+    size_t total = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        total += align_up(files[i].url.size() + 1 + HEADERS_MAX, 64) + align_up(files[i].size, 64);
+    }
+    if (total == 0) {
+        total = 64;
+    }
+
+    asset_store* store = new asset_store();
+    // 2.创建arena: 优先使用大页, 失败时退回普通页并建议内核使用透明大页
+    void* addr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge) {
+        store->m_arena_size = align_up(total, HUGE_PAGE_SIZE);
+        addr = mmap(NULL, store->m_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap(MAP_HUGETLB)");
+        }
+    }
+#endif
+    if (addr == MAP_FAILED) {
+        store->m_arena_size = align_up(total, 4096);
+        addr = mmap(NULL, store->m_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap");
+            delete store;
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (huge) {
+            madvise(addr, store->m_arena_size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    store->m_arena = (char*)addr;
+
+    // 3.创建查找表(大小为2的幂, 负载因子不超过0.5), 并逐个读入文件
+    uint32_t slots = 16;
+    while (slots < files.size() * 2) {
+        slots <<= 1;
+    }
+    store->m_mask = slots - 1;
+    store->m_slots = new uint32_t[slots];
+    memset(store->m_slots, 0, sizeof(uint32_t) * slots);
+    store->m_assets = new asset[files.size() + 1];
+    char* cursor = store->m_arena;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!store->insert(files[i].url.c_str(), files[i].url.size(), files[i].path.c_str(), files[i].size, cursor)) {
+            printf("资源预加载: 读取 %s 失败, 已跳过\n", files[i].path.c_str());
+        }
+    }
+    store->m_arena_used = cursor - store->m_arena;
+
+    // 4.锁定在内存中, 并把arena设为只读
+    if (lock) {
+        if (mlock(store->m_arena, store->m_arena_size) == 0) {
+            store->m_locked = true;
+        } else {
+            perror("mlock");
+        }
+    }
+    mprotect(store->m_arena, store->m_arena_size, PROT_READ);
+    return store;
+}
+
+bool asset_store::insert(const char* url, int url_len, const char* path, size_t size, char*& cursor) {
+    // 1.读入文件内容
+    char* head = cursor;
+    char* data = head + align_up(url_len + 1 + HEADERS_MAX, 64);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::read(fd, data + done, size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    if (done != size) {
+        return false;  // 文件在遍历之后被改动过
+    }
+    // 2.写入URL和预生成的首部行, 与process_write生成的内容保持一致
+    memcpy(head, url, url_len);
+    head[url_len] = '\0';
+    char* headers = head + url_len + 1;
+    const char* mime = mime_type(url);
+    int headers_len = snprintf(headers, HEADERS_MAX, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type:%s\r\n", size, mime);
+    // 3.登记资源并插入查找表
+    asset& a = m_assets[m_count];
+    a.url = head;
+    a.url_len = url_len;
+    a.headers = headers;
+    a.headers_len = headers_len;
+    a.data = data;
+    a.length = size;
+    a.mime = mime;
+    a.store = this;
+    add(a, hash(url, url_len));
+    cursor = data + align_up(size, 64);
+    return true;
+}
+
+void asset_store::add(asset& a, uint64_t h) {
+    a.hash = h;
+    a.gzip = NULL;
+    uint32_t i = h & m_mask;
+    while (m_slots[i]) {
+        i = (i + 1) & m_mask;
+    }
+    m_slots[i] = ++m_count;
+}
+
+// 生成资源包中资源的首部行. gzip: 0为原始内容, 1为原始内容(另有gzip版本), 2为gzip版本
+static int pack_headers(char* buf, size_t length, const char* mime, int64_t mtime, int gzip) {
+    char date[64];
+    time_t t = mtime;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return snprintf(buf, PACK_HEADERS_MAX, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type:%s\r\nLast-Modified: %s\r\n%s%s",
+        length, mime, date, gzip ? "Vary: Accept-Encoding\r\n" : "", gzip == 2 ? "Content-Encoding: gzip\r\n" : "");
+}
+
+asset_store* asset_store::load_pack(const char* path, bool lock) {
+    // 1.映射整个包. 之后即使包文件被rename替换, 映射仍然指向旧的文件
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open(pack)");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(pack_header)) {
+        printf("资源包 %s 不完整\n", path);
+        close(fd);
+        return NULL;
+    }
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror("mmap(pack)");
+        return NULL;
+    }
+    asset_store* store = new asset_store();
+    store->m_arena = (char*)addr;
+    store->m_arena_size = st.st_size;
+    store->m_arena_used = st.st_size;
+
+    // 2.检查文件头: 魔数、版本, 以及索引和字符串区都在文件之内. 先检查strings不超过size, 再做减法, 避免回绕
+    const char* base = store->m_arena;
+    const pack_header* header = (const pack_header*)base;
+    uint64_t size = st.st_size;
+    uint64_t index_end = sizeof(pack_header) + (uint64_t)header->count * sizeof(pack_entry);
+    if (memcmp(header->magic, PACK_MAGIC, 8) != 0 || header->version != PACK_VERSION || header->size != size
+        || index_end > size || header->strings < index_end || header->strings > size
+        || header->strings_len > size - header->strings) {
+        printf("%s 不是有效的资源包\n", path);
+        delete store;
+        return NULL;
+    }
+    const pack_entry* entries = (const pack_entry*)(base + sizeof(pack_header));
+    const char* strings = base + header->strings;
+
+    // 3.建立查找表, 为每个资源(以及它的gzip版本)生成首部行
+    uint32_t count = header->count;
+    uint32_t slots = 16;
+    while (slots < count * 2) {
+        slots <<= 1;
+    }
+    store->m_mask = slots - 1;
+    store->m_slots = new uint32_t[slots];
+    memset(store->m_slots, 0, sizeof(uint32_t) * slots);
+    store->m_assets = new asset[count * 2 + 1];
+    store->m_text = new char[(size_t)count * 2 * PACK_HEADERS_MAX + 1];
+    asset* variants = store->m_assets + count;  // gzip版本放在数组后半部分, 不进入查找表
+    char* text = store->m_text;
+    for (uint32_t i = 0; i < count; i++) {
+        const pack_entry& e = entries[i];
+        bool ok = e.url < header->strings_len && e.url_len < header->strings_len - e.url && e.mime < header->strings_len
+            && e.length <= size && e.offset <= size - e.length && e.gz_length <= size && e.gz_offset <= size - e.gz_length
+            && memchr(strings + e.mime, '\0', header->strings_len - e.mime) && strings[e.url + e.url_len] == '\0';
+        if (!ok) {
+            printf("%s 不是有效的资源包(第 %u 项越界)\n", path, i);
+            delete store;
+            return NULL;
+        }
+        bool has_gzip = e.gz_offset != 0;
+        asset& a = store->m_assets[store->m_count];
+        a.url = strings + e.url;
+        a.url_len = e.url_len;
+        a.data = base + e.offset;
+        a.length = e.length;
+        a.mime = strings + e.mime;
+        a.store = store;
+        a.headers = text;
+        a.headers_len = pack_headers(text, e.length, a.mime, e.mtime, has_gzip ? 1 : 0);
+        text += PACK_HEADERS_MAX;
+        store->add(a, hash(a.url, a.url_len));
+        if (has_gzip) {
+            asset& v = variants[i];
+            v = a;
+            v.gzip = NULL;
+            v.data = base + e.gz_offset;
+            v.length = e.gz_length;
+            v.headers = text;
+            v.headers_len = pack_headers(text, e.gz_length, a.mime, e.mtime, 2);
+            text += PACK_HEADERS_MAX;
+            a.gzip = &v;
+        }
+    }
+
+    // 4.锁定在内存中
+    if (lock) {
+        if (mlock(store->m_arena, store->m_arena_size) == 0) {
+            store->m_locked = true;
+        } else {
+            perror("mlock");
+        }
+    }
+    return store;
+}
+
+const asset_store::asset* asset_store::find(const char* url, size_t len) const {
+    uint64_t h = hash(url, len);
+    for (uint32_t i = h & m_mask; m_slots[i]; i = (i + 1) & m_mask) {
+        const asset* a = m_assets + m_slots[i] - 1;
+        if (a->hash == h && (size_t)a->url_len == len && memcmp(a->url, url, len) == 0) {
+            return a;
+        }
+    }
+    return NULL;
+}
+
+int asset_store::reader_slot() {
+    static thread_local int slot = s_next_reader.fetch_add(1, std::memory_order_relaxed) % READERS;
+    return slot;
+}
+
+asset_store* asset_store::acquire() {
+    // 读取指针与增加引用计数之间, 仓库可能恰好被替换. 用窗口计数器告诉主线程本线程可能还拿着旧仓库的指针.
+    // 计数器的增加与读取指针都是顺序一致的: 主线程在替换之后读到计数器为0, 说明本线程要么已经增加了
+    // 引用计数, 要么要在那之后才读取指针, 只会取到新仓库
+    int slot = reader_slot();
+    counter& r = s_readers[slot];
+    r.n.fetch_add(1, std::memory_order_seq_cst);
+    asset_store* store = s_current.load(std::memory_order_seq_cst);
+    if (store) {
+        store->m_refs[slot].n.fetch_add(1, std::memory_order_relaxed);
+    }
+    r.n.fetch_sub(1, std::memory_order_release);
+    return store;
+}
+
+void asset_store::release() {
+    m_refs[reader_slot()].n.fetch_sub(1, std::memory_order_release);
+}
+
+void asset_store::publish(asset_store* store) {
+    asset_store* old = s_current.exchange(store, std::memory_order_seq_cst);
+    if (old) {
+        s_retired.push_back(old);
+    }
+}
+
+void asset_store::reclaim() {
+    if (s_retired.empty()) {
+        return;
+    }
+    // 1.所有窗口计数器都为0时, 此前退休的仓库都已经过了静止状态. 有计数器不为0时下次再检查
+    bool quiet = true;
+    for (int i = 0; i < READERS && quiet; i++) {
+        quiet = s_readers[i].n.load(std::memory_order_seq_cst) == 0;
+    }
+    // 2.释放已经过静止状态且引用计数为0的旧仓库. 此后它的各个分片只会减少, 不会再增加, 因此依次读出的
+    //   分片之和不小于读完时的真实引用数, 和为0说明确实已经无人使用
+    for (size_t i = 0; i < s_retired.size(); ) {
+        asset_store* store = s_retired[i];
+        if (quiet) {
+            store->m_quiesced = true;
+        }
+        long refs = 0;
+        if (store->m_quiesced) {
+            for (int j = 0; j < READERS; j++) {
+                refs += store->m_refs[j].n.load(std::memory_order_acquire);
+            }
+        }
+        if (store->m_quiesced && refs == 0) {
+            delete store;
+            s_retired[i] = s_retired.back();
+            s_retired.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+void asset_store::reload(const char* root, const char* pack, size_t max_file_size, bool huge, bool lock) {
+    s_reload_lock.lock();
+    s_reload_args.root = root;
+    s_reload_args.pack = pack;
+    s_reload_args.max_file_size = max_file_size;
+    s_reload_args.huge = huge;
+    s_reload_args.lock = lock;
+    if (s_reloading) {
+        // 正在加载的仓库可能读到了修改之前的文件, 加载完成后再加载一次
+        s_reload_again = true;
+        s_reload_lock.unlock();
+        return;
+    }
+    // 加载线程屏蔽所有信号, SIGHUP等信号仍然只由主线程处理
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reload_worker, NULL) == 0) {
+        pthread_detach(thread);
+        s_reloading = true;
+    } else {
+        printf("无法创建资源加载线程\n");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    s_reload_lock.unlock();
+}
+
+void* asset_store::reload_worker(void* arg) {
+    s_reload_lock.lock();
+    while (true) {
+        reload_args args = s_reload_args;
+        s_reload_again = false;
+        s_reload_lock.unlock();
+        // 1.建立新仓库, 不持有锁
+        asset_store* store = args.pack ? load_pack(args.pack, args.lock)
+            : load(args.root, args.max_file_size, args.huge, args.lock);
+        // 2.交给主线程. 上一个仓库还没有被发布时, 它已经过时了, 直接释放(没有人引用它)
+        s_reload_lock.lock();
+        if (store) {
+            delete s_reloaded;
+            s_reloaded = store;
+        }
+        uint64_t one = 1;
+        if (write(reload_fd(), &one, sizeof(one)) != sizeof(one)) {
+            perror("write");
+        }
+        if (!s_reload_again) {
+            break;
+        }
+    }
+    s_reloading = false;
+    s_reload_lock.unlock();
+    return NULL;
+}
+
+int asset_store::reload_fd() {
+    static int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return fd;
+}
+
+asset_store* asset_store::reloaded() {
+    uint64_t count;
+    if (read(reload_fd(), &count, sizeof(count)) != sizeof(count)) {
+        return NULL;
+    }
+    s_reload_lock.lock();
+    asset_store* store = s_reloaded;
+    s_reloaded = NULL;
+    s_reload_lock.unlock();
+    if (store) {
+        publish(store);
+    }
+    return store;
+}
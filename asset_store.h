@@ -0,0 +1,126 @@
+#ifndef ASSET_STORE_H
+#define ASSET_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+
+/*
+ * 静态资源预加载仓库.
+ * 启动时(以及收到SIGHUP时)遍历doc_root, 把不超过指定大小的文件全部读入一块连续的内存区(arena),
+ * 并为每个文件预先生成应答报文的状态行和首部行(Connection首部除外, 它取决于请求). 之后
+ * do_request()命中仓库时直接使用内存中的数据, 不再有stat/open/mmap等系统调用.
+ * 1.arena可以使用大页(MAP_HUGETLB, 失败时退回透明大页), 并可以mlock常驻内存;
+ * 2.加载完成后arena被设为只读, URL到资源的查找表也不再修改, 因此查找无需加锁;
+ * 3.更新方式类似RCU: 新仓库建好后用原子操作替换当前仓库, 旧仓库进入退休链表. 正在使用
+ *   旧仓库数据的应答通过引用计数钉住它. 引用计数按线程分片(每个线程增减自己的计数器, 释放时
+ *   只需各分片之和为0), 工作线程之间不争抢同一个缓存行. acquire()读取当前仓库与增加引用计数之间有一个很短的窗口,
+ *   每个线程用自己的计数器(s_readers)标记是否处于窗口中. 旧仓库退休后, 主线程观察到所有线程都
+ *   不在窗口中(静止状态), 此后旧仓库不会再被acquire()取到, 引用计数归零后即可释放, 不依赖时间.
+ * 4.仓库也可以来自资源包(见asset_pack.h): 整个包被mmap为arena, 文件内容不需要复制, 只需为每个
+ *   文件生成首部行并建立查找表. 包中的gzip预压缩版本作为资源的变体, 不进入查找表.
+ * 5.收到SIGHUP时在后台线程中建立新仓库(reload), 主线程不被文件读取和哈希表构建阻塞. 建好后加载线程
+ *   使eventfd(reload_fd)可读, 主线程在事件循环中调用reloaded()发布它.
+ */
+class asset_store {
+public:
+    static const int READERS = 64;  // 窗口计数器的数量, 线程多于它时共用计数器(仍然正确, 只是旧仓库可能释放得晚一些)
+
+    // 仓库中的一个文件
+    struct asset {
+        uint64_t hash;  // URL的哈希值
+        const char* url;  // 例如"/images/image1.jpg"
+        int url_len;
+        int headers_len;
+        const char* headers;  // 预先生成的状态行和首部行(不含Connection首部和空行)
+        const char* data;  // 文件内容
+        size_t length;  // 文件大小
+        const char* mime;  // MIME类型
+        const asset* gzip;  // gzip预压缩的版本(只有资源包中才有), 没有时为NULL
+        asset_store* store;  // 所属的仓库, 释放时通过它减少引用计数
+    };
+
+    /* 遍历root目录, 加载所有不超过max_file_size字节且Others可读的普通文件.
+     * huge: 是否尝试使用大页; lock: 是否mlock. 失败返回NULL */
+    static asset_store* load(const char* root, size_t max_file_size, bool huge, bool lock);
+    // 映射资源包path并建立仓库. lock: 是否mlock. 包的格式错误时返回NULL
+    static asset_store* load_pack(const char* path, bool lock);
+
+    // 获取当前仓库并增加其引用计数, 没有仓库时返回NULL. 用完之后必须调用release()
+    static asset_store* acquire();
+    // 发布新仓库, 旧仓库进入退休链表. 只能在主线程中调用
+    static void publish(asset_store* store);
+    // 释放退休链表中已经过静止状态且无人使用的旧仓库. 只能在主线程中调用
+    static void reclaim();
+
+    // 在后台线程中重新加载仓库: pack不为NULL时映射资源包, 否则遍历root. 加载过程中再次调用时,
+    // 本次加载完成后再加载一次. 参数的含义同load/load_pack, 字符串必须一直有效
+    static void reload(const char* root, const char* pack, size_t max_file_size, bool huge, bool lock);
+    // 加载线程建好新仓库(或者加载失败)时可读的eventfd, 由主线程加入epoll实例
+    static int reload_fd();
+    // reload_fd()可读时在主线程中调用: 发布新建好的仓库并返回它, 没有新仓库(加载失败)时返回NULL
+    static asset_store* reloaded();
+
+    // 按URL查找资源, 找不到返回NULL
+    const asset* find(const char* url, size_t len) const;
+    // 释放acquire()得到的引用, 可以在与acquire()不同的线程中调用
+    void release();
+    int count() const { return m_count; }
+    size_t bytes() const { return m_arena_used; }
+
+    ~asset_store();
+
+private:
+    asset_store();
+
+    static uint64_t hash(const char* s, size_t len);
+    bool insert(const char* url, int url_len, const char* path, size_t size, char*& cursor);
+    void add(asset& a, uint64_t hash);  // 把已经填好的资源a插入查找表
+
+    char* m_arena;  // 连续内存区, 存放URL、首部行和文件内容
+    size_t m_arena_size;  // 映射的大小
+    size_t m_arena_used;
+    bool m_locked;  // 是否已mlock
+    char* m_text;  // 来自资源包时, 存放预生成的首部行
+
+    asset* m_assets;  // 资源数组
+    int m_count;
+    uint32_t* m_slots;  // 开放寻址哈希表, 值为资源下标+1, 0表示空槽
+    uint32_t m_mask;  // 哈希表大小-1
+
+    bool m_quiesced;  // 退休之后是否已观察到所有线程都不在acquire()的窗口中
+
+    // 一个独占缓存行的计数器, 按线程分片使用
+    struct alignas(64) counter {
+        std::atomic<int> n;
+    };
+    // 正在使用本仓库数据的应答数量, 按线程分片. 引用可能在另一个线程中释放, 单个分片可以为负数
+    counter m_refs[READERS];
+    static int reader_slot();  // 当前线程使用的计数器下标
+
+    static std::atomic<asset_store*> s_current;  // 当前发布的仓库
+    static counter s_readers[READERS];  // 每个线程(或者共用计数器的几个线程)处于acquire()窗口中的次数
+    static std::atomic<int> s_next_reader;  // 下一个线程使用的计数器下标
+
+    // 后台加载线程
+    struct reload_args {
+        const char* root;
+        const char* pack;
+        size_t max_file_size;
+        bool huge;
+        bool lock;
+    };
+    static void* reload_worker(void* arg);
+
+    static locker s_reload_lock;  // 保护以下四个成员
+    static bool s_reloading;  // 加载线程是否在运行
+    static bool s_reload_again;  // 加载过程中又收到了重新加载的请求
+    static reload_args s_reload_args;
+    static asset_store* s_reloaded;  // 建好但还没有发布的仓库
+    static std::vector<asset_store*> s_retired;  // 退休链表, 只由主线程访问
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "capture.h"
+
+int capture::s_fd = -1;
+uint64_t capture::s_start = 0;
+std::atomic<uint32_t> capture::s_next_conn(1);
+long capture::s_dropped = 0;
+pthread_t capture::s_thread;
+locker capture::s_lock;
+cond capture::s_cond;
+char capture::s_bufs[2][BUFFER_SIZE];
+int capture::s_lens[2] = {0, 0};
+int capture::s_active = 0;
+bool capture::s_pending = false;
+bool capture::s_stop = false;
+
+uint64_t capture::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool capture::open(const char* path) {
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open(capture)");
+        return false;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    capture_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "WSCAPTUR", 8);
+    header.version = VERSION;
+    header.record_size = sizeof(capture_record);
+    header.start_time = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        perror("write(capture)");
+        ::close(fd);
+        return false;
+    }
+    s_start = now();
+    s_fd = fd;
+    if (pthread_create(&s_thread, NULL, worker, NULL) != 0) {
+        printf("无法创建录制线程\n");
+        ::close(fd);
+        s_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void capture::close() {
+    if (s_fd == -1) {
+        return;
+    }
+    // 1.让后台线程写完已经交给它的缓冲区后退出
+    s_lock.lock();
+    s_stop = true;
+    s_cond.signal(s_lock.get());
+    s_lock.unlock();
+    pthread_join(s_thread, NULL);
+    // 2.写出当前缓冲区中剩余的记录
+    s_lock.lock();
+    write_out(s_bufs[s_active], s_lens[s_active]);
+    s_lens[s_active] = 0;
+    ::close(s_fd);
+    s_fd = -1;
+    if (s_dropped > 0) {
+        printf("录制: 写文件跟不上, 丢弃了 %ld 条记录\n", s_dropped);
+    }
+    s_lock.unlock();
+}
+
+uint32_t capture::connect() {
+    uint32_t conn = s_next_conn.fetch_add(1, std::memory_order_relaxed);
+    append(OPEN, conn, NULL, 0);
+    return conn;
+}
+
+void capture::data(uint32_t conn, const char* buf, int len) {
+    // len字段只有16位, 更长的数据拆成多条记录(时间戳相同)
+    while (len > 0) {
+        int n = len < 65535 ? len : 65535;
+        append(DATA, conn, buf, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+void capture::disconnect(uint32_t conn) {
+    append(CLOSE, conn, NULL, 0);
+}
+
+void capture::append(uint16_t type, uint32_t conn, const char* buf, int len) {
+    s_lock.lock();
+    if (s_fd == -1) {  // 已经关闭
+        s_lock.unlock();
+        return;
+    }
+    uint64_t t = now();
+    // 当前缓冲区放不下时交给后台线程; 后台线程还没写完另一个缓冲区时丢弃这条记录, 不等待
+    if (s_lens[s_active] + (int)sizeof(capture_record) + len > BUFFER_SIZE && !swap()) {
+        s_dropped++;
+        s_lock.unlock();
+        return;
+    }
+    char* p = s_bufs[s_active] + s_lens[s_active];
+    capture_record rec;
+    rec.time = t - s_start;
+    rec.conn = conn;
+    rec.type = type;
+    rec.len = len;
+    memcpy(p, &rec, sizeof(rec));
+    if (len > 0) {
+        memcpy(p + sizeof(rec), buf, len);
+    }
+    s_lens[s_active] += sizeof(rec) + len;
+    s_lock.unlock();
+}
+
+bool capture::swap() {
+    if (s_pending || s_stop) {
+        return false;
+    }
+    s_pending = true;
+    s_active ^= 1;
+    s_cond.signal(s_lock.get());
+    return true;
+}
+
+void capture::write_out(const char* buf, int len) {
+    int done = 0;
+    while (done < len) {
+        ssize_t n = write(s_fd, buf + done, len - done);
+        if (n <= 0) {
+            perror("write(capture)");
+            break;
+        }
+        done += n;
+    }
+}
+
+void* capture::worker(void* arg) {
+    s_lock.lock();
+    while (true) {
+        // 1.等待交过来的缓冲区. 超时后, 当前缓冲区中停留了FLUSH_MS的记录也交过来
+        if (!s_pending && !s_stop) {
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_nsec += FLUSH_MS * 1000000L;
+            if (t.tv_nsec >= 1000000000L) {
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000L;
+            }
+            s_cond.timedwait(s_lock.get(), t);
+            if (!s_pending && s_lens[s_active] > 0) {
+                swap();
+            }
+        }
+        // 2.不持有锁写文件, 这期间记录写入另一个缓冲区
+        if (s_pending) {
+            int i = s_active ^ 1;
+            s_lock.unlock();
+            write_out(s_bufs[i], s_lens[i]);
+            s_lock.lock();
+            s_lens[i] = 0;
+            s_pending = false;
+            continue;
+        }
+        if (s_stop) {
+            break;
+        }
+    }
+    s_lock.unlock();
+    return NULL;
+}
@@ -0,0 +1,82 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include "locker.h"
+
+/*
+ * 流量录制: 把客户端连接的建立、从m_read_buf读入的原始请求字节及其到达时间、连接的关闭
+ * 依次写入一个录制文件, 由tools/replay.cpp在本机按原来的时序重放, 用真实的请求组合做性能测试.
+ * 1.文件由capture_header和一串记录组成, 每条记录是16字节的capture_record, DATA记录后面紧跟len字节的数据;
+ * 2.时间戳是相对于开始录制的单调时钟纳秒数, 连接用录制期间分配的序号(从1开始)标识;
+ * 3.记录先写入进程内的两个缓冲区之一(互斥锁保护, 只做内存复制). 当前缓冲区满了, 或者其中的记录
+ *   停留超过FLUSH_MS时, 与另一个缓冲区交换, 由后台线程把写满的缓冲区写到文件, 主线程和工作线程不做
+ *   文件I/O. 后台线程还没写完上一个缓冲区而当前缓冲区又满了时, 新记录被丢弃并计数.
+ *   进程收到SIGINT/SIGTERM时写出剩余的记录后退出;
+ * 4.只录制请求方向的字节流, 不录制应答.
+ */
+
+// 录制文件的文件头
+struct capture_header {
+    char magic[8];  // "WSCAPTUR"
+    uint32_t version;
+    uint32_t record_size;  // sizeof(capture_record)
+    uint64_t start_time;  // 开始录制的时间, 自1970-01-01以来的纳秒数
+};
+
+// 一条录制记录
+struct capture_record {
+    uint64_t time;  // 相对于开始录制的时间, 单位纳秒
+    uint32_t conn;  // 连接序号
+    uint16_t type;  // capture::RECORD_TYPE
+    uint16_t len;  // DATA记录的数据长度, 其他记录为0
+};
+
+static_assert(sizeof(capture_header) == 24, "capture_header的布局应为24字节");
+static_assert(sizeof(capture_record) == 16, "capture_record的布局应为16字节");
+
+class capture {
+public:
+    enum RECORD_TYPE { OPEN = 1, DATA, CLOSE };
+    static const uint32_t VERSION = 1;
+    static const int BUFFER_SIZE = 1024 * 1024;  // 缓冲区大小
+    static const int FLUSH_MS = 100;  // 缓冲区中的记录最多停留的时间
+
+    // 创建录制文件并启动后台线程, 失败返回false
+    static bool open(const char* path);
+    // 等后台线程写完, 写出缓冲区中剩余的记录并关闭文件
+    static void close();
+    static bool enabled() {
+        return s_fd != -1;
+    }
+    // 记录一个新连接, 返回它的序号
+    static uint32_t connect();
+    // 记录连接conn读入的len字节数据
+    static void data(uint32_t conn, const char* buf, int len);
+    // 记录连接conn被关闭
+    static void disconnect(uint32_t conn);
+
+private:
+    static void append(uint16_t type, uint32_t conn, const char* buf, int len);
+    static bool swap();  // 把当前缓冲区交给后台线程, 后台线程还在写另一个缓冲区时返回false. 调用者持有s_lock
+    static void write_out(const char* buf, int len);
+    static void* worker(void* arg);
+    static uint64_t now();
+
+    static int s_fd;
+    static uint64_t s_start;  // 开始录制的单调时钟时间
+    static std::atomic<uint32_t> s_next_conn;
+    static long s_dropped;  // 因后台线程跟不上而丢弃的记录数
+    static pthread_t s_thread;
+    static locker s_lock;  // 保护以下成员
+    static cond s_cond;  // 有缓冲区交给后台线程, 或者要停止录制
+    static char s_bufs[2][BUFFER_SIZE];
+    static int s_lens[2];
+    static int s_active;  // 正在写入记录的缓冲区
+    static bool s_pending;  // 另一个缓冲区已交给后台线程, 还没有写完
+    static bool s_stop;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <sys/mman.h>
+#include <new>
+#include <vector>
+#include <exception>
+#include "locker.h"
+#include "http_conn.h"
+
+/*
+ * 连接表: 以文件描述符为下标的槽位数组.
+ * 1.热数据: MAX_FD个http_conn对象(每个128字节)连续存放在一块匿名映射中, 并建议内核
+ *   使用透明大页, 这样即使有几万个活跃连接, 它们的热数据也只分布在少数几个页上,
+ *   TLB缺失大大减少.
+ * 2.冷数据: 每个连接的读写缓冲区等大块数据以COLD_SLAB个为一组批量分配, 通过空闲链表
+ *   复用. 链表是后进先出的, 刚释放的块(很可能还在cache中)会被下一个新连接优先使用.
+ * 3.代数检查: find()根据epoll事件中的key查找连接, 若槽位的代数与key中的不一致, 说明
+ *   这是已关闭连接遗留下来的过期事件, 返回NULL.
+ */
+class conn_table {
+public:
+    static const int COLD_SLAB = 64;  // 每次批量分配的冷数据块数量
+
+    // 有参构造
+    conn_table(int max_fd): m_max_fd(max_fd), m_free_cold(NULL) {
+        if (max_fd <= 0) {
+            throw std::exception();
+        }
+        // 1.为热数据创建匿名映射, 并建议内核使用大页
+        m_map_size = sizeof(http_conn) * (size_t)max_fd;
+        void* addr = mmap(NULL, m_map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            throw std::exception();
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(addr, m_map_size, MADV_HUGEPAGE);
+#endif
+        // 2.在映射区上逐个构造http_conn对象(mmap返回的地址是页对齐的, 满足alignas(64))
+        m_conns = (http_conn*)addr;
+        for (int i = 0; i < max_fd; i++) {
+            new (m_conns + i) http_conn();
+        }
+    }
+    // 析构函数
+    ~conn_table() {
+        for (int i = 0; i < m_max_fd; i++) {
+            m_conns[i].~http_conn();
+        }
+        munmap(m_conns, m_map_size);
+        for (size_t i = 0; i < m_slabs.size(); i++) {
+            delete[] m_slabs[i];
+        }
+    }
+
+    // 按文件描述符取槽位
+    http_conn& operator[](int fd) {
+        return m_conns[fd];
+    }
+    http_conn* base() {
+        return m_conns;
+    }
+    int size() const {
+        return m_max_fd;
+    }
+
+    // 按epoll事件中的key查找连接, 若该事件已过期(槽位已关闭或已被复用)则返回NULL
+    http_conn* find(uint64_t key) {
+        int fd = key_fd(key);
+        if (fd < 0 || fd >= m_max_fd) {
+            return NULL;
+        }
+        http_conn* conn = m_conns + fd;
+        if (conn->sockfd() == -1 || conn->generation() != key_generation(key)) {
+            return NULL;
+        }
+        return conn;
+    }
+
+    /* 分配一个冷数据块.
+     * 连接可能在工作线程中被关闭(process中的close_conn), 因此空闲链表需要加锁. */
+    http_conn::cold_data* alloc_cold() {
+        m_cold_locker.lock();
+        if (!m_free_cold) {
+            // 空闲链表为空, 批量分配一组新的冷数据块并串入链表
+            http_conn::cold_data* slab = new http_conn::cold_data[COLD_SLAB];
+            m_slabs.push_back(slab);
+            for (int i = COLD_SLAB - 1; i >= 0; i--) {
+                slab[i].m_next = m_free_cold;
+                m_free_cold = slab + i;
+            }
+        }
+        http_conn::cold_data* cold = m_free_cold;
+        m_free_cold = cold->m_next;
+        m_cold_locker.unlock();
+        return cold;
+    }
+
+    // 归还一个冷数据块
+    void free_cold(http_conn::cold_data* cold) {
+        m_cold_locker.lock();
+        cold->m_next = m_free_cold;
+        m_free_cold = cold;
+        m_cold_locker.unlock();
+    }
+
+private:
+    int m_max_fd;  // 槽位数量
+    size_t m_map_size;  // 热数据映射区的大小
+    http_conn* m_conns;  // 热数据数组
+    locker m_cold_locker;  // 保护空闲链表的互斥锁
+    http_conn::cold_data* m_free_cold;  // 冷数据块空闲链表
+    std::vector<http_conn::cold_data*> m_slabs;  // 所有批量分配的冷数据块, 析构时释放
+};
+
+#endif
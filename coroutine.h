@@ -0,0 +1,215 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+/*
+ * 协程模式所需的基础设施(需要C++20, 例如 g++ -std=c++20).
+ * 经典模式下, 一个请求被拆成主线程read()、工作线程process()、主线程write()三段, 中间靠
+ * EPOLLONESHOT重新注册和各种索引衔接. 协程模式下, 每个连接是一个协程, 按顺序写成
+ * "读请求 -> 查找资源 -> 发送应答 -> 等待下一个请求"的循环:
+ * 1.等待fd就绪时挂起(io_wait), 主线程的事件循环收到事件后恢复它;
+ * 2.只有会阻塞的工作(文件系统调用)才切换到线程池(offload), 在工作线程上恢复执行;
+ * 3.协程帧由frame_pool分配, 连接建立时取一块, 关闭时归还, 不产生堆分配.
+ */
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define HAS_COROUTINE 1
+
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <vector>
+#include <stddef.h>
+#include "locker.h"
+
+/*
+ * 协程帧分配器: 按大小分为若干级(128, 256, ..., 4096字节), 每级一个后进先出的空闲链表,
+ * 空闲块不够时一次分配一整块slab切分. 协程可能在工作线程上结束, 因此空闲链表需要加锁.
+ * 超过最大一级的帧直接使用operator new, 并计入heap_allocs().
+ */
+class frame_pool {
+public:
+    static const int MIN_SHIFT = 7;  // 最小一级为128字节
+    static const int CLASSES = 6;  // 128 ~ 4096字节
+    static const size_t SLAB_BYTES = 64 * 1024;  // 每次批量分配的大小
+
+    static void* allocate(size_t size) {
+        int c = size_class(size);
+        if (c < 0) {
+            instance().m_heap_allocs++;
+            return ::operator new(size);
+        }
+        return instance().pop(c);
+    }
+    static void deallocate(void* p, size_t size) {
+        int c = size_class(size);
+        if (c < 0) {
+            ::operator delete(p);
+            return;
+        }
+        instance().push(c, p);
+    }
+    // 因帧太大而直接使用堆分配的次数
+    static size_t heap_allocs() {
+        return instance().m_heap_allocs;
+    }
+
+private:
+    struct block {
+        block* next;
+    };
+
+    frame_pool() {
+        for (int i = 0; i < CLASSES; i++) {
+            m_free[i] = NULL;
+        }
+        m_heap_allocs = 0;
+    }
+    ~frame_pool() {
+        for (size_t i = 0; i < m_slabs.size(); i++) {
+            delete[] m_slabs[i];
+        }
+    }
+    static frame_pool& instance() {
+        static frame_pool pool;
+        return pool;
+    }
+    static int size_class(size_t size) {
+        for (int c = 0; c < CLASSES; c++) {
+            if (size <= ((size_t)1 << (MIN_SHIFT + c))) {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    void* pop(int c) {
+        m_locker.lock();
+        if (!m_free[c]) {
+            // 空闲链表为空, 分配一块slab并切分成该级的块
+            size_t size = (size_t)1 << (MIN_SHIFT + c);
+            char* slab = new char[SLAB_BYTES];
+            m_slabs.push_back(slab);
+            for (size_t off = SLAB_BYTES; off >= size; off -= size) {
+                block* b = (block*)(slab + off - size);
+                b->next = m_free[c];
+                m_free[c] = b;
+            }
+        }
+        block* b = m_free[c];
+        m_free[c] = b->next;
+        m_locker.unlock();
+        return b;
+    }
+    void push(int c, void* p) {
+        block* b = (block*)p;
+        m_locker.lock();
+        b->next = m_free[c];
+        m_free[c] = b;
+        m_locker.unlock();
+    }
+
+    locker m_locker;
+    block* m_free[CLASSES];
+    std::vector<char*> m_slabs;
+    size_t m_heap_allocs;
+};
+
+/*
+ * 连接协程的返回类型. 模板参数T是连接类, 协程必须是T的成员函数, 并且T需要提供:
+ *   void coroutine_exit(); // 协程结束(帧已销毁)后调用, 由T决定关闭连接还是交给别的处理方式
+ * 协程创建后先挂起, 由调用者保存address()并在第一次fd就绪时恢复.
+ * 协程在结束时自行销毁协程帧: 恢复协程的线程在resume()返回后不能再访问协程帧, 因为
+ * 协程可能已经挂起在io_wait上并被另一个线程恢复、执行完毕了.
+ */
+template<typename T>
+class conn_task {
+public:
+    struct promise_type {
+        T* owner;
+
+        promise_type(T& conn): owner(&conn) {}  // 成员函数协程的第一个参数是*this
+
+        static void* operator new(size_t size) {
+            return frame_pool::allocate(size);
+        }
+        static void operator delete(void* p, size_t size) {
+            frame_pool::deallocate(p, size);
+        }
+
+        conn_task get_return_object() {
+            return conn_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        struct final_awaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+            void await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                T* conn = h.promise().owner;
+                h.destroy();
+                conn->coroutine_exit();
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    void* address() const {
+        return m_handle.address();
+    }
+
+private:
+    explicit conn_task(std::coroutine_handle<promise_type> h): m_handle(h) {}
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/*
+ * 等待fd就绪: 挂起协程, 并以EPOLLONESHOT重新注册event事件(由T::rearm完成).
+ * upstream为true时等待的是连接正在使用的上游fd(见proxy.h), 否则是连接自己的fd.
+ * 注册之后, 协程随时可能被主线程恢复, 因此await_suspend在rearm之后不能再访问协程帧.
+ */
+template<typename T>
+struct io_wait {
+    T* conn;
+    int event;
+    bool upstream;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<>) {
+        conn->rearm(event, upstream);
+    }
+    void await_resume() const noexcept {}
+};
+
+/*
+ * 切换到线程池: 挂起协程, 把连接加入线程池的任务队列, 工作线程的T::process()会恢复它.
+ * 任务队列已满时不挂起, 直接在当前线程继续执行.
+ */
+template<typename T, typename P>
+struct offload {
+    T* conn;
+    P* pool;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    bool await_suspend(std::coroutine_handle<>) {
+        return pool->append(conn);
+    }
+    void await_resume() const noexcept {}
+};
+
+#else
+#define HAS_COROUTINE 0
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#include <sys/epoll.h>
+#include "event_dispatcher.h"
+
+void event_dispatcher::handle(uint64_t key, uint32_t events) {
+    // 1.上游连接的事件: 根据其中客户端连接的key找到客户端连接, 推进转发
+    if (key & UPSTREAM_KEY_FLAG) {
+        http_conn* conn = m_users->find(key & ~UPSTREAM_KEY_FLAG);
+        if (conn && !conn->proxy_event()) {
+            conn->close_conn();
+        }
+        return;
+    }
+    // 2.根据key查找连接; 若连接已关闭或槽位已被新连接复用, 说明这是过期事件, 直接丢弃
+    http_conn* conn = m_users->find(key);
+    if (!conn) {
+        return;
+    }
+    if (http_conn::m_register_once) {
+        // 3.单次注册模式: 事件先记在连接上. 连接正由工作线程处理时, 由那个线程处理完请求后接着处理
+        if (conn->claim(events)) {
+            while (conn->advance()) {
+                if (conn->admit()) {
+                    submit(conn);
+                    break;
+                }
+                if (!conn->write()) {  // 超过请求速率限制, 429应答已经生成, 直接发送; 没有发完时由advance等待EPOLLOUT
+                    conn->close_conn();
+                    break;
+                }
+            }
+        }
+        return;
+    }
+    // 4.经典模式
+    conn->handed_back();  // 连接以EPOLLONESHOT注册, 收到它的事件说明工作线程已经处理完
+    if ((events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) == EPOLLERR && conn->zerocopy_pending()) {
+        // 4-1 MSG_ZEROCOPY的完成通知: socket的错误队列可读时epoll报告EPOLLERR
+        if (!conn->zerocopy_event(events)) {
+            conn->close_conn();
+        }
+    } else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // 4-2 如果对方异常断开, 或者发生错误
+        conn->close_conn();
+    } else if (http_conn::m_coroutine && conn->in_coroutine()) {
+        // 4-3 协程模式: 恢复挂起在io_wait上的连接协程, 读写都由协程自己完成
+        conn->resume();
+    } else if (events & EPOLLIN) {
+        // 4-4 如果需要读数据, 则一次性把所有数据都读完, 并向线程池添加新任务
+        if (conn->read()) {
+            if (conn->admit()) {
+                conn->hand_off();
+                submit(conn);
+            } else {  // 超过请求速率限制, 429应答已经生成, 等待EPOLLOUT发送
+                m_transport->mod(conn->sockfd(), EPOLLOUT, conn->generation());
+            }
+        } else {  // 如果读出现失败, 则直接关闭当前连接
+            conn->close_conn();
+        }
+    } else if (events & EPOLLOUT) {
+        // 4-5 如果可以写数据了, 则一次性把所有数据都写完
+        if (!conn->write()) {  // 如果写出现失败, 也是直接关闭当前连接
+            conn->close_conn();
+        }
+    }
+}
+
+void event_dispatcher::submit(http_conn* conn) {
+    if (m_inline) {
+        conn->process();
+        return;
+    }
+    if (!m_pool->append(conn)) {  // append要求的输入是T*, 即http_conn*. 任务队列已满时回复503
+        conn->overload();
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef EVENT_DISPATCHER_H
+#define EVENT_DISPATCHER_H
+
+#include <stdint.h>
+#include "http_conn.h"
+#include "conn_table.h"
+#include "threadpool.h"
+#include "transport.h"
+
+/*
+ * 主线程对连接事件的处理, 服务器(main.cpp)和内存回环基准测试(tools/loopback_bench)共用, 两者只是
+ * 事件的来源和传输层不同:
+ * 1.上游连接的事件(key带UPSTREAM_KEY_FLAG): 找到对应的客户端连接, 推进转发;
+ * 2.单次注册模式: 事件先记在连接上(claim), 连接正由工作线程处理时由那个线程接着处理;
+ * 3.经典模式(EPOLLONESHOT): MSG_ZEROCOPY的完成通知、断开、协程的恢复、读后交给线程池、写.
+ * 需要处理请求时交给线程池, 任务队列已满时回复503. inline_process为true时直接在主线程调用process(),
+ * 基准测试用它得到可以逐次复现的结果.
+ */
+class event_dispatcher {
+public:
+    event_dispatcher(conn_table* users, transport* tp, threadpool<http_conn>* pool, bool inline_process = false)
+        : m_users(users), m_transport(tp), m_pool(pool), m_inline(inline_process) {}
+    // 处理一个事件, key和events即epoll_event的data.u64和events
+    void handle(uint64_t key, uint32_t events);
+
+private:
+    void submit(http_conn* conn);  // 把连接交给线程池(或直接处理)
+
+    conn_table* m_users;
+    transport* m_transport;
+    threadpool<http_conn>* m_pool;
+    bool m_inline;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "handoff.h"
+#include "hot_urls.h"
+
+static const char READY = 'R';  // 新进程就绪
+static const int TIMEOUT_SECONDS = 5;  // 控制连接上收发的超时时间, 对方卡住时不会一直阻塞
+
+// 填写path的地址, path太长时返回false
+static bool make_addr(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        printf("控制套接字的路径太长: %s\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static void set_timeout(int fd) {
+    struct timeval tv;
+    tv.tv_sec = TIMEOUT_SECONDS;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int handoff::take(const char* path, int* lfd, std::string& hot) {
+    struct sockaddr_un addr;
+    if (!make_addr(path, &addr)) {
+        return -2;
+    }
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn == -1) {
+        perror("socket");
+        return -2;
+    }
+    if (connect(conn, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(conn);  // 没有旧进程(路径不存在, 或者是上一个进程遗留的套接字文件)
+        return -1;
+    }
+    set_timeout(conn);
+
+    // 1.一个字节的数据, 附带监听套接字
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        perror("recvmsg");
+        close(conn);
+        return -2;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        printf("旧进程没有发来监听套接字\n");
+        close(conn);
+        return -2;
+    }
+    memcpy(lfd, CMSG_DATA(cmsg), sizeof(int));
+
+    // 2.热点URL列表, 以空行结束
+    char buf[4096];
+    while (hot != "\n" && (hot.size() < 2 || hot.compare(hot.size() - 2, 2, "\n\n") != 0)) {
+        ssize_t n = recv(conn, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            printf("没有收到完整的热点URL列表\n");
+            close(*lfd);
+            *lfd = -1;
+            close(conn);
+            return -2;
+        }
+        hot.append(buf, n);
+    }
+    hot.erase(hot.size() - 1);  // 去掉结束的空行
+    return conn;
+}
+
+void handoff::ready(int conn) {
+    if (send(conn, &READY, 1, MSG_NOSIGNAL) != 1) {
+        perror("send");
+    }
+    close(conn);
+}
+
+int handoff::listen(const char* path) {
+    struct sockaddr_un addr;
+    if (!make_addr(path, &addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);  // 旧进程的(或者遗留的)套接字文件
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || ::listen(fd, 1) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool handoff::give(int conn, int lfd) {
+    set_timeout(conn);
+    // 1.监听套接字
+    char byte = 'L';
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &lfd, sizeof(int));
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1) {
+        perror("sendmsg");
+        return false;
+    }
+    // 2.热点URL列表
+    std::string hot;
+    int count = hot_urls::dump(hot, MAX_HOT);
+    hot += '\n';
+    size_t sent = 0;
+    while (sent < hot.size()) {
+        ssize_t n = send(conn, hot.data() + sent, hot.size() - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return false;
+        }
+        sent += n;
+    }
+    printf("监听套接字和 %d 个热点URL已交给新进程\n", count);
+    return true;
+}
+
+bool handoff::is_ready(int conn) {
+    char byte;
+    return recv(conn, &byte, 1, 0) == 1 && byte == READY;
+}
@@ -0,0 +1,37 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <string>
+
+/*
+ * 平滑升级: 新进程从旧进程接过监听套接字, 监听一直没有关闭, 升级期间到来的连接都有进程accept.
+ * 以-U path启动的服务器在Unix域套接字path上等待新进程(控制套接字). 升级时以相同的-U path启动新进程:
+ * 1.新进程先连接path(take). 连接成功说明有旧进程在运行, 旧进程(give)用SCM_RIGHTS把监听套接字
+ *   发过来, 随后发送热点URL列表(见hot_urls.h, 每行"计数 URL", 以空行结束). 连接失败时新进程
+ *   按通常的方式创建监听套接字;
+ * 2.新进程按列表预热文件系统的元数据缓存和页缓存, 把监听套接字加入自己的epoll实例, 然后回复一个
+ *   字节(ready). 在此之前两个进程都在accept同一个监听套接字, 旧进程照常服务;
+ * 3.旧进程收到回复后停止accept, 关闭控制套接字, 进入排空: 空闲的keep-alive连接立即关闭, 其余连接
+ *   的应答改为Connection: close, 发完即关闭. 所有连接都关闭, 或者超过排空时间后, 旧进程退出.
+ *   新进程没有回复就断开时(例如启动失败), 旧进程继续服务;
+ * 4.新进程重新绑定path(listen), 等待下一次升级.
+ */
+class handoff {
+public:
+    static const int MAX_HOT = 512;  // 交给新进程预热的热点URL的最大数量
+
+    // 新进程: 连接path上的旧进程, 接过监听套接字(lfd)和热点URL列表(hot).
+    // 返回与旧进程的控制连接; 没有旧进程时返回-1; 连接上了但交接失败时返回-2
+    static int take(const char* path, int* lfd, std::string& hot);
+    // 新进程: 预热完成, 通知旧进程停止accept, 并关闭控制连接
+    static void ready(int conn);
+
+    // 在path上创建控制套接字, 等待下一个新进程. 失败时返回-1
+    static int listen(const char* path);
+    // 旧进程: 在从控制套接字accept到的连接conn上发送监听套接字lfd和热点URL列表. 失败时返回false
+    static bool give(int conn, int lfd);
+    // 旧进程: 控制连接可读时调用. 返回true表示新进程已就绪, false表示新进程断开了
+    static bool is_ready(int conn);
+};
+
+#endif
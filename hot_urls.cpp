@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "hot_urls.h"
+
+hot_urls::slot hot_urls::s_slots[SLOTS];
+locker hot_urls::s_locks[STRIPES];
+
+void hot_urls::record(const char* url, size_t len, uint32_t weight) {
+    if (len == 0 || len > URL_LEN) {
+        return;
+    }
+    int i = hash(url, len) & (SLOTS - 1);
+    slot& s = s_slots[i];
+    locker& lock = s_locks[i % STRIPES];
+    lock.lock();
+    if (s.len == len && memcmp(s.url, url, len) == 0) {
+        s.count += weight;
+    } else if (s.count > weight) {
+        s.count -= weight;
+    } else {
+        // 槽位中原来的URL被挤掉
+        memcpy(s.url, url, len);
+        s.len = len;
+        s.count = weight;
+    }
+    lock.unlock();
+}
+
+int hot_urls::dump(std::string& out, int max) {
+    std::vector<std::pair<uint32_t, std::string> > urls;
+    for (int i = 0; i < SLOTS; i++) {
+        const slot& s = s_slots[i];
+        locker& lock = s_locks[i % STRIPES];
+        lock.lock();
+        if (s.count > 0) {
+            urls.push_back(std::make_pair(s.count, std::string(s.url, s.len)));
+        }
+        lock.unlock();
+    }
+    std::sort(urls.begin(), urls.end(), [](const std::pair<uint32_t, std::string>& a, const std::pair<uint32_t, std::string>& b) {
+        return a.first > b.first;
+    });
+    int n = (int)urls.size() < max ? (int)urls.size() : max;
+    for (int i = 0; i < n; i++) {
+        char count[16];
+        snprintf(count, sizeof(count), "%u ", urls[i].first);
+        out += count;
+        out += urls[i].second;
+        out += '\n';
+    }
+    return n;
+}
+
+uint64_t hot_urls::hash(const char* s, size_t len) {
+    uint64_t h = 14695981039346656037ull;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
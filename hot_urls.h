@@ -0,0 +1,41 @@
+#ifndef HOT_URLS_H
+#define HOT_URLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include "locker.h"
+
+/*
+ * 热点URL: 近似地记录从文件系统提供的请求中最常被访问的URL, 平滑升级时交给新进程预热(见handoff.h).
+ * 资源仓库命中的请求不需要访问文件系统, 新进程启动时自己会加载资源仓库, 因此不记录.
+ * 1.容量固定: SLOTS个槽位, 以URL的哈希值选择槽位, 每个槽位只保存一个URL. 槽位按哈希值分成STRIPES组,
+ *   每组一把锁;
+ * 2.访问的URL与槽位中的相同时计数加1, 不同时计数减1, 减到0后由新的URL占据这个槽位. 这样偶尔访问的
+ *   URL很快被挤掉, 频繁访问的URL留在槽位中, 计数近似反映访问次数.
+ */
+class hot_urls {
+public:
+    static const int SLOTS = 1024;  // 槽位数, 必须是2的幂
+    static const int STRIPES = 64;  // 锁的数量
+    static const int URL_LEN = 120;  // 能被记录的URL的最大长度(使每个槽位为128字节)
+
+    // 记录一次对url的访问, weight为访问次数. 由工作线程调用
+    static void record(const char* url, size_t len, uint32_t weight = 1);
+    // 按计数从大到小把最多max个URL追加到out, 每行"计数 URL"
+    static int dump(std::string& out, int max);
+
+private:
+    struct slot {
+        uint32_t count;
+        uint32_t len;
+        char url[URL_LEN];
+    };
+
+    static uint64_t hash(const char* s, size_t len);
+
+    static slot s_slots[SLOTS];
+    static locker s_locks[STRIPES];
+};
+
+#endif
@@ -0,0 +1,506 @@
+#include <string.h>
+#include "hpack.h"
+
+// 静态表(RFC 7541 附录A), 下标从1开始
+static const struct {
+    const char* name;
+    const char* value;
+} static_table[hpack_table::STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Huffman码表(RFC 7541 附录B): 每个符号的编码(右对齐)及其位数, 第256项为EOS
+static const struct {
+    uint32_t code;
+    int bits;
+} huffman_codes[257] = {
+    {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
+    {0x0fffffe4, 28}, {0x0fffffe5, 28}, {0x0fffffe6, 28}, {0x0fffffe7, 28},
+    {0x0fffffe8, 28}, {0x00ffffea, 24}, {0x3ffffffc, 30}, {0x0fffffe9, 28},
+    {0x0fffffea, 28}, {0x3ffffffd, 30}, {0x0fffffeb, 28}, {0x0fffffec, 28},
+    {0x0fffffed, 28}, {0x0fffffee, 28}, {0x0fffffef, 28}, {0x0ffffff0, 28},
+    {0x0ffffff1, 28}, {0x0ffffff2, 28}, {0x3ffffffe, 30}, {0x0ffffff3, 28},
+    {0x0ffffff4, 28}, {0x0ffffff5, 28}, {0x0ffffff6, 28}, {0x0ffffff7, 28},
+    {0x0ffffff8, 28}, {0x0ffffff9, 28}, {0x0ffffffa, 28}, {0x0ffffffb, 28},
+    {0x00000014,  6}, {0x000003f8, 10}, {0x000003f9, 10}, {0x00000ffa, 12},
+    {0x00001ff9, 13}, {0x00000015,  6}, {0x000000f8,  8}, {0x000007fa, 11},
+    {0x000003fa, 10}, {0x000003fb, 10}, {0x000000f9,  8}, {0x000007fb, 11},
+    {0x000000fa,  8}, {0x00000016,  6}, {0x00000017,  6}, {0x00000018,  6},
+    {0x00000000,  5}, {0x00000001,  5}, {0x00000002,  5}, {0x00000019,  6},
+    {0x0000001a,  6}, {0x0000001b,  6}, {0x0000001c,  6}, {0x0000001d,  6},
+    {0x0000001e,  6}, {0x0000001f,  6}, {0x0000005c,  7}, {0x000000fb,  8},
+    {0x00007ffc, 15}, {0x00000020,  6}, {0x00000ffb, 12}, {0x000003fc, 10},
+    {0x00001ffa, 13}, {0x00000021,  6}, {0x0000005d,  7}, {0x0000005e,  7},
+    {0x0000005f,  7}, {0x00000060,  7}, {0x00000061,  7}, {0x00000062,  7},
+    {0x00000063,  7}, {0x00000064,  7}, {0x00000065,  7}, {0x00000066,  7},
+    {0x00000067,  7}, {0x00000068,  7}, {0x00000069,  7}, {0x0000006a,  7},
+    {0x0000006b,  7}, {0x0000006c,  7}, {0x0000006d,  7}, {0x0000006e,  7},
+    {0x0000006f,  7}, {0x00000070,  7}, {0x00000071,  7}, {0x00000072,  7},
+    {0x000000fc,  8}, {0x00000073,  7}, {0x000000fd,  8}, {0x00001ffb, 13},
+    {0x0007fff0, 19}, {0x00001ffc, 13}, {0x00003ffc, 14}, {0x00000022,  6},
+    {0x00007ffd, 15}, {0x00000003,  5}, {0x00000023,  6}, {0x00000004,  5},
+    {0x00000024,  6}, {0x00000005,  5}, {0x00000025,  6}, {0x00000026,  6},
+    {0x00000027,  6}, {0x00000006,  5}, {0x00000074,  7}, {0x00000075,  7},
+    {0x00000028,  6}, {0x00000029,  6}, {0x0000002a,  6}, {0x00000007,  5},
+    {0x0000002b,  6}, {0x00000076,  7}, {0x0000002c,  6}, {0x00000008,  5},
+    {0x00000009,  5}, {0x0000002d,  6}, {0x00000077,  7}, {0x00000078,  7},
+    {0x00000079,  7}, {0x0000007a,  7}, {0x0000007b,  7}, {0x00007ffe, 15},
+    {0x000007fc, 11}, {0x00003ffd, 14}, {0x00001ffd, 13}, {0x0ffffffc, 28},
+    {0x000fffe6, 20}, {0x003fffd2, 22}, {0x000fffe7, 20}, {0x000fffe8, 20},
+    {0x003fffd3, 22}, {0x003fffd4, 22}, {0x003fffd5, 22}, {0x007fffd9, 23},
+    {0x003fffd6, 22}, {0x007fffda, 23}, {0x007fffdb, 23}, {0x007fffdc, 23},
+    {0x007fffdd, 23}, {0x007fffde, 23}, {0x00ffffeb, 24}, {0x007fffdf, 23},
+    {0x00ffffec, 24}, {0x00ffffed, 24}, {0x003fffd7, 22}, {0x007fffe0, 23},
+    {0x00ffffee, 24}, {0x007fffe1, 23}, {0x007fffe2, 23}, {0x007fffe3, 23},
+    {0x007fffe4, 23}, {0x001fffdc, 21}, {0x003fffd8, 22}, {0x007fffe5, 23},
+    {0x003fffd9, 22}, {0x007fffe6, 23}, {0x007fffe7, 23}, {0x00ffffef, 24},
+    {0x003fffda, 22}, {0x001fffdd, 21}, {0x000fffe9, 20}, {0x003fffdb, 22},
+    {0x003fffdc, 22}, {0x007fffe8, 23}, {0x007fffe9, 23}, {0x001fffde, 21},
+    {0x007fffea, 23}, {0x003fffdd, 22}, {0x003fffde, 22}, {0x00fffff0, 24},
+    {0x001fffdf, 21}, {0x003fffdf, 22}, {0x007fffeb, 23}, {0x007fffec, 23},
+    {0x001fffe0, 21}, {0x001fffe1, 21}, {0x003fffe0, 22}, {0x001fffe2, 21},
+    {0x007fffed, 23}, {0x003fffe1, 22}, {0x007fffee, 23}, {0x007fffef, 23},
+    {0x000fffea, 20}, {0x003fffe2, 22}, {0x003fffe3, 22}, {0x003fffe4, 22},
+    {0x007ffff0, 23}, {0x003fffe5, 22}, {0x003fffe6, 22}, {0x007ffff1, 23},
+    {0x03ffffe0, 26}, {0x03ffffe1, 26}, {0x000fffeb, 20}, {0x0007fff1, 19},
+    {0x003fffe7, 22}, {0x007ffff2, 23}, {0x003fffe8, 22}, {0x01ffffec, 25},
+    {0x03ffffe2, 26}, {0x03ffffe3, 26}, {0x03ffffe4, 26}, {0x07ffffde, 27},
+    {0x07ffffdf, 27}, {0x03ffffe5, 26}, {0x00fffff1, 24}, {0x01ffffed, 25},
+    {0x0007fff2, 19}, {0x001fffe3, 21}, {0x03ffffe6, 26}, {0x07ffffe0, 27},
+    {0x07ffffe1, 27}, {0x03ffffe7, 26}, {0x07ffffe2, 27}, {0x00fffff2, 24},
+    {0x001fffe4, 21}, {0x001fffe5, 21}, {0x03ffffe8, 26}, {0x03ffffe9, 26},
+    {0x0ffffffd, 28}, {0x07ffffe3, 27}, {0x07ffffe4, 27}, {0x07ffffe5, 27},
+    {0x000fffec, 20}, {0x00fffff3, 24}, {0x000fffed, 20}, {0x001fffe6, 21},
+    {0x003fffe9, 22}, {0x001fffe7, 21}, {0x001fffe8, 21}, {0x007ffff3, 23},
+    {0x003fffea, 22}, {0x003fffeb, 22}, {0x01ffffee, 25}, {0x01ffffef, 25},
+    {0x00fffff4, 24}, {0x00fffff5, 24}, {0x03ffffea, 26}, {0x007ffff4, 23},
+    {0x03ffffeb, 26}, {0x07ffffe6, 27}, {0x03ffffec, 26}, {0x03ffffed, 26},
+    {0x07ffffe7, 27}, {0x07ffffe8, 27}, {0x07ffffe9, 27}, {0x07ffffea, 27},
+    {0x07ffffeb, 27}, {0x0ffffffe, 28}, {0x07ffffec, 27}, {0x07ffffed, 27},
+    {0x07ffffee, 27}, {0x07ffffef, 27}, {0x07fffff0, 27}, {0x03ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+/*
+ * Huffman解码树. 第一次使用时由码表构造, 之后只读.
+ * 每个内部结点有两个孩子, 值 >= 0 表示孩子结点的下标, 值 < 0 表示叶子, 符号为 -(值) - 1.
+ */
+struct huffman_tree {
+    short child[512][2];
+    int count;
+
+    huffman_tree(): count(1) {
+        memset(child, 0, sizeof(child));
+        for (int sym = 0; sym < 257; sym++) {
+            int node = 0;
+            for (int i = huffman_codes[sym].bits - 1; i >= 0; i--) {
+                int bit = (huffman_codes[sym].code >> i) & 1;
+                if (i == 0) {
+                    child[node][bit] = (short)(-sym - 1);
+                } else {
+                    if (child[node][bit] == 0) {
+                        child[node][bit] = (short)count++;
+                    }
+                    node = child[node][bit];
+                }
+            }
+        }
+    }
+};
+
+int hpack_huffman_decode(const uint8_t* data, size_t len, char* out, int out_size) {
+    static const huffman_tree tree;  // C++11保证局部静态变量的初始化是线程安全的
+    int node = 0;
+    int depth = 0;  // 当前未完成符号已消耗的位数, 用于检查末尾填充
+    bool all_ones = true;  // 当前未完成符号的各位是否都是1
+    int n = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = (data[i] >> b) & 1;
+            short next = tree.child[node][bit];
+            all_ones = all_ones && bit;
+            depth++;
+            if (next < 0) {
+                int sym = -next - 1;
+                if (sym == 256 || n >= out_size) {  // 字符串中出现EOS是解码错误
+                    return -1;
+                }
+                out[n++] = (char)sym;
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            } else {
+                node = next;
+            }
+        }
+    }
+    // 末尾的填充必须是EOS的前缀(全1), 且不能超过7位
+    if (depth > 7 || !all_ones) {
+        return -1;
+    }
+    return n;
+}
+
+int hpack_encode_int(uint8_t* out, size_t out_size, uint32_t value, int prefix, uint8_t first_byte) {
+    uint32_t max_prefix = (1u << prefix) - 1;
+    size_t n = 0;
+    if (out_size < 1) {
+        return -1;
+    }
+    if (value < max_prefix) {
+        out[n++] = first_byte | (uint8_t)value;
+        return (int)n;
+    }
+    out[n++] = first_byte | (uint8_t)max_prefix;
+    value -= max_prefix;
+    while (value >= 128) {
+        if (n >= out_size) {
+            return -1;
+        }
+        out[n++] = (uint8_t)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    if (n >= out_size) {
+        return -1;
+    }
+    out[n++] = (uint8_t)value;
+    return (int)n;
+}
+
+bool hpack_decode_int(const uint8_t*& p, const uint8_t* end, int prefix, uint32_t* value) {
+    if (p >= end) {
+        return false;
+    }
+    uint32_t max_prefix = (1u << prefix) - 1;
+    uint32_t v = *p++ & max_prefix;
+    if (v < max_prefix) {
+        *value = v;
+        return true;
+    }
+    int shift = 0;
+    while (p < end) {
+        uint8_t b = *p++;
+        if (shift > 21) {  // 超过28位, 视为溢出
+            return false;
+        }
+        v += (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* ---------------------------- hpack_table ---------------------------- */
+
+hpack_table::hpack_table(): m_head(0), m_tail(0), m_first(0), m_count(0), m_size(0), m_max_size(MAX_TABLE_SIZE) {
+}
+
+bool hpack_table::get(uint32_t index, const char** name, int* name_len, const char** value, int* value_len) const {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= STATIC_COUNT) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+    uint32_t i = index - STATIC_COUNT - 1;  // 0为最新的条目
+    if (i >= (uint32_t)m_count) {
+        return false;
+    }
+    const entry& e = m_entries[(m_first + m_count - 1 - i) % MAX_ENTRIES];
+    *name = m_data + e.offset;
+    *name_len = e.name_len;
+    *value = m_data + e.offset + e.name_len;
+    *value_len = e.value_len;
+    return true;
+}
+
+void hpack_table::evict_one() {
+    const entry& e = m_entries[m_first];
+    m_size -= e.name_len + e.value_len + ENTRY_OVERHEAD;
+    m_head = e.offset + e.name_len + e.value_len;
+    m_first = (m_first + 1) % MAX_ENTRIES;
+    m_count--;
+    if (m_count == 0) {
+        m_head = m_tail = 0;
+    }
+}
+
+void hpack_table::add(const char* name, int name_len, const char* value, int value_len) {
+    uint32_t size = name_len + value_len + ENTRY_OVERHEAD;
+    // 1.淘汰旧条目, 直到新条目能放下
+    while (m_count > 0 && m_size + size > m_max_size) {
+        evict_one();
+    }
+    // 2.条目比整张表还大时, 结果是一张空表(RFC 7541 4.4)
+    if (size > m_max_size) {
+        return;
+    }
+    // 3.尾部空间不足时, 把活跃数据整体挪到数组开头
+    int len = name_len + value_len;
+    if (m_tail + len > MAX_TABLE_SIZE) {
+        memmove(m_data, m_data + m_head, m_tail - m_head);
+        for (int i = 0; i < m_count; i++) {
+            m_entries[(m_first + i) % MAX_ENTRIES].offset -= m_head;
+        }
+        m_tail -= m_head;
+        m_head = 0;
+    }
+    // 4.写入新条目
+    entry& e = m_entries[(m_first + m_count) % MAX_ENTRIES];
+    e.offset = m_tail;
+    e.name_len = name_len;
+    e.value_len = value_len;
+    memcpy(m_data + m_tail, name, name_len);
+    memcpy(m_data + m_tail + name_len, value, value_len);
+    m_tail += len;
+    m_count++;
+    m_size += size;
+}
+
+bool hpack_table::set_max_size(uint32_t max_size) {
+    if (max_size > MAX_TABLE_SIZE) {
+        return false;
+    }
+    m_max_size = max_size;
+    while (m_count > 0 && m_size > m_max_size) {
+        evict_one();
+    }
+    return true;
+}
+
+uint32_t hpack_table::find(const char* name, int name_len, const char* value, int value_len, bool* exact) const {
+    uint32_t name_index = 0;
+    *exact = false;
+    // 先查动态表(新条目优先), 再查静态表
+    for (int i = 0; i < m_count; i++) {
+        const entry& e = m_entries[(m_first + m_count - 1 - i) % MAX_ENTRIES];
+        if (e.name_len == name_len && memcmp(m_data + e.offset, name, name_len) == 0) {
+            if (e.value_len == value_len && memcmp(m_data + e.offset + name_len, value, value_len) == 0) {
+                *exact = true;
+                return STATIC_COUNT + 1 + i;
+            }
+            if (!name_index) {
+                name_index = STATIC_COUNT + 1 + i;
+            }
+        }
+    }
+    for (int i = 0; i < STATIC_COUNT; i++) {
+        if (strncmp(static_table[i].name, name, name_len) == 0 && static_table[i].name[name_len] == '\0') {
+            if (strncmp(static_table[i].value, value, value_len) == 0 && static_table[i].value[value_len] == '\0') {
+                *exact = true;
+                return i + 1;
+            }
+            if (!name_index) {
+                name_index = i + 1;
+            }
+        }
+    }
+    return name_index;
+}
+
+/* ---------------------------- hpack_decoder ---------------------------- */
+
+bool hpack_decoder::read_string(const uint8_t*& p, const uint8_t* end, char* out, int out_size, int* out_len) {
+    if (p >= end) {
+        return false;
+    }
+    bool huffman = (*p & 0x80) != 0;
+    uint32_t len = 0;
+    if (!hpack_decode_int(p, end, 7, &len) || len > (uint32_t)(end - p)) {
+        return false;
+    }
+    if (huffman) {
+        int n = hpack_huffman_decode(p, len, out, out_size);
+        if (n < 0) {
+            return false;
+        }
+        *out_len = n;
+    } else {
+        if (len > (uint32_t)out_size) {
+            return false;
+        }
+        memcpy(out, p, len);
+        *out_len = len;
+    }
+    p += len;
+    return true;
+}
+
+bool hpack_decoder::decode(const uint8_t* data, size_t len, header_cb on_header, void* arg) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    while (p < end) {
+        uint8_t b = *p;
+        const char* name = 0;
+        const char* value = 0;
+        int name_len = 0;
+        int value_len = 0;
+        uint32_t index = 0;
+        if (b & 0x80) {
+            // 1.索引字段: 1xxxxxxx
+            if (!hpack_decode_int(p, end, 7, &index) || !m_table.get(index, &name, &name_len, &value, &value_len)) {
+                return false;
+            }
+            on_header(arg, name, name_len, value, value_len);
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {
+            // 2.动态表大小更新: 001xxxxx
+            uint32_t size = 0;
+            if (!hpack_decode_int(p, end, 5, &size) || size > m_limit || !m_table.set_max_size(size)) {
+                return false;
+            }
+            continue;
+        }
+        // 3.字面量字段: 带增量索引01xxxxxx, 不索引0000xxxx, 永不索引0001xxxx
+        bool indexing = (b & 0xc0) == 0x40;
+        if (!hpack_decode_int(p, end, indexing ? 6 : 4, &index)) {
+            return false;
+        }
+        if (index) {
+            const char* v;
+            int vl;
+            if (!m_table.get(index, &name, &name_len, &v, &vl)) {
+                return false;
+            }
+            // name可能指向动态表内部, 插入新条目时可能被挪动, 先拷贝出来
+            memcpy(m_name, name, name_len);
+        } else if (!read_string(p, end, m_name, STRING_BUF_SIZE, &name_len)) {
+            return false;
+        }
+        if (!read_string(p, end, m_value, STRING_BUF_SIZE, &value_len)) {
+            return false;
+        }
+        if (indexing) {
+            m_table.add(m_name, name_len, m_value, value_len);
+        }
+        on_header(arg, m_name, name_len, m_value, value_len);
+    }
+    return true;
+}
+
+/* ---------------------------- hpack_encoder ---------------------------- */
+
+void hpack_encoder::set_peer_table_size(uint32_t size) {
+    if (size > hpack_table::MAX_TABLE_SIZE) {
+        size = hpack_table::MAX_TABLE_SIZE;  // 对端允许得更大也没关系, 本端最多只用4096
+    }
+    if (size != m_table.max_size()) {
+        m_table.set_max_size(size);
+        m_pending_size = true;
+    }
+}
+
+int hpack_encoder::begin(uint8_t* out, size_t out_size) {
+    if (!m_pending_size) {
+        return 0;
+    }
+    int n = hpack_encode_int(out, out_size, m_table.max_size(), 5, 0x20);
+    if (n > 0) {
+        m_pending_size = false;
+    }
+    return n;
+}
+
+int hpack_encoder::encode(uint8_t* out, size_t out_size, const char* name, const char* value, bool indexing) {
+    int name_len = strlen(name);
+    int value_len = strlen(value);
+    bool exact = false;
+    uint32_t index = m_table.find(name, name_len, value, value_len, &exact);
+    // 1.完全匹配, 只需输出下标
+    if (exact) {
+        return hpack_encode_int(out, out_size, index, 7, 0x80);
+    }
+    // 2.字面量: 先输出name(下标或原文), 再输出value原文
+    int n = hpack_encode_int(out, out_size, index, indexing ? 6 : 4, indexing ? 0x40 : 0x00);
+    if (n < 0) {
+        return -1;
+    }
+    if (!index) {
+        int m = hpack_encode_int(out + n, out_size - n, name_len, 7, 0x00);
+        if (m < 0 || (size_t)(n + m + name_len) > out_size) {
+            return -1;
+        }
+        n += m;
+        memcpy(out + n, name, name_len);
+        n += name_len;
+    }
+    int m = hpack_encode_int(out + n, out_size - n, value_len, 7, 0x00);
+    if (m < 0 || (size_t)(n + m + value_len) > out_size) {
+        return -1;
+    }
+    n += m;
+    memcpy(out + n, value, value_len);
+    n += value_len;
+    if (indexing) {
+        m_table.add(name, name_len, value, value_len);
+    }
+    return n;
+}
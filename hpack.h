@@ -0,0 +1,99 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * HPACK(RFC 7541)头部压缩, 供HTTP/2使用.
+ * 1.静态表: 61个固定条目, 下标从1开始;
+ * 2.动态表: 先进先出, 新条目的下标为62, 越旧下标越大. 表的总大小为每个条目的
+ *   name长度 + value长度 + 32之和, 不能超过对端通过SETTINGS_HEADER_TABLE_SIZE允许的值;
+ * 3.字符串既可以是原文, 也可以是Huffman编码. 解码器两者都支持, 编码器只输出原文.
+ * 整个实现不做堆内存分配: 动态表使用固定大小的字节数组和条目数组.
+ */
+
+// 动态表. 编码器和解码器各自维护一张, 两端的表必须保持同步
+class hpack_table {
+public:
+    static const int STATIC_COUNT = 61;  // 静态表条目数
+    static const int MAX_TABLE_SIZE = 4096;  // 本实现支持的最大动态表大小
+    static const int MAX_ENTRIES = MAX_TABLE_SIZE / 32;  // 动态表最多能容纳的条目数
+    static const int ENTRY_OVERHEAD = 32;  // 每个条目的额外开销(RFC 7541 4.1)
+
+    hpack_table();
+    // 按HPACK下标获取条目(1~61为静态表, 62及以上为动态表), 下标非法时返回false
+    bool get(uint32_t index, const char** name, int* name_len, const char** value, int* value_len) const;
+    // 插入新条目, 必要时从最旧的条目开始淘汰
+    void add(const char* name, int name_len, const char* value, int value_len);
+    // 修改动态表的最大大小, 并淘汰超出部分
+    bool set_max_size(uint32_t max_size);
+    uint32_t max_size() const { return m_max_size; }
+    // 在静态表和动态表中查找条目, 完全匹配时返回下标并令*exact = true,
+    // 只有name匹配时返回name的下标并令*exact = false, 找不到时返回0
+    uint32_t find(const char* name, int name_len, const char* value, int value_len, bool* exact) const;
+
+private:
+    struct entry {
+        int offset;  // 在m_data中的起始位置, name之后紧跟value
+        int name_len;
+        int value_len;
+    };
+    void evict_one();  // 淘汰最旧的条目
+
+    char m_data[MAX_TABLE_SIZE];  // 条目的name和value, 活跃数据总是连续地存放在[m_head, m_tail)
+    int m_head;
+    int m_tail;
+    entry m_entries[MAX_ENTRIES];  // 环形数组, m_first为最旧的条目
+    int m_first;
+    int m_count;
+    uint32_t m_size;  // 当前表大小(按RFC 7541计算)
+    uint32_t m_max_size;  // 最大表大小
+};
+
+// 解码器. decode()对一个完整的头部块逐个回调on_header
+class hpack_decoder {
+public:
+    typedef void (*header_cb)(void* arg, const char* name, int name_len, const char* value, int value_len);
+
+    hpack_decoder(): m_limit(hpack_table::MAX_TABLE_SIZE) {}
+    // 解码成功返回true; 出现压缩错误(COMPRESSION_ERROR)返回false
+    bool decode(const uint8_t* data, size_t len, header_cb on_header, void* arg);
+
+private:
+    static const int STRING_BUF_SIZE = 4096;  // 解码出的字符串的暂存区大小
+
+    // 读出一个字符串(可能是Huffman编码的)到out中, 返回false表示出错
+    bool read_string(const uint8_t*& p, const uint8_t* end, char* out, int out_size, int* out_len);
+
+    hpack_table m_table;
+    uint32_t m_limit;  // 本端通过SETTINGS允许的动态表大小上限
+    char m_name[STRING_BUF_SIZE];
+    char m_value[STRING_BUF_SIZE];
+};
+
+// 编码器
+class hpack_encoder {
+public:
+    hpack_encoder(): m_pending_size(false) {}
+    // 对端修改了SETTINGS_HEADER_TABLE_SIZE, 下一个头部块开头需要发送动态表大小更新
+    void set_peer_table_size(uint32_t size);
+    // 开始一个新的头部块, 返回写入的字节数(可能需要写入动态表大小更新), 空间不够时返回-1
+    int begin(uint8_t* out, size_t out_size);
+    /* 编码一个头部字段, 返回写入的字节数, 空间不够时返回-1.
+     * indexing为true时, 以"带增量索引的字面量"编码, 之后相同的字段只需一个字节. */
+    int encode(uint8_t* out, size_t out_size, const char* name, const char* value, bool indexing);
+
+private:
+    hpack_table m_table;
+    bool m_pending_size;  // 是否有待发送的动态表大小更新
+};
+
+// HPACK整数编码, prefix为前缀位数, first_byte为首字节中前缀之外的高位标志, 返回写入的字节数, 空间不够时返回-1
+int hpack_encode_int(uint8_t* out, size_t out_size, uint32_t value, int prefix, uint8_t first_byte);
+// HPACK整数解码, 失败返回false
+bool hpack_decode_int(const uint8_t*& p, const uint8_t* end, int prefix, uint32_t* value);
+// Huffman解码, 返回解码后的长度, 出错返回-1
+int hpack_huffman_decode(const uint8_t* data, size_t len, char* out, int out_size);
+
+#endif
@@ -0,0 +1,855 @@
+#include "http2_session.h"
+#include "rate_limiter.h"
+#include "url.h"
+#include "transport.h"
+
+extern const char* error_400_form;
+extern const char* error_403_form;
+extern const char* error_404_form;
+extern const char* error_429_form;
+extern const char* error_500_form;
+extern const char* error_502_form;
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// 帧标志
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+// SETTINGS参数
+static const uint16_t SETTINGS_HEADER_TABLE_SIZE = 0x1;
+static const uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+static const uint16_t SETTINGS_MAX_FRAME_SIZE = 0x5;
+
+static const int64_t MAX_WINDOW = 0x7fffffff;
+
+static inline uint32_t get_u32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// 写9字节的帧头
+static inline void put_frame_header(uint8_t* p, uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put_u32(p + 5, stream_id & 0x7fffffff);
+}
+
+// base64url解码(HTTP2-Settings首部), 出错返回-1
+static int base64url_decode(const char* in, uint8_t* out, int out_size) {
+    uint32_t acc = 0;
+    int bits = 0;
+    int n = 0;
+    for (; *in && *in != '='; in++) {
+        int v;
+        char c = *in;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n >= out_size) {
+                return -1;
+            }
+            out[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    return n;
+}
+
+int http2_session::check_preface(const char* buf, int len) {
+    int n = len < PREFACE_LEN ? len : PREFACE_LEN;
+    if (memcmp(buf, preface, n) != 0) {
+        return -1;
+    }
+    return n == PREFACE_LEN ? 1 : 0;
+}
+
+http2_session::http2_session(http_conn* conn):
+    m_conn(conn),
+    m_expect_preface(true),
+    m_closing(false),
+    m_peer_goaway(false),
+    m_goaway_sent(false),
+    m_write_shut(false),
+    m_last_stream_id(0),
+    m_skip(0),
+    m_in_len(0),
+    m_send_window(DEFAULT_WINDOW),
+    m_peer_initial_window(DEFAULT_WINDOW),
+    m_peer_max_frame(MAX_FRAME_SIZE),
+    m_header_len(0),
+    m_continuation_stream(0),
+    m_header_end_stream(false),
+    m_bad_header(false),
+    m_rr(0),
+    m_ctrl_len(0),
+    m_frame_len(0),
+    m_iov_count(0),
+    m_iov_index(0)
+{
+    memset(m_streams, 0, sizeof(m_streams));
+}
+
+http2_session::~http2_session() {
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (m_streams[i].id) {
+            release_stream(m_streams + i);
+        }
+    }
+}
+
+void http2_session::start() {
+    queue_settings();
+}
+
+bool http2_session::upgrade(const char* settings, http_conn::HTTP_CODE ret) {
+    // 1.应用HTTP2-Settings首部中的参数(base64url编码的SETTINGS帧负载)
+    uint8_t payload[64];
+    int len = settings ? base64url_decode(settings, payload, sizeof(payload)) : 0;
+    if (len < 0 || len % 6 != 0) {
+        return false;
+    }
+    handle_settings(0, payload, len);
+    m_ctrl_len = 0;  // 升级请求中的SETTINGS不需要ACK
+    // 2.回复101, 紧接着发送服务器的SETTINGS
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    memcpy(m_ctrl, switching, sizeof(switching) - 1);
+    m_ctrl_len = sizeof(switching) - 1;
+    queue_settings();
+    // 3.升级前的请求成为流1, 它已经处于半关闭(远端)状态
+    m_last_stream_id = 1;
+    open_stream(1, ret);
+    stream* s = find_stream(1);
+    if (s) {
+        s->start_time = m_conn->m_cold->m_start_time;  // 从读到升级请求时算起
+    }
+    // 4.请求之后可能紧跟着客户端的连接序言, 把它们挪到读缓冲区开头
+    http_conn::cold_data* cold = m_conn->m_cold;
+    int rest = m_conn->m_read_index - m_conn->m_checked_index;
+    memmove(cold->m_read_buf, cold->m_read_buf + m_conn->m_checked_index, rest);
+    m_conn->m_read_index = rest;
+    m_conn->m_checked_index = 0;
+    m_conn->m_start_line = 0;
+    return true;
+}
+
+bool http2_session::process() {
+    char* buf = m_conn->m_cold->m_read_buf;
+    int len = m_conn->m_read_index;
+    int pos = 0;
+
+    // 已关闭写方向: 丢弃对端还在发送的帧, 等待它关闭连接
+    if (m_write_shut) {
+        return linger();
+    }
+
+    // 1.检查客户端连接序言(升级时, 101应答要先发出去, 序言可能还没到)
+    if (m_expect_preface) {
+        int ret = check_preface(buf, len);
+        if (ret < 0) {
+            connection_error(PROTOCOL_ERROR);
+        } else if (ret == 1) {
+            m_expect_preface = false;
+            pos = PREFACE_LEN;
+        }
+    }
+
+    // 2.逐帧处理
+    while (!m_closing && !m_expect_preface && pos < len) {
+        // 2-1 丢弃上一个DATA帧尚未读到的负载
+        if (m_skip) {
+            uint32_t n = (uint32_t)(len - pos) < m_skip ? (uint32_t)(len - pos) : m_skip;
+            m_skip -= n;
+            pos += n;
+            continue;
+        }
+        // 2-2 继续拼接读缓冲区放不下的帧, 拼完整后处理
+        if (m_in_len) {
+            uint32_t flen = ((uint32_t)m_in_frame[0] << 16) | ((uint32_t)m_in_frame[1] << 8) | m_in_frame[2];
+            uint32_t need = 9 + flen - m_in_len;
+            uint32_t n = (uint32_t)(len - pos) < need ? (uint32_t)(len - pos) : need;
+            memcpy(m_in_frame + m_in_len, buf + pos, n);
+            m_in_len += n;
+            pos += n;
+            if (m_in_len < 9 + flen) {
+                break;
+            }
+            m_in_len = 0;
+            handle_frame(m_in_frame[3], m_in_frame[4], get_u32(m_in_frame + 5) & 0x7fffffff, m_in_frame + 9, flen);
+            continue;
+        }
+        if (len - pos < 9) {
+            break;
+        }
+        const uint8_t* p = (const uint8_t*)buf + pos;
+        uint32_t flen = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        uint8_t type = p[3];
+        uint8_t flags = p[4];
+        uint32_t stream_id = get_u32(p + 5) & 0x7fffffff;
+        if (flen > (uint32_t)MAX_FRAME_SIZE) {
+            connection_error(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (type == DATA && m_continuation_stream == 0) {
+            // 2-3 DATA帧: 本服务器只处理GET, 请求体直接丢弃, 只需归还流量控制窗口
+            if (stream_id == 0) {
+                connection_error(PROTOCOL_ERROR);
+                break;
+            }
+            if (flen) {
+                queue_window_update(0, flen);
+                if (find_stream(stream_id)) {
+                    queue_window_update(stream_id, flen);
+                }
+            }
+            pos += 9;
+            m_skip = flen;
+            continue;
+        }
+        if ((uint32_t)(len - pos) < 9 + flen) {
+            // 2-4 帧不完整. 读缓冲区放不下这一帧时, 把已经收到的部分移到m_in_frame中拼接, 腾出读缓冲区
+            if (9 + flen > (uint32_t)http_conn::READ_BUFFER_SIZE) {
+                m_in_len = len - pos;
+                memcpy(m_in_frame, p, m_in_len);
+                pos = len;
+            }
+            break;
+        }
+        handle_frame(type, flags, stream_id, p + 9, flen);
+        pos += 9 + flen;
+    }
+
+    // 3.把未处理完的数据挪到读缓冲区开头
+    if (m_closing) {
+        pos = len;
+    }
+    memmove(buf, buf + pos, len - pos);
+    m_conn->m_read_index = len - pos;
+
+    // 4.旧进程正在排空时通知对端. 若当前没有批次在途, 组织新批次, 然后重新注册事件
+    if (http_conn::m_draining.load(std::memory_order_relaxed)) {
+        queue_goaway();
+    }
+    if (m_iov_index >= m_iov_count) {
+        build_batch();
+        if (m_iov_count == 0 && finished()) {
+            return linger();
+        }
+    }
+    arm();
+    return true;
+}
+
+void http2_session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len) {
+    // 头部块没有结束时, 只能收到同一个流的CONTINUATION
+    if (m_continuation_stream && (type != CONTINUATION || stream_id != m_continuation_stream)) {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    switch (type) {
+        case HEADERS: {
+            if (stream_id == 0 || !(stream_id & 1) || stream_id <= m_last_stream_id) {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            // 去掉填充和优先级字段
+            uint32_t pad = 0;
+            if (flags & FLAG_PADDED) {
+                if (len < 1) {
+                    connection_error(PROTOCOL_ERROR);
+                    return;
+                }
+                pad = payload[0];
+                payload++;
+                len--;
+            }
+            if (flags & FLAG_PRIORITY) {
+                if (len < 5) {
+                    connection_error(PROTOCOL_ERROR);
+                    return;
+                }
+                payload += 5;
+                len -= 5;
+            }
+            if (pad > len) {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            len -= pad;
+            m_last_stream_id = stream_id;
+            m_header_end_stream = (flags & FLAG_END_STREAM) != 0;
+            m_header_len = 0;
+            // 把头部块片段追加到m_header_block中
+            [[fallthrough]];
+        }
+        case CONTINUATION: {
+            if (type == CONTINUATION && m_continuation_stream == 0) {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            if (m_header_len + len > (uint32_t)HEADER_BLOCK_SIZE) {
+                connection_error(ENHANCE_YOUR_CALM);
+                return;
+            }
+            memcpy(m_header_block + m_header_len, payload, len);
+            m_header_len += len;
+            if (flags & FLAG_END_HEADERS) {
+                m_continuation_stream = 0;
+                handle_headers_end(stream_id);
+            } else {
+                m_continuation_stream = stream_id;
+            }
+            break;
+        }
+        case PRIORITY: {
+            break;  // 不实现优先级, 所有流公平轮转
+        }
+        case RST_STREAM: {
+            if (stream_id == 0 || len != 4) {
+                connection_error(len != 4 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+                return;
+            }
+            stream* s = find_stream(stream_id);
+            if (s) {
+                s->state = STREAM_DONE;  // 取消这个流, 在批次结束后释放
+            }
+            break;
+        }
+        case SETTINGS: {
+            if (stream_id != 0) {
+                connection_error(PROTOCOL_ERROR);
+                return;
+            }
+            handle_settings(flags, payload, len);
+            break;
+        }
+        case PUSH_PROMISE: {
+            connection_error(PROTOCOL_ERROR);  // 客户端不能推送
+            break;
+        }
+        case PING: {
+            if (stream_id != 0 || len != 8) {
+                connection_error(len != 8 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+                return;
+            }
+            if (!(flags & FLAG_ACK)) {
+                queue_frame(PING, FLAG_ACK, 0, payload, 8);
+            }
+            break;
+        }
+        case GOAWAY: {
+            m_peer_goaway = true;
+            break;
+        }
+        case WINDOW_UPDATE: {
+            handle_window_update(stream_id, payload, len);
+            break;
+        }
+        default: {
+            break;  // 未知类型的帧必须忽略
+        }
+    }
+}
+
+void http2_session::handle_settings(uint8_t flags, const uint8_t* payload, uint32_t len) {
+    if (flags & FLAG_ACK) {
+        if (len != 0) {
+            connection_error(FRAME_SIZE_ERROR);
+        }
+        return;
+    }
+    if (len % 6 != 0) {
+        connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+    for (uint32_t i = 0; i < len; i += 6) {
+        uint16_t id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get_u32(payload + i + 2);
+        switch (id) {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                m_encoder.set_peer_table_size(value);
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > MAX_WINDOW) {
+                    connection_error(FLOW_CONTROL_ERROR);
+                    return;
+                }
+                // 初始窗口的变化量作用于所有已打开的流
+                int64_t delta = (int64_t)value - m_peer_initial_window;
+                for (int k = 0; k < MAX_STREAMS; k++) {
+                    if (m_streams[k].id) {
+                        m_streams[k].window += delta;
+                    }
+                }
+                m_peer_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < 16384 || value > 16777215) {
+                    connection_error(PROTOCOL_ERROR);
+                    return;
+                }
+                m_peer_max_frame = value;
+                break;
+            default:
+                break;
+        }
+    }
+    queue_frame(SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+void http2_session::handle_window_update(uint32_t stream_id, const uint8_t* payload, uint32_t len) {
+    if (len != 4) {
+        connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+    uint32_t increment = get_u32(payload) & 0x7fffffff;
+    if (stream_id == 0) {
+        if (increment == 0 || m_send_window + increment > MAX_WINDOW) {
+            connection_error(increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+            return;
+        }
+        m_send_window += increment;
+        return;
+    }
+    stream* s = find_stream(stream_id);
+    if (!s) {
+        return;  // 已关闭的流上的WINDOW_UPDATE直接忽略
+    }
+    if (increment == 0 || s->window + increment > MAX_WINDOW) {
+        uint8_t code[4];
+        put_u32(code, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        queue_frame(RST_STREAM, 0, stream_id, code, 4);
+        s->state = STREAM_DONE;
+        return;
+    }
+    s->window += increment;
+}
+
+void http2_session::on_header(void* arg, const char* name, int name_len, const char* value, int value_len) {
+    http2_session* session = (http2_session*)arg;
+    if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+        if (value_len >= (int)sizeof(session->m_method)) {
+            session->m_bad_header = true;
+            return;
+        }
+        memcpy(session->m_method, value, value_len);
+        session->m_method[value_len] = '\0';
+    } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+        if (value_len >= (int)sizeof(session->m_path)) {
+            session->m_bad_header = true;
+            return;
+        }
+        memcpy(session->m_path, value, value_len);
+        session->m_path[value_len] = '\0';
+    }
+}
+
+void http2_session::handle_headers_end(uint32_t stream_id) {
+    // 1.解码头部块. 即使这个流随后被拒绝, 也必须解码, 以保持动态表同步
+    m_method[0] = '\0';
+    m_path[0] = '\0';
+    m_bad_header = false;
+    if (!m_decoder.decode(m_header_block, m_header_len, on_header, this)) {
+        connection_error(COMPRESSION_ERROR);
+        return;
+    }
+    // 2.检查流的数量. 发送GOAWAY之后打开的流不再处理, 对端可以在别的连接上重试
+    if (m_goaway_sent || find_stream(0) == NULL) {
+        uint8_t code[4];
+        put_u32(code, REFUSED_STREAM);
+        queue_frame(RST_STREAM, 0, stream_id, code, 4);
+        return;
+    }
+    // 3.与HTTP/1.1相同, 只处理GET; 找到资源后作为新的流进行响应
+    http_conn::HTTP_CODE ret;
+    m_conn->m_url = m_path;
+    m_conn->m_cold->m_target = m_path;
+    m_conn->m_cold->m_accept_gzip = false;  // HTTP/2的应答不使用预压缩的版本
+    if (m_bad_header || strcmp(m_method, "GET") != 0
+        || url_normalize(m_path, strlen(m_path), m_conn->m_cold->m_url_key, http_conn::FILENAME_LEN) < 0) {
+        ret = http_conn::BAD_REQUEST;
+    } else if (!rate_limiter::request(m_conn->m_cold->m_addr.sin_addr.s_addr)) {
+        ret = http_conn::TOO_MANY_REQUESTS;
+    } else {
+        m_conn->m_url = m_conn->m_cold->m_url_key;
+        ret = m_conn->do_request();
+    }
+    open_stream(stream_id, ret);
+}
+
+void http2_session::open_stream(uint32_t id, http_conn::HTTP_CODE ret) {
+    stream* s = NULL;
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (!m_streams[i].id) {
+            s = m_streams + i;
+            break;
+        }
+    }
+    if (!s) {
+        m_conn->unmap();
+        return;
+    }
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->state = STREAM_HEADERS;
+    s->window = m_peer_initial_window;
+    s->mime = "text/html";
+    if (access_log::enabled()) {
+        s->start_time = access_log::now();
+        s->url_len = m_conn->m_url ? strlen(m_conn->m_url) : 0;
+        memcpy(s->url, m_conn->m_url, s->url_len < access_record::URL_LEN ? s->url_len : access_record::URL_LEN);
+    }
+    switch (ret) {
+        case http_conn::FILE_REQUEST:
+            // 接管do_request映射好的文件, 释放流时再munmap
+            s->status = 200;
+            s->mime = m_conn->m_cold->m_mime;
+            s->body = m_conn->m_file_address;
+            s->body_len = m_conn->m_cold->m_file_stat.st_size;
+            if (m_conn->m_asset) {
+                s->asset = m_conn->m_asset;
+            } else {
+                s->file_address = m_conn->m_file_address;
+            }
+            m_conn->m_file_address = 0;
+            m_conn->m_asset = NULL;
+            break;
+        case http_conn::ROUTE_REQUEST:
+            s->status = 200;
+            s->mime = m_conn->m_cold->m_mime;
+            memcpy(s->route_body, m_conn->m_cold->m_route_body, m_conn->m_cold->m_route_len);
+            s->body = s->route_body;
+            s->body_len = m_conn->m_cold->m_route_len;
+            break;
+        case http_conn::BAD_REQUEST:
+            s->status = 400;
+            s->body = error_400_form;
+            break;
+        case http_conn::FORBIDDEN_REQUEST:
+            s->status = 403;
+            s->body = error_403_form;
+            break;
+        case http_conn::NO_RESOURCE:
+            s->status = 404;
+            s->body = error_404_form;
+            break;
+        case http_conn::TOO_MANY_REQUESTS:
+            s->status = 429;
+            s->body = error_429_form;
+            break;
+        case http_conn::PROXY_REQUEST:
+            // 反向代理只支持HTTP/1.1连接
+            s->status = 502;
+            s->body = error_502_form;
+            break;
+        default:
+            s->status = 500;
+            s->body = error_500_form;
+            break;
+    }
+    if (s->status != 200) {
+        s->body_len = strlen(s->body);
+    }
+    m_conn->m_cold->m_mime = "text/html";
+}
+
+http2_session::stream* http2_session::find_stream(uint32_t id) {
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (m_streams[i].id == id) {
+            return m_streams + i;
+        }
+    }
+    return NULL;
+}
+
+bool http2_session::has_active_streams() {
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (m_streams[i].id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void http2_session::release_stream(stream* s) {
+    // 写访问日志. HTTP/2只处理GET, 其他方法的请求已被回复400
+    m_conn->log_access(http_conn::GET, s->url, s->url_len, s->status, s->sent, s->start_time, 2);
+    if (s->asset) {
+        s->asset->store->release();
+    } else if (s->file_address) {
+        munmap(s->file_address, s->body_len);
+    }
+    memset(s, 0, sizeof(*s));
+}
+
+void http2_session::reap_streams() {
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        if (m_streams[i].id && m_streams[i].state == STREAM_DONE) {
+            release_stream(m_streams + i);
+        }
+    }
+}
+
+void http2_session::queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, uint32_t len) {
+    if (m_ctrl_len + 9 + len > (uint32_t)CTRL_BUF_SIZE) {
+        // 对端只发不收(例如PING洪泛), 控制帧积压过多, 直接断开
+        m_closing = true;
+        return;
+    }
+    put_frame_header(m_ctrl + m_ctrl_len, len, type, flags, stream_id);
+    if (len) {
+        memcpy(m_ctrl + m_ctrl_len + 9, payload, len);
+    }
+    m_ctrl_len += 9 + len;
+}
+
+void http2_session::queue_settings() {
+    uint8_t payload[6];
+    payload[0] = 0;
+    payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32(payload + 2, MAX_STREAMS);
+    queue_frame(SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+void http2_session::queue_window_update(uint32_t stream_id, uint32_t increment) {
+    uint8_t payload[4];
+    put_u32(payload, increment);
+    queue_frame(WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+void http2_session::connection_error(ERROR_CODE code) {
+    if (m_closing) {
+        return;
+    }
+    uint8_t payload[8];
+    put_u32(payload, m_last_stream_id);
+    put_u32(payload + 4, code);
+    queue_frame(GOAWAY, 0, 0, payload, 8);
+    m_closing = true;
+}
+
+void http2_session::queue_goaway() {
+    if (m_goaway_sent || m_closing) {
+        return;
+    }
+    uint8_t payload[8];
+    put_u32(payload, m_last_stream_id);
+    put_u32(payload + 4, NO_ERROR);
+    queue_frame(GOAWAY, 0, 0, payload, 8);
+    m_goaway_sent = true;
+}
+
+bool http2_session::finished() {
+    return m_closing || ((m_peer_goaway || m_goaway_sent) && !has_active_streams());
+}
+
+/*
+ * 发送GOAWAY之后的流都发完时, 对端可能还在发送帧(如WINDOW_UPDATE). 这时直接close, 接收队列中的
+ * 数据会使内核回复RST, 对端还没读走的最后一批应答随之丢失. 因此只关闭写方向, 之后读到的数据全部丢弃,
+ * 对端关闭后(read返回0)再关闭连接, 最多等到排空超时. 出错或对端发送GOAWAY而结束的会话立即关闭
+ */
+bool http2_session::linger() {
+    if (m_closing || !m_goaway_sent) {
+        return false;
+    }
+    if (!m_write_shut) {
+        http_conn::m_transport->shutdown_write(m_conn->m_sockfd);
+        m_write_shut = true;
+    }
+    m_conn->m_read_index = 0;
+    arm();
+    return true;
+}
+
+bool http2_session::drain() {
+    queue_goaway();
+    if (m_iov_index < m_iov_count) {
+        return true;  // 批次在途, GOAWAY随下一批发出
+    }
+    return write();
+}
+
+bool http2_session::add_iov(const void* base, size_t len) {
+    if (len == 0) {
+        return true;
+    }
+    // 与上一个iovec首尾相接时直接合并, 节省iovec
+    if (m_iov_count > 0) {
+        struct iovec& last = m_iov[m_iov_count - 1];
+        if ((const char*)last.iov_base + last.iov_len == (const char*)base) {
+            last.iov_len += len;
+            return true;
+        }
+    }
+    if (m_iov_count >= MAX_IOV) {
+        return false;
+    }
+    m_iov[m_iov_count].iov_base = (void*)base;
+    m_iov[m_iov_count].iov_len = len;
+    m_iov_count++;
+    return true;
+}
+
+void http2_session::build_batch() {
+    m_iov_count = 0;
+    m_iov_index = 0;
+    m_frame_len = 0;
+    reap_streams();
+
+    // 1.待发送的控制帧(以及升级时的101应答)
+    if (m_ctrl_len) {
+        memcpy(m_frame_buf, m_ctrl, m_ctrl_len);
+        add_iov(m_frame_buf, m_ctrl_len);
+        m_frame_len = m_ctrl_len;
+        m_ctrl_len = 0;
+    }
+    if (m_closing || m_expect_preface) {
+        // 已发送GOAWAY, 不再发送响应; 升级后在收到客户端序言之前, 也只发101和SETTINGS,
+        // 避免一部分客户端在处理101时丢掉紧随其后的大量数据
+        return;
+    }
+
+    // 2.新流的HEADERS帧
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        stream* s = m_streams + i;
+        if (!s->id || s->state != STREAM_HEADERS) {
+            continue;
+        }
+        if (m_frame_len + 9 + 128 > FRAME_BUF_SIZE) {
+            break;  // 剩下的留到下一批
+        }
+        uint8_t* hdr = m_frame_buf + m_frame_len;
+        uint8_t* p = hdr + 9;
+        size_t room = FRAME_BUF_SIZE - m_frame_len - 9;
+        char status[8], length[24];
+        snprintf(status, sizeof(status), "%d", s->status);
+        snprintf(length, sizeof(length), "%zu", s->body_len);
+        int n = m_encoder.begin(p, room);
+        int k1 = m_encoder.encode(p + n, room - n, ":status", status, false);
+        int k2 = m_encoder.encode(p + n + k1, room - n - k1, "content-length", length, false);
+        int k3 = m_encoder.encode(p + n + k1 + k2, room - n - k1 - k2, "content-type", s->mime, true);
+        if (n < 0 || k1 < 0 || k2 < 0 || k3 < 0) {
+            connection_error(INTERNAL_ERROR);
+            return;
+        }
+        int blen = n + k1 + k2 + k3;
+        uint8_t flags = FLAG_END_HEADERS;
+        if (s->body_len == 0) {
+            flags |= FLAG_END_STREAM;
+            s->state = STREAM_DONE;
+        } else {
+            s->state = STREAM_DATA;
+        }
+        put_frame_header(hdr, blen, HEADERS, flags, s->id);
+        add_iov(hdr, 9 + blen);
+        m_frame_len += 9 + blen;
+    }
+
+    // 3.DATA帧: 各流轮流取一块, 直到窗口耗尽或本批已满
+    size_t batch_bytes = 0;
+    bool progress = true;
+    while (progress && m_send_window > 0 && batch_bytes < (size_t)BATCH_BYTES) {
+        progress = false;
+        for (int k = 0; k < MAX_STREAMS; k++) {
+            stream* s = m_streams + (m_rr + k) % MAX_STREAMS;
+            if (!s->id || s->state != STREAM_DATA || s->window <= 0) {
+                continue;
+            }
+            if (m_send_window <= 0 || batch_bytes >= (size_t)BATCH_BYTES
+                || m_iov_count + 2 > MAX_IOV || m_frame_len + 9 > FRAME_BUF_SIZE) {
+                progress = false;
+                break;
+            }
+            size_t chunk = s->body_len - s->sent;
+            if (chunk > (size_t)s->window) chunk = s->window;
+            if (chunk > (size_t)m_send_window) chunk = m_send_window;
+            if (chunk > m_peer_max_frame) chunk = m_peer_max_frame;
+            if (chunk > (size_t)DATA_QUANTUM) chunk = DATA_QUANTUM;
+
+            uint8_t flags = 0;
+            if (s->sent + chunk == s->body_len) {
+                flags = FLAG_END_STREAM;
+            }
+            uint8_t* hdr = m_frame_buf + m_frame_len;
+            put_frame_header(hdr, chunk, DATA, flags, s->id);
+            m_frame_len += 9;
+            add_iov(hdr, 9);
+            add_iov(s->body + s->sent, chunk);
+            s->sent += chunk;
+            s->window -= chunk;
+            m_send_window -= chunk;
+            batch_bytes += chunk;
+            if (flags & FLAG_END_STREAM) {
+                s->state = STREAM_DONE;  // 这批发完之后释放
+            }
+            progress = true;
+        }
+    }
+    m_rr = (m_rr + 1) % MAX_STREAMS;
+}
+
+void http2_session::arm() {
+    if (m_iov_index < m_iov_count) {
+        // 发送期间也要监听读事件, 否则收不到对端的WINDOW_UPDATE
+        http_conn::m_transport->mod(m_conn->m_sockfd, EPOLLOUT | EPOLLIN, m_conn->m_generation);
+    } else {
+        http_conn::m_transport->mod(m_conn->m_sockfd, EPOLLIN, m_conn->m_generation);
+    }
+}
+
+bool http2_session::write() {
+    while (true) {
+        // 1.当前批次已发完, 组织下一批
+        if (m_iov_index >= m_iov_count) {
+            build_batch();
+            if (m_iov_count == 0) {
+                if (finished()) {
+                    return linger();
+                }
+                arm();
+                return true;
+            }
+        }
+        // 2.发送
+        ssize_t n = http_conn::m_transport->writev(m_conn->m_sockfd, m_iov + m_iov_index, m_iov_count - m_iov_index);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                arm();
+                return true;
+            }
+            return false;
+        }
+        // 3.跳过已经发完的iovec
+        while (n > 0 && m_iov_index < m_iov_count) {
+            struct iovec& iv = m_iov[m_iov_index];
+            if ((size_t)n >= iv.iov_len) {
+                n -= iv.iov_len;
+                m_iov_index++;
+            } else {
+                iv.iov_base = (char*)iv.iov_base + n;
+                iv.iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+}
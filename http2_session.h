@@ -0,0 +1,148 @@
+#ifndef HTTP2_SESSION_H
+#define HTTP2_SESSION_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include "hpack.h"
+#include "http_conn.h"
+#include "access_log.h"
+
+/*
+ * 明文HTTP/2(h2c)会话, 挂在http_conn上, 与HTTP/1.1的process_read状态机并列.
+ * 进入HTTP/2的两种方式:
+ * 1.先验知识(prior knowledge): 客户端一连上就发送连接序言"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+ * 2.升级: 客户端发送带有"Upgrade: h2c"和"HTTP2-Settings"的HTTP/1.1请求, 服务器回复101,
+ *   升级前的请求作为流1, 在HTTP/2上响应.
+ * 线程模型与HTTP/1.1相同: 主线程read()把数据读入m_read_buf, 工作线程process()解析帧并
+ * 处理请求, 主线程write()发送. 多个流的响应被切成DATA帧, 轮流(round robin)放入同一批
+ * iovec中, 一次writev发出, 每个DATA帧都受连接级和流级的流量控制窗口约束.
+ */
+class http2_session {
+public:
+    static const int PREFACE_LEN = 24;  // 客户端连接序言的长度
+    static const int MAX_STREAMS = 32;  // 同时处理的最大流数, 通过SETTINGS_MAX_CONCURRENT_STREAMS通告给客户端
+    static const int MAX_IOV = 64;  // 一批writev的最大iovec数
+    static const int FRAME_BUF_SIZE = 8192;  // 一批中帧头、HEADERS帧和控制帧的总大小上限
+    static const int CTRL_BUF_SIZE = 2048;  // 待发送控制帧(SETTINGS ACK、PING ACK、WINDOW_UPDATE等)缓冲区的大小
+    static const int HEADER_BLOCK_SIZE = 16384;  // 请求头部块(HEADERS + CONTINUATION)的最大长度, 至少能放下一个最大的帧
+    static const int BATCH_BYTES = 256 * 1024;  // 一批最多发送的字节数
+    static const int DATA_QUANTUM = 16384;  // 轮转时每个流每次最多放入的字节数
+    static const int DEFAULT_WINDOW = 65535;  // 流量控制窗口初始值
+    static const int MAX_FRAME_SIZE = 16384;  // 本端接收的最大帧长度(默认值, 不修改)
+    static const int IN_FRAME_SIZE = 9 + MAX_FRAME_SIZE;  // 读缓冲区放不下的帧在会话中拼接, 缓冲区能放下一个最大的帧
+
+    // 帧类型
+    enum FRAME_TYPE { DATA = 0, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING, GOAWAY, WINDOW_UPDATE, CONTINUATION };
+    // 错误码
+    enum ERROR_CODE { NO_ERROR = 0, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT, STREAM_CLOSED,
+                      FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR, CONNECT_ERROR, ENHANCE_YOUR_CALM };
+
+    /* 检查缓冲区开头是否是客户端连接序言.
+     * 返回1: 序言完整; 返回0: 目前的数据与序言一致, 但还不完整; 返回-1: 不是HTTP/2连接 */
+    static int check_preface(const char* buf, int len);
+
+    http2_session(http_conn* conn);
+    ~http2_session();
+
+    // 以先验知识方式开始会话: 发送服务器的SETTINGS
+    void start();
+    /* 通过Upgrade: h2c升级: 应用HTTP2-Settings, 回复101, 发送SETTINGS, 并把升级前的请求
+     * (其处理结果为ret)作为流1进行响应. 失败返回false */
+    bool upgrade(const char* settings, http_conn::HTTP_CODE ret);
+    // 工作线程调用: 解析读缓冲区中的帧并处理请求. 返回false表示应关闭连接
+    bool process();
+    // 主线程调用: 非阻塞地发送. 返回false表示应关闭连接
+    bool write();
+    /* 平滑升级后排空: 发送GOAWAY(NO_ERROR), 不再接受新的流, 已有的流发完后关闭写方向, 对端关闭后关闭连接.
+     * 由主线程在连接不在线程池中时调用. 返回false表示已经没有要发送的数据, 应关闭连接 */
+    bool drain();
+
+private:
+    enum STREAM_STATE { STREAM_IDLE = 0, STREAM_HEADERS, STREAM_DATA, STREAM_DONE };
+
+    struct stream {
+        uint32_t id;
+        STREAM_STATE state;
+        int status;  // 响应状态码
+        const char* body;  // 响应体
+        size_t body_len;
+        size_t sent;  // 已放入批次的响应体字节数
+        int64_t window;  // 流级发送窗口
+        char* file_address;  // 若响应体是mmap映射的文件, 释放流时需要munmap
+        const asset_store::asset* asset;  // 若响应体来自资源仓库, 释放流时需要释放对仓库的引用
+        const char* mime;  // 响应体的Content-Type
+        char route_body[http_conn::ROUTE_BODY_SIZE];  // 保留路由的应答内容(连接的m_route_body会被下一个流覆盖, 需要拷贝一份)
+        uint64_t start_time;  // 流开始的时间, 用于访问日志
+        char url[access_record::URL_LEN];  // 请求的URL(可能被截断), 用于访问日志
+        int url_len;  // URL的原始长度
+    };
+
+    void handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t len);
+    void handle_settings(uint8_t flags, const uint8_t* payload, uint32_t len);
+    void handle_headers_end(uint32_t stream_id);
+    void handle_window_update(uint32_t stream_id, const uint8_t* payload, uint32_t len);
+    void open_stream(uint32_t id, http_conn::HTTP_CODE ret);
+    stream* find_stream(uint32_t id);  // id为0时查找空闲槽位
+    bool has_active_streams();
+    void release_stream(stream* s);
+    void reap_streams();  // 释放已经发送完或被取消的流, 只能在没有批次在途时调用
+
+    // 向控制帧缓冲区追加一帧
+    void queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, uint32_t len);
+    void queue_settings();
+    void queue_window_update(uint32_t stream_id, uint32_t increment);
+    void connection_error(ERROR_CODE code);  // 发送GOAWAY, 发完后关闭连接
+    void queue_goaway();  // 排空时发送GOAWAY(NO_ERROR), 只发一次
+    bool finished();  // 没有批次在途时调用: 是否可以关闭连接
+    bool linger();  // finished之后调用: 返回false表示立即关闭连接
+
+    void build_batch();  // 组织下一批待发送的数据
+    bool add_iov(const void* base, size_t len);
+    void arm();  // 根据是否有待发送的数据, 重新注册epoll事件
+
+    static void on_header(void* arg, const char* name, int name_len, const char* value, int value_len);
+
+    http_conn* m_conn;
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+
+    bool m_expect_preface;  // 是否还在等待客户端连接序言
+    bool m_closing;  // 已发送GOAWAY, 发完后关闭
+    bool m_peer_goaway;  // 对端已发送GOAWAY
+    bool m_goaway_sent;  // 排空时本端已发送GOAWAY(NO_ERROR), 之后的新流被拒绝
+    bool m_write_shut;  // 已关闭写方向, 等待对端关闭连接
+    uint32_t m_last_stream_id;  // 对端发起的最大流ID
+    uint32_t m_skip;  // 当前DATA帧还需丢弃的负载字节数
+    // 比连接读缓冲区大的非DATA帧(例如携带长Cookie的HEADERS)在这里拼接完整后再处理
+    uint8_t m_in_frame[IN_FRAME_SIZE];
+    uint32_t m_in_len;  // m_in_frame中已有的字节数, 0表示没有正在拼接的帧
+    int64_t m_send_window;  // 连接级发送窗口
+    int32_t m_peer_initial_window;  // 对端的SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t m_peer_max_frame;  // 对端的SETTINGS_MAX_FRAME_SIZE
+
+    // 请求头部块
+    uint8_t m_header_block[HEADER_BLOCK_SIZE];
+    int m_header_len;
+    uint32_t m_continuation_stream;  // 正在等待CONTINUATION的流, 0表示没有
+    bool m_header_end_stream;
+    // 解码头部块时收集的伪首部
+    char m_method[16];
+    char m_path[http_conn::FILENAME_LEN];
+    bool m_bad_header;
+
+    stream m_streams[MAX_STREAMS];
+    int m_rr;  // 轮转的起点
+
+    // 待发送的控制帧
+    uint8_t m_ctrl[CTRL_BUF_SIZE];
+    int m_ctrl_len;
+
+    // 当前批次
+    uint8_t m_frame_buf[FRAME_BUF_SIZE];
+    int m_frame_len;
+    struct iovec m_iov[MAX_IOV];
+    int m_iov_count;
+    int m_iov_index;  // 第一个还未发完的iovec
+};
+
+#endif
@@ -1,4 +1,35 @@
 #include "http_conn.h"
+#include "conn_table.h"
+#include "http2_session.h"
+#include "mime.h"
+#include "threadpool.h"
+#include "proxy.h"
+#include "access_log.h"
+#include "neg_cache.h"
+#include "hot_urls.h"
+#include "rate_limiter.h"
+#include "capture.h"
+#include "url.h"
+#include "transport.h"
+#include "probes.h"
+#include <vector>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
@@ -8,12 +39,82 @@ const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "Too many requests from your address, please retry later.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server did not return a valid response.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The server is too busy to handle the request, please retry later.\n";
 
 // 网站根目录
 const char* doc_root = "/home/peng/webserver/resources";
 
+// 404应答是固定的, 预先生成两份: [0]为Connection: close, [1]为Connection: keep-alive
+static char response_404[2][256];
+static int build_404(bool linger) {
+    return snprintf(response_404[linger], sizeof(response_404[linger]),
+        "HTTP/1.1 404 %s\r\nContent-Length: %d\r\nContent-Type:text/html\r\nConnection: %s\r\n\r\n%s",
+        error_404_title, (int)strlen(error_404_form), linger ? "keep-alive" : "close", error_404_form);
+}
+static const int response_404_len[2] = {build_404(false), build_404(true)};
+
+// 连接数超过限制时的429应答, accept之后直接发送
+static char response_429[256];
+static const int response_429_len = snprintf(response_429, sizeof(response_429),
+    "HTTP/1.1 429 %s\r\nRetry-After: 1\r\nContent-Length: %d\r\nContent-Type:text/html\r\nConnection: close\r\n\r\n%s",
+    error_429_title, (int)strlen(error_429_form), error_429_form);
+
+// 线程池的任务队列已满时的503应答, 由主线程直接发送
+static char response_503[256];
+static const int response_503_len = snprintf(response_503, sizeof(response_503),
+    "HTTP/1.1 503 %s\r\nRetry-After: 1\r\nContent-Length: %d\r\nContent-Type:text/html\r\nConnection: close\r\n\r\n%s",
+    error_503_title, (int)strlen(error_503_form), error_503_form);
+
+// 保留路由表, 由static_map在编译期生成完美哈希. 这些路径优先于网站根目录下的文件
+enum ROUTE { ROUTE_HEALTH = 0, ROUTE_STATS };
+struct route_entry {
+    const char* key;  // 路径
+    ROUTE route;
+};
+static constexpr route_entry route_table[] = {
+    {"/health", ROUTE_HEALTH},  // 健康检查
+    {"/stats", ROUTE_STATS},  // 运行状态统计
+};
+static constexpr static_map<sizeof(route_table) / sizeof(route_table[0]), 8> route_map(route_table);
+
+/* 大文件提示: 以URL的哈希值为下标的位图, 记录每个URL上一次访问的文件是否不小于m_large_file字节.
+ * 请求在append之前还没有stat, 只能根据上一次的结果分类; 哈希冲突只会让个别请求进错通道 */
+static const int LARGE_HINT_BITS = 4096;
+static std::atomic<uint64_t> large_hints[LARGE_HINT_BITS / 64];
+
+static uint32_t large_hint_index(const char* url, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)url[i]) * 16777619u;
+    }
+    return h & (LARGE_HINT_BITS - 1);
+}
+
+static bool large_hint(const char* url, size_t len) {
+    uint32_t i = large_hint_index(url, len);
+    return large_hints[i / 64].load(std::memory_order_relaxed) & (1ull << (i % 64));
+}
+
+static void set_large_hint(const char* url, size_t len, bool large) {
+    uint32_t i = large_hint_index(url, len);
+    uint64_t bit = 1ull << (i % 64);
+    if (((large_hints[i / 64].load(std::memory_order_relaxed) & bit) != 0) == large) {
+        return;  // 没有变化时不写, 避免多个线程反复写同一个cache line
+    }
+    if (large) {
+        large_hints[i / 64].fetch_or(bit, std::memory_order_relaxed);
+    } else {
+        large_hints[i / 64].fetch_and(~bit, std::memory_order_relaxed);
+    }
+}
+
 // 将文件描述符设为非阻塞
 void setnonblocking(int fd) {
     int flag = fcntl(fd, F_GETFL);
@@ -21,11 +122,11 @@ void setnonblocking(int fd) {
     fcntl(fd, F_SETFL, flag);
 }
 
-// 向epoll实例添加文件描述符
-void addfd(int epfd, int fd, bool oneshot, bool edge) {
+// 向epoll实例添加文件描述符, 事件中携带的key由fd和槽位代数generation组成
+void addfd(int epfd, int fd, bool oneshot, bool edge, uint32_t generation) {
     // 创建epoll实例, 并将fd以及要检测的事件添加入epoll实例
     struct epoll_event epev;
-    epev.data.fd = fd;
+    epev.data.u64 = conn_key(fd, generation);
     epev.events = EPOLLIN | EPOLLRDHUP;
     if (edge) {
         epev.events |= EPOLLET;
@@ -46,16 +147,30 @@ void removefd(int epfd, int fd) {
 
 // 修改epoll实例中要检测的文件描述符的属性, 将原属性修改为event, 
 // 注意: 修改时无需添加EPOLLRDHUP, EPOLLONESHOT. 此函数会自动添加.
-void modfd(int epfd, int fd, int event) {
+void modfd(int epfd, int fd, int event, uint32_t generation) {
     epoll_event epev;
-    epev.data.fd = fd;
+    epev.data.u64 = conn_key(fd, generation);
     epev.events = event | EPOLLRDHUP | EPOLLONESHOT | EPOLLET;
     epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &epev);
 }
 
 // 静态变量, 类内声明, 类外初始化
 int http_conn::m_epfd = -1;
+transport* http_conn::m_transport = NULL;
 int http_conn::m_user_count = 0;
+conn_table* http_conn::m_table = NULL;
+bool http_conn::m_coroutine = false;
+threadpool<http_conn>* http_conn::m_pool = NULL;
+size_t http_conn::m_large_file = 1024 * 1024;
+size_t http_conn::m_zerocopy_min = 0;
+std::atomic<long> http_conn::m_zerocopy_sends(0);
+std::atomic<long> http_conn::m_zerocopy_copied(0);
+size_t http_conn::m_prefetch_max = 64 * 1024 * 1024;
+std::atomic<long> http_conn::m_resident_hits(0);
+std::atomic<long> http_conn::m_resident_misses(0);
+std::atomic<long> http_conn::m_prefetched_pages(0);
+bool http_conn::m_register_once = false;
+std::atomic<bool> http_conn::m_draining(false);
 
 /* 初始化连接相关信息
  * 注意, init函数不同于有参构造函数. 
@@ -64,16 +179,35 @@ int http_conn::m_user_count = 0;
  */
 void http_conn::init(int sockfd, const sockaddr_in& addr) {
     m_sockfd = sockfd;
-    m_addr = addr;
-    // 对m_sockfd设置端口复用
-    int reuse = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
-    // 将m_sockfd添加到epoll实例当中
-    addfd(m_epfd, m_sockfd, true, true);  // 需要检测cfd的EPOLLONESHOT事件; 对cfd使用边沿触发
+    m_generation++;  // 槽位被复用, 代数加1, 使旧连接遗留的事件失效
+    // 从连接表中取一块冷数据
+    if (!m_cold) {
+        m_cold = m_table->alloc_cold();
+    }
+    m_cold->m_addr = addr;
+    m_file_address = 0;
+    m_asset = NULL;
+    m_h2 = NULL;
+    m_cold->m_upstream = NULL;
+    m_cold->m_coro = NULL;
+    m_cold->m_zc_sent = 0;
+    m_cold->m_zc_done = 0;
+    m_cold->m_capture_id = capture::enabled() ? capture::connect() : 0;
+    // 允许以MSG_ZEROCOPY发送, 内核(或传输层)不支持时本连接使用普通发送
+    m_cold->m_zerocopy = m_zerocopy_min > 0 && m_transport->enable_zerocopy(sockfd);
+    // 将m_sockfd注册到传输层(epoll实例)当中
+    m_owner.store(0, std::memory_order_relaxed);
+    m_transport->add(m_sockfd, m_generation, m_register_once);
     // 更新用户数量属性
     m_user_count++;
     // 初始化其他信息(使用私有的那个init)
     init();
+#if HAS_COROUTINE
+    // 协程模式: 创建连接协程, 它一开始处于挂起状态, 第一次EPOLLIN事件到来时由主线程恢复
+    if (m_coroutine) {
+        m_cold->m_coro = serve().address();
+    }
+#endif
 }
 
 // 初始化其他信息
@@ -81,19 +215,25 @@ void http_conn::init() {
     m_check_state = CHECK_STATE_REQUESTLINE;  // 初始化主状态机状态: 解析请求首行
     m_method = GET;
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);  // 清空读缓冲区
+    bzero(m_cold->m_read_buf, READ_BUFFER_SIZE);  // 清空读缓冲区
     m_checked_index = 0;
     m_start_line = 0;
     m_read_index = 0;
     
-    bzero(m_real_file, FILENAME_LEN);
+    bzero(m_cold->m_real_file, FILENAME_LEN);
     m_url = 0;
-    m_version = 0;
+    m_cold->m_target = 0;
+    m_cold->m_version = 0;
     m_linger = false;
     m_content_length = 0;
-    m_host = 0;
+    m_cold->m_host = 0;
+    m_cold->m_upgrade_h2c = false;
+    m_cold->m_http2_settings = 0;
+    m_cold->m_accept_gzip = false;
+    m_cold->m_admitted = false;
+    m_cold->m_mime = "text/html";
     
-    bzero(m_write_buf, WRITE_BUFFER_SIZE);
+    bzero(m_cold->m_write_buf, WRITE_BUFFER_SIZE);
     m_write_index = 0;
 
     bytes_to_send = 0;
@@ -103,11 +243,41 @@ void http_conn::init() {
 // 关闭这个连接
 void http_conn::close_conn() {
     if (m_sockfd != -1) {  // 如果这个连接还没被关闭
-        // 将本连接对应的文件描述符从epoll实例中删除
-        removefd(m_epfd, m_sockfd);
         // 更新本对象中的相关成员, 包括m_sockfd和m_user_count
+        int fd = m_sockfd;
         m_sockfd = -1;
         m_user_count--;
+#if HAS_COROUTINE
+        // 协程还挂起在io_wait上(主线程收到了错误事件), 销毁协程帧
+        if (m_cold->m_coro) {
+            std::coroutine_handle<>::from_address(m_cold->m_coro).destroy();
+            m_cold->m_coro = NULL;
+        }
+#endif
+        if (m_cold->m_capture_id) {
+            capture::disconnect(m_cold->m_capture_id);
+        }
+        // 归还这个地址的连接数
+        if (rate_limiter::enabled()) {
+            rate_limiter::disconnect(m_cold->m_addr.sin_addr.s_addr);
+        }
+        // 正在转发的请求被中断, 上游连接的状态未知, 不能放回连接池
+        if (m_cold->m_upstream) {
+            proxy::release(m_cold->m_upstream, false);
+            m_cold->m_upstream = NULL;
+        }
+        /* 释放仍未解除的内存映射, 并把冷数据块还给连接表.
+         * 若还有MSG_ZEROCOPY发送没有完成, 内核持有页面的引用, munmap之后数据仍然有效 */
+        unmap();
+        if (m_h2) {
+            delete m_h2;
+            m_h2 = NULL;
+        }
+        m_table->free_cold(m_cold);
+        m_cold = NULL;
+        /* 最后才将文件描述符从epoll实例中删除并关闭. 连接可能在工作线程中关闭, fd关闭之后
+         * 主线程就可能accept到同一个fd并复用这个槽位, 因此之后不能再访问本对象 */
+        m_transport->remove(fd);
     }
 }
 
@@ -118,10 +288,15 @@ bool http_conn::read() {
     if (m_read_index >= READ_BUFFER_SIZE) {
         return false;
     }
+    // 新请求的开始时间
+    if (m_read_index == 0 && access_log::enabled()) {
+        m_cold->m_start_time = access_log::now();
+    }
     // 读取到的字节
     int bytes_read = 0;
-    while (true) {
-        bytes_read = recv(m_sockfd,m_read_buf + m_read_index,READ_BUFFER_SIZE - m_read_index,0);
+    int read_start = m_read_index;
+    while (m_read_index < READ_BUFFER_SIZE) {  // 缓冲区满了就先交给process处理, 剩余数据在重新注册事件后再读
+        bytes_read = m_transport->recv(m_sockfd, m_cold->m_read_buf + m_read_index, READ_BUFFER_SIZE - m_read_index);
         printf("bytes_read = %d\n", bytes_read);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -135,18 +310,56 @@ bool http_conn::read() {
             // 对方关闭连接
             return false;
         }
+        if (m_cold->m_capture_id) {
+            capture::data(m_cold->m_capture_id, m_cold->m_read_buf + m_read_index, bytes_read);
+        }
         m_read_index += bytes_read;
     }
+    WEBSERVER_PROBE(read, m_sockfd, m_read_index - read_start, m_read_index);
     printf("读取到了数据:\n");
     printf("-----------------------------\n");
-    printf("%s", m_read_buf);
+    printf("%s", m_cold->m_read_buf);
     printf("-----------------------------\n");
     printf(">>>>> 函数http_conn::read执行完毕!\n");
     return true;
 }
 
+/* 每个请求在它的第一批数据读入后取一个令牌, 超过速率时不再交给线程池, 直接回复429并关闭连接.
+ * HTTP/2连接的请求在http2_session中按流检查 */
+bool http_conn::admit() {
+    if (!rate_limiter::enabled() || m_h2 || m_cold->m_admitted) {
+        return true;
+    }
+    int preface = http2_session::check_preface(m_cold->m_read_buf, m_read_index);
+    if (preface == 0) {  // 可能是HTTP/2连接序言, 等数据收全后再决定
+        return true;
+    }
+    m_cold->m_admitted = true;
+    if (preface == 1 || rate_limiter::request(m_cold->m_addr.sin_addr.s_addr)) {
+        return true;
+    }
+    m_linger = false;
+    process_write(TOO_MANY_REQUESTS);
+    return false;
+}
+
+void http_conn::reject(int fd) {
+    send(fd, response_429, response_429_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* 请求没能放进线程池(任务队列已满): 直接回复503(尽力而为, 不等待)并关闭连接, 清除所有权.
+ * 否则单次注册模式下OWNER_HELD一直被置位, 之后的事件(包括HUP)都只记在m_owner中, 连接永远不会被关闭.
+ * HTTP/2连接不能插入HTTP/1.1应答, 直接关闭 */
+void http_conn::overload() {
+    if (!m_h2) {
+        send(m_sockfd, response_503, response_503_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close_conn();
+    m_owner.store(0, std::memory_order_release);
+}
+
 // 主状态机: 解析HTTP请求
-http_conn::HTTP_CODE http_conn::process_read() {
+http_conn::HTTP_CODE http_conn::process_read(bool resolve) {
     printf(">>>>> 函数http_conn::process_read开始执行: \n");
     // 1.创建并初始化需要的变量
     // 创建从状态机状态: line_state, 并将其值初始化为LINE_OK(读取到一个完整的行)
@@ -175,6 +388,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 ret = parse_request_line(text);
                 printf("process_read: 处理结果, ret = %d\n", ret);
                 if (ret == BAD_REQUEST) {  // 如果客户请求出现语法错误, 只能返回
+                    WEBSERVER_PROBE(parse, m_sockfd, BAD_REQUEST, m_checked_index);
                     return BAD_REQUEST;
                 }
                 break;
@@ -184,9 +398,11 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 ret = parse_headers(text);
                 printf("process_read: 解析结果, ret = %d", ret);
                 if (ret == BAD_REQUEST) {  // 如果客户请求出现语法错误, 只能返回
+                    WEBSERVER_PROBE(parse, m_sockfd, BAD_REQUEST, m_checked_index);
                     return BAD_REQUEST;
                 } else if (ret == GET_REQUEST) {  // 如果请求头(首部行)都解析完了
-                    return do_request(); 
+                    WEBSERVER_PROBE(parse, m_sockfd, GET_REQUEST, m_checked_index);
+                    return resolve ? do_request() : GET_REQUEST;
                 }
                 break;
             }
@@ -195,7 +411,8 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 ret = parse_content(text);
                 printf("process_read: 解析结果, ret = %d", ret);
                 if (ret == GET_REQUEST) {
-                    return do_request();
+                    WEBSERVER_PROBE(parse, m_sockfd, GET_REQUEST, m_checked_index);
+                    return resolve ? do_request() : GET_REQUEST;
                 }
                 line_state = LINE_OPEN;
                 break;
@@ -206,6 +423,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
         }
     }
 
+    WEBSERVER_PROBE(parse, m_sockfd, NO_REQUEST, m_checked_index);
     printf(">>>>> 函数http_conn::process_read执行完毕!\n");
     return NO_REQUEST;
 }
@@ -216,24 +434,24 @@ http_conn::LINE_STATUS http_conn::parse_line() {
     printf(">>>>>>>>>> 函数http_conn::process_line开始运行: \n");
     char temp;
     for (; m_checked_index < m_read_index; ++m_checked_index) {
-        temp = m_read_buf[m_checked_index];
+        temp = m_cold->m_read_buf[m_checked_index];
         if (temp == '\r') {
             if ((m_checked_index + 1) == m_read_index) {
                 printf(">>>>>>>>>> 函数http_conn::process_line运行完毕, 返回值: LINE_OPEN. \n");
                 return LINE_OPEN;
-            } else if (m_read_buf[m_checked_index + 1] == '\n') {
-                m_read_buf[m_checked_index] = '\0';
+            } else if (m_cold->m_read_buf[m_checked_index + 1] == '\n') {
+                m_cold->m_read_buf[m_checked_index] = '\0';
                 m_checked_index++;
-                m_read_buf[m_checked_index] = '\0';
+                m_cold->m_read_buf[m_checked_index] = '\0';
                 m_checked_index++;
                 printf(">>>>>>>>>> 函数http_conn::process_line运行完毕, 返回值: LINE_OK. \n");
                 return LINE_OK;
             }
             return LINE_BAD;
         } else if (temp == '\n') {
-            if ( (m_checked_index > 1) && (m_read_buf[m_checked_index - 1] == '\r') ) {
-                m_read_buf[m_checked_index - 1] = '\0';
-                m_read_buf[m_checked_index] = '\0';
+            if ( (m_checked_index > 1) && (m_cold->m_read_buf[m_checked_index - 1] == '\r') ) {
+                m_cold->m_read_buf[m_checked_index - 1] = '\0';
+                m_cold->m_read_buf[m_checked_index] = '\0';
                 m_checked_index++;
                 printf(">>>>>>>>>> 函数http_conn::process_line运行完毕, 返回值: LINE_OK. \n");
                 return LINE_OK;
@@ -267,14 +485,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
         return BAD_REQUEST;
     }
     // 获取HTTP版本m_version
-    m_version = strpbrk(m_url, " \t");
-    if (!m_version) {  // 如果m_version为NULL
+    m_cold->m_version = strpbrk(m_url, " \t");
+    if (!m_cold->m_version) {  // 如果m_version为NULL
         printf(">>>>>>>>>> 函数http_conn::parse_request_line运行完毕, 返回值: BAD_REQUEST. \n");
         return BAD_REQUEST;
     }
-    *m_version = '\0';
-    m_version++;
-    if (strcasecmp(m_version, "HTTP/1.1") != 0) {  // 当前只接受HTTP/1.1版本
+    *m_cold->m_version = '\0';
+    m_cold->m_version++;
+    if (strcasecmp(m_cold->m_version, "HTTP/1.1") != 0) {  // 当前只接受HTTP/1.1版本
         printf(">>>>>>>>>> 函数http_conn::parse_request_line运行完毕, 返回值: BAD_REQUEST. \n");
         return BAD_REQUEST;
     }
@@ -288,6 +506,13 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
         printf(">>>>>>>>>> 函数http_conn::parse_request_line运行完毕, 返回值: BAD_REQUEST. \n");
         return BAD_REQUEST;
     }
+    // 规范化URL: 解码、去掉查询串、处理"."和"..". 之后的查找、缓存和转发都使用规范化的URL, 原始URL只用于取出转发时的查询串
+    m_cold->m_target = m_url;
+    if (url_normalize(m_url, strlen(m_url), m_cold->m_url_key, FILENAME_LEN) < 0) {
+        printf(">>>>>>>>>> 函数http_conn::parse_request_line运行完毕, 返回值: BAD_REQUEST. \n");
+        return BAD_REQUEST;
+    }
+    m_url = m_cold->m_url_key;
 
     // 更新主状态机的状态
     m_check_state = CHECK_STATE_HEADER;  // 检查完请求行之后, 主状态机状态变为处理首部行
@@ -296,6 +521,25 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     return NO_REQUEST;
 }
 
+// Accept-Encoding的值中是否有gzip, 并且没有用"q=0"拒绝它
+static bool accepts_gzip(const char* value) {
+    for (const char* p = value; (p = strcasestr(p, "gzip")) != NULL; p += 4) {
+        if (p != value && !strchr(" \t,", p[-1])) {
+            continue;  // 例如"x-gzip"
+        }
+        const char* q = p + 4;
+        q += strspn(q, " \t");
+        if (*q == '\0' || *q == ',') {
+            return true;
+        }
+        if (*q == ';') {
+            q = strchr(q, '=');
+            return q && strtod(q + 1, NULL) > 0;
+        }
+    }
+    return false;
+}
+
 // 子函数: 解析请求头(首部行)
 http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
     if( text[0] == '\0' ) {
@@ -311,7 +555,7 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
         // 处理Connection 头部字段  Connection: keep-alive
         text += 11;
         text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
+        if ( strcasecmp( text, "keep-alive" ) == 0 && !m_draining.load(std::memory_order_relaxed) ) {  // 排空时不再保持连接
             m_linger = true;
         }
     } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
@@ -323,7 +567,23 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
         // 处理Host头部字段
         text += 5;
         text += strspn( text, " \t" );
-        m_host = text;
+        m_cold->m_host = text;
+    } else if ( strncasecmp( text, "Upgrade:", 8 ) == 0 ) {
+        // 处理Upgrade头部字段  Upgrade: h2c
+        text += 8;
+        text += strspn( text, " \t" );
+        if ( strcasecmp( text, "h2c" ) == 0 ) {
+            m_cold->m_upgrade_h2c = true;
+        }
+    } else if ( strncasecmp( text, "HTTP2-Settings:", 15 ) == 0 ) {
+        // 处理HTTP2-Settings头部字段, 其值为base64url编码的SETTINGS帧负载
+        text += 15;
+        text += strspn( text, " \t" );
+        m_cold->m_http2_settings = text;
+    } else if ( strncasecmp( text, "Accept-Encoding:", 16 ) == 0 ) {
+        // 处理Accept-Encoding头部字段  Accept-Encoding: gzip, deflate, br
+        text += 16;
+        m_cold->m_accept_gzip = accepts_gzip(text);
     } else {
         printf( "parse_headers: 遇到了不在处理范围内的首部行(将忽略): %s\n", text );
     }
@@ -342,39 +602,284 @@ http_conn::HTTP_CODE http_conn::parse_content(char* text) {
 }
 
 http_conn::HTTP_CODE http_conn::do_request() {
-    
+    HTTP_CODE ret = do_lookup();
+    if (ret == NO_REQUEST) {
+        ret = do_file();
+    }
+    WEBSERVER_PROBE(lookup, m_sockfd, ret, ret == FILE_REQUEST ? m_cold->m_file_stat.st_size : 0);
+    return ret;
+}
+
+http_conn::HTTP_CODE http_conn::do_lookup() {
+    size_t url_len = strlen(m_url);
+
+    // 保留路由
+    int route = route_map.find(m_url, url_len);
+    if (route >= 0) {
+        return do_route(route_table[route].route);
+    }
+
+    // 反向代理规则
+    const upstream* target = proxy::match(m_url);
+    if (target) {
+        m_cold->m_proxy_target = target;
+        return PROXY_REQUEST;
+    }
+
+    // 优先在预加载的资源仓库中查找, 命中时不需要任何文件系统调用
+    asset_store* store = asset_store::acquire();
+    if (store) {
+        const asset_store::asset* asset = store->find(m_url, url_len);
+        if (asset) {
+            // 客户端接受gzip时使用资源包中预压缩的版本. 升级到HTTP/2的请求由HTTP/2会话回复, 不使用它
+            if (asset->gzip && m_cold->m_accept_gzip && !m_cold->m_upgrade_h2c) {
+                asset = asset->gzip;
+            }
+            m_asset = asset;  // 仓库的引用计数由m_asset持有, 在unmap中释放
+            m_file_address = (char*)asset->data;
+            m_cold->m_file_stat.st_size = asset->length;
+            m_cold->m_mime = asset->mime;
+            return FILE_REQUEST;
+        }
+        store->release();
+    }
+
+    // 最近确认过不存在的路径, 直接回复404, 不再访问文件系统
+    if (neg_cache::find(m_url, url_len)) {
+        return NO_RESOURCE;
+    }
+    return NO_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::do_file() {
     // 构造所请求的资源的路径
-    strcpy(m_real_file, doc_root);
+    strcpy(m_cold->m_real_file, doc_root);
     int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    strncpy(m_cold->m_real_file + len, m_url, FILENAME_LEN - len - 1);
 
-    // 获取所请求文件的相关状态信息, 若失败则返回NO_RESOURCE
-    if (stat(m_real_file, &m_file_stat) < 0) {
+    // 获取所请求文件的相关状态信息, 若失败则返回NO_RESOURCE. 文件不存在时记入否定缓存
+    uint32_t generation = neg_cache::generation();
+    if (stat(m_cold->m_real_file, &m_cold->m_file_stat) < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            neg_cache::insert(m_url, strlen(m_url), generation);
+        }
         return NO_RESOURCE;
     }
 
     // 检查Others用户对所请求资源的读权限
-    if (!(m_file_stat.st_mode & S_IROTH)) {
+    if (!(m_cold->m_file_stat.st_mode & S_IROTH)) {
         return FORBIDDEN_REQUEST;  // 如果没有权限, 返回此值
     }
 
     // 判断是否是目录, 如果是, 也不能返回任何内容
-    if (S_ISDIR(m_file_stat.st_mode)) {
+    if (S_ISDIR(m_cold->m_file_stat.st_mode)) {
         return BAD_REQUEST;
     }
 
+    // 记下文件的大小类别, 下一次请求这个URL时据此选择任务通道
+    size_t url_len = strlen(m_url);
+    if (m_large_file > 0) {
+        set_large_hint(m_url, url_len, (size_t)m_cold->m_file_stat.st_size >= m_large_file);
+    }
+    // 记入热点URL, 平滑升级时交给新进程预热
+    hot_urls::record(m_url, url_len);
+
+    // 根据扩展名确定MIME类型
+    m_cold->m_mime = mime_type(m_url);
+
     // 以只读方式打开文件
-    int fd = open(m_real_file, O_RDONLY);
+    int fd = open(m_cold->m_real_file, O_RDONLY);
     // 创建内存映射
-    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    m_file_address = (char*)mmap(0, m_cold->m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // 在工作线程中等待文件内容读进内存
+    if (m_prefetch_max > 0 && m_file_address != MAP_FAILED && m_cold->m_file_stat.st_size > 0) {
+        prefetch(fd);
+    }
     close(fd);
     return FILE_REQUEST;
 }
 
+// 把映射在addr的文件(fd)的前len字节同步地读进页缓存, 并建立页表项
+static void populate(int fd, const char* addr, size_t len) {
+    posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    if (madvise((void*)addr, len, MADV_POPULATE_READ) != 0) {
+        const volatile char* p = addr;
+        for (size_t off = 0; off < len; off += 4096) {
+            (void)p[off];
+        }
+    }
+}
+
+/*
+ * 预读: 文件内容第一次被访问是在发送应答时, 经典模式下这发生在主线程的writev中, 一个冷的大文件
+ * 会让主线程阻塞在磁盘I/O上, 所有连接都要等它. 因此在工作线程返回之前:
+ * 1.用mincore检查映射的页面是否都已在页缓存中, 是则计为命中, 什么都不用做;
+ * 2.否则计为未命中, 对前m_prefetch_max字节发起预读(posix_fadvise), 再用MADV_POPULATE_READ
+ *   同步地把页面读进来并建立页表项. 内核不支持MADV_POPULATE_READ(Linux 5.14以下)时,
+ *   逐页读一个字节, 效果相同. 超出m_prefetch_max的部分仍在发送时按需读入.
+ * 命中与未命中的比例反映了页缓存是否放得下工作集.
+ */
+void http_conn::prefetch(int fd) {
+    static const size_t PAGE = 4096;
+    size_t size = m_cold->m_file_stat.st_size;
+    size_t pages = (size + PAGE - 1) / PAGE;
+    // 1.检查驻留情况. 每页一个字节, 最低位为1表示页面在内存中
+    // mincore失败时驻留情况未知(residency中是上一个文件的数据), 不计入命中与未命中, 直接预读
+    static thread_local std::vector<unsigned char> residency;
+    residency.resize(pages);
+    size_t len = size < m_prefetch_max ? size : m_prefetch_max;
+    if (mincore(m_file_address, size, residency.data()) != 0) {
+        populate(fd, m_file_address, len);
+        return;
+    }
+    size_t missing = 0;
+    for (size_t i = 0; i < pages; i++) {
+        missing += !(residency[i] & 1);
+    }
+    if (missing == 0) {
+        m_resident_hits.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    m_resident_misses.fetch_add(1, std::memory_order_relaxed);
+    // 2.把前m_prefetch_max字节读进来
+    populate(fd, m_file_address, len);
+    size_t prefetched = 0;
+    for (size_t i = 0; i < (len + PAGE - 1) / PAGE; i++) {
+        prefetched += !(residency[i] & 1);
+    }
+    m_prefetched_pages.fetch_add(prefetched, std::memory_order_relaxed);
+}
+
+/*
+ * 预热: 平滑升级时, 新进程在开始服务之前对旧进程的每个热点URL调用. 与do_file一样stat文件, 让内核缓存
+ * 路径查找和inode, 并记下大文件提示; 再像prefetch一样把前m_prefetch_max字节读进页缓存.
+ * 这样切换之后的第一批请求不必等磁盘. m_prefetch_max为0时只预热元数据.
+ */
+bool http_conn::warm(const char* url) {
+    char path[FILENAME_LEN];
+    int n = snprintf(path, sizeof(path), "%s%s", doc_root, url);
+    if (n < 0 || n >= FILENAME_LEN) {
+        return false;
+    }
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH)) {
+        return false;
+    }
+    if (m_large_file > 0) {
+        set_large_hint(url, strlen(url), (size_t)st.st_size >= m_large_file);
+    }
+    size_t len = (size_t)st.st_size < m_prefetch_max ? st.st_size : m_prefetch_max;
+    if (len == 0) {
+        return true;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    char* addr = (char*)mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+        populate(fd, addr, len);
+        munmap(addr, len);
+    }
+    close(fd);
+    return true;
+}
+
+// 生成保留路由的应答内容
+http_conn::HTTP_CODE http_conn::do_route(int route) {
+    char* body = m_cold->m_route_body;
+    int len = 0;
+    switch (route) {
+        case ROUTE_HEALTH: {
+            len = snprintf(body, ROUTE_BODY_SIZE, "ok\n");
+            m_cold->m_mime = "text/plain";
+            break;
+        }
+        case ROUTE_STATS: {
+            int assets = 0;
+            size_t asset_bytes = 0;
+            asset_store* store = asset_store::acquire();
+            if (store) {
+                assets = store->count();
+                asset_bytes = store->bytes();
+                store->release();
+            }
+            len = snprintf(body, ROUTE_BODY_SIZE,
+                "{\"users\":%d,\"assets\":%d,\"asset_bytes\":%zu,\"upstream_connects\":%ld,\"upstream_reuses\":%ld,\"log_dropped\":%ld,"
+                "\"zerocopy_sends\":%ld,\"zerocopy_copied\":%ld,\"neg_cache_hits\":%ld,\"neg_cache_invalidations\":%ld,"
+                "\"rate_limited_connections\":%ld,\"rate_limited_requests\":%ld,"
+                "\"resident_hits\":%ld,\"resident_misses\":%ld,\"prefetched_pages\":%ld,\"wake_p50_ns\":%llu,\"wake_p99_ns\":%llu}\n",
+                m_user_count, assets, asset_bytes, proxy::connects(), proxy::reuses(), access_log::dropped(),
+                m_zerocopy_sends.load(std::memory_order_relaxed), m_zerocopy_copied.load(std::memory_order_relaxed),
+                neg_cache::hits(), neg_cache::invalidations(),
+                rate_limiter::rejected_connections(), rate_limiter::rejected_requests(),
+                m_resident_hits.load(std::memory_order_relaxed), m_resident_misses.load(std::memory_order_relaxed),
+                m_prefetched_pages.load(std::memory_order_relaxed),
+                (unsigned long long)m_pool->wake_percentile(0.5), (unsigned long long)m_pool->wake_percentile(0.99));
+            m_cold->m_mime = "application/json";
+            break;
+        }
+        default: {
+            return NO_RESOURCE;
+        }
+    }
+    if (len < 0 || len >= ROUTE_BODY_SIZE) {
+        return INTERNAL_ERROR;
+    }
+    m_cold->m_route_len = len;
+    return ROUTE_REQUEST;
+}
+
+// 线程池的分类函数, 在append之前调用. 经典模式下只能根据还没解析的请求行做廉价的判断
+int http_conn::lane() {
+    // 协程切换到工作线程时, 请求已经解析完, 且没有命中资源仓库和否定缓存, 需要访问文件系统
+    if (m_cold->m_coro) {
+        return m_url && large_hint(m_url, strlen(m_url)) ? LANE_LARGE : LANE_FILE;
+    }
+    // HTTP/2连接, 以及请求的后续数据
+    if (m_h2 || m_check_state != CHECK_STATE_REQUESTLINE || m_start_line != 0) {
+        return LANE_FILE;
+    }
+    // 经典模式下请求还没有解析, 从读缓冲区的请求行中取出URL
+    const char* buf = m_cold->m_read_buf;
+    if (m_read_index < 5 || memcmp(buf, "GET /", 5) != 0) {
+        return LANE_FILE;
+    }
+    const char* url = buf + 4;
+    const char* end = (const char*)memchr(url, ' ', m_read_index - 4);
+    if (!end) {
+        return LANE_FILE;
+    }
+    char key[FILENAME_LEN];
+    int n = url_normalize(url, end - url, key, FILENAME_LEN);
+    if (n < 0) {
+        return LANE_FAST;  // 会直接得到400应答
+    }
+    url = key;
+    size_t len = n;
+    if (route_map.find(url, len) >= 0) {
+        return LANE_FAST;
+    }
+    asset_store* store = asset_store::acquire();
+    if (store) {
+        bool hit = store->find(url, len) != NULL;
+        store->release();
+        if (hit) {
+            return LANE_FAST;
+        }
+    }
+    return large_hint(url, len) ? LANE_LARGE : LANE_FILE;
+}
+
 // 对内存映射区执行munmap操作
 void http_conn::unmap() {
-    if (m_file_address) {
-        munmap(m_file_address, m_file_stat.st_size);
+    if (m_asset) {
+        // 来自资源仓库的数据不需要munmap, 只需释放对仓库的引用
+        m_asset->store->release();
+        m_asset = NULL;
+        m_file_address = 0;
+    } else if (m_file_address) {
+        munmap(m_file_address, m_cold->m_file_stat.st_size);
         m_file_address = 0;
     }
 }
@@ -388,7 +893,7 @@ bool http_conn::add_response( const char* format, ... ) {
     // 读取输入参数, 并向写缓冲区中按一定格式写数据
     va_list arg_list;
     va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_index, WRITE_BUFFER_SIZE - 1 - m_write_index, format, arg_list );
+    int len = vsnprintf( m_cold->m_write_buf + m_write_index, WRITE_BUFFER_SIZE - 1 - m_write_index, format, arg_list );
     if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_index ) ) {
         return false;
     }
@@ -405,10 +910,8 @@ bool http_conn::add_status_line(int status, const char* title) {
 
 // 构造应答报文: 添加首部行
 bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    return add_content_length(content_len) && add_content_type()
+        && add_linger() && add_blank_line();
 }
 
 // 构造应答报文: 添加应答的具体内容
@@ -423,7 +926,7 @@ bool http_conn::add_content_length( int content_len ) {
 
 // add_headers的子函数
 bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    return add_response("Content-Type:%s\r\n", m_cold->m_mime);
 }
 
 // add_headers的子函数
@@ -441,6 +944,7 @@ bool http_conn::process_write(HTTP_CODE ret) {
     printf(">>>>> 函数http_conn::process_write开始执行: \n");
     switch (ret) {
         case INTERNAL_ERROR: 
+            m_cold->m_status = 500;
             add_status_line(500, error_500_title);
             add_headers(strlen(error_500_form));
             if (!add_content(error_500_form)) {
@@ -448,6 +952,7 @@ bool http_conn::process_write(HTTP_CODE ret) {
             }
             break;
         case BAD_REQUEST:
+            m_cold->m_status = 400;
             add_status_line( 400, error_400_title );
             add_headers( strlen( error_400_form ) );
             if ( ! add_content( error_400_form ) ) {
@@ -455,35 +960,69 @@ bool http_conn::process_write(HTTP_CODE ret) {
             }
             break;
         case NO_RESOURCE: 
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
-                return false;
-            }
+            // 使用预先生成的应答, 扫描器大量请求不存在的路径时省去格式化
+            m_cold->m_status = 404;
+            memcpy(m_cold->m_write_buf, response_404[m_linger], response_404_len[m_linger]);
+            m_write_index = response_404_len[m_linger];
             break;
         case FORBIDDEN_REQUEST:
+            m_cold->m_status = 403;
             add_status_line( 403, error_403_title );
             add_headers(strlen( error_403_form));
             if ( ! add_content( error_403_form ) ) {
                 return false;
             }
             break;
-        case FILE_REQUEST: 
+        case TOO_MANY_REQUESTS:
+            m_cold->m_status = 429;
+            add_status_line(429, error_429_title);
+            add_response("Retry-After: %d\r\n", 1);
+            add_headers(strlen(error_429_form));
+            if (!add_content(error_429_form)) {
+                return false;
+            }
+            break;
+        case BAD_GATEWAY:
+            m_cold->m_status = 502;
+            add_status_line(502, error_502_title);
+            add_headers(strlen(error_502_form));
+            if (!add_content(error_502_form)) {
+                return false;
+            }
+            break;
+        case ROUTE_REQUEST:
+            m_cold->m_status = 200;
             add_status_line(200, ok_200_title);
-            add_headers(m_file_stat.st_size);
-            m_iv[0].iov_base = m_write_buf;
+            add_headers(m_cold->m_route_len);
+            if (!add_content(m_cold->m_route_body)) {
+                return false;
+            }
+            break;
+        case FILE_REQUEST: 
+            m_cold->m_status = 200;
+            if (m_asset) {
+                // 资源仓库中已经预先生成了状态行和首部行, 只需补上Connection首部和空行
+                memcpy(m_cold->m_write_buf, m_asset->headers, m_asset->headers_len);
+                m_write_index = m_asset->headers_len;
+                add_linger();
+                add_blank_line();
+            } else {
+                add_status_line(200, ok_200_title);
+                add_headers(m_cold->m_file_stat.st_size);
+            }
+            m_iv[0].iov_base = m_cold->m_write_buf;
             m_iv[0].iov_len = m_write_index;
             m_iv[1].iov_base = m_file_address;
-            m_iv[1].iov_len = m_file_stat.st_size;
+            m_iv[1].iov_len = m_cold->m_file_stat.st_size;
             m_iv_count = 2;
-            bytes_to_send = m_write_index + m_file_stat.st_size;
+            bytes_to_send = m_write_index + m_cold->m_file_stat.st_size;
             return true;
         default:
             return false;
     }
 
     // 跳到这说明状态码是FILE_REQUEST以外的, 应答体内容已经写入m_write_buf了
-    m_iv[0].iov_base = m_write_buf;
+    m_iv[0].iov_base = m_cold->m_write_buf;
     m_iv[0].iov_len = m_write_index;
     m_iv_count = 1;
     bytes_to_send = m_write_index;
@@ -494,83 +1033,593 @@ bool http_conn::process_write(HTTP_CODE ret) {
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
 void http_conn::process() {
     printf(">>>>> 函数http_conn::process开始执行: \n");
+    // 协程模式: 连接协程通过offload切换到了工作线程, 在这里恢复它
+    if (m_coroutine && m_cold->m_coro) {
+        resume();
+        return;
+    }
+    // 单次注册模式: 处理完一个请求后, 接着处理期间记下的事件; 又读到了请求就继续处理, 不回到主线程
+    if (m_register_once) {
+        bool open = process_request();
+        while (open && advance()) {
+            if (admit()) {  // 与主线程一样, 先检查请求速率限制
+                open = process_request();
+            } else if (!write()) {  // 429应答已经生成, 发完后关闭连接
+                close_conn();
+                open = false;
+            }
+        }
+        return;
+    }
+    process_request();
+    printf(">>>>> 函数http_conn::process执行完毕!\n");
+}
+
+bool http_conn::process_request() {
+    // 已经切换到HTTP/2的连接, 交给HTTP/2会话处理
+    if (m_h2) {
+        if (!m_h2->process()) {
+            close_conn();
+            return false;
+        }
+        return true;
+    }
+    // 新连接的第一个请求以HTTP/2连接序言开头, 说明客户端使用先验知识直接发起h2c(单次注册模式只支持HTTP/1.1)
+    if (!m_register_once && m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0) {
+        int preface = http2_session::check_preface(m_cold->m_read_buf, m_read_index);
+        if (preface == 0) {  // 序言还没收全
+            arm(EPOLLIN);
+            return true;
+        } else if (preface == 1) {
+            m_h2 = new http2_session(this);
+            m_h2->start();
+            if (!m_h2->process()) {
+                close_conn();
+                return false;
+            }
+            return true;
+        }
+    }
     // 解析HTTP请求
     HTTP_CODE read_ret = process_read();
     // 如果此时请求不完整，则继续读取客户数据
     if (read_ret == NO_REQUEST) {
-        modfd(m_epfd,m_sockfd,EPOLLIN);
-        return;
+        arm(EPOLLIN);
+        return true;
+    }
+    // 转发给上游服务器, 之后由主线程在上游fd和客户端fd的事件中推进转发
+    if (read_ret == PROXY_REQUEST) {
+        if (proxy_start()) {
+            if (!proxy_event()) {
+                close_conn();
+                return false;
+            }
+            return true;
+        }
+        read_ret = BAD_GATEWAY;
+    }
+    // 请求带有"Upgrade: h2c", 回复101并在HTTP/2上响应这个请求
+    if (m_cold->m_upgrade_h2c && read_ret != BAD_REQUEST && !m_register_once) {
+        m_h2 = new http2_session(this);
+        if (m_h2->upgrade(m_cold->m_http2_settings, read_ret)) {
+            if (!m_h2->process()) {
+                close_conn();
+                return false;
+            }
+            return true;
+        }
+        delete m_h2;  // HTTP2-Settings非法, 仍按HTTP/1.1响应
+        m_h2 = NULL;
     }
     // 生成响应
     bool write_ret = process_write(read_ret);
     if (!write_ret) {
         close_conn();
+        return false;
     }
-    modfd(m_epfd,m_sockfd,EPOLLOUT);
-    printf(">>>>> 函数http_conn::process执行完毕!\n");
+    // 单次注册模式: EPOLLOUT一直是注册着的, 直接发送, 发不完时再等它的边沿
+    if (m_register_once) {
+        if (!write()) {
+            close_conn();
+            return false;
+        }
+        return true;
+    }
+    arm(EPOLLOUT);
+    return true;
+}
+
+void http_conn::arm(int event) {
+    if (!m_register_once) {
+        m_transport->mod(m_sockfd, event, m_generation);
+    }
+}
+
+bool http_conn::claim(uint32_t events) {
+    uint8_t bits = OWNER_HELD;
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        bits |= OWNER_HUP;
+    }
+    if (events & EPOLLIN) {
+        bits |= OWNER_IN;
+    }
+    if (events & EPOLLOUT) {
+        bits |= OWNER_OUT;
+    }
+    return !(m_owner.fetch_or(bits, std::memory_order_acq_rel) & OWNER_HELD);
+}
+
+/* 取出记下的事件并处理, 直到没有新的事件, 然后放手. 放手与记下事件都是对m_owner的原子操作,
+ * 因此事件要么被本线程取到, 要么使下一个收到事件的线程取得连接, 不会丢失.
+ * 应答还没发完时读到的EPOLLIN先不处理(读缓冲区还在使用), 留在m_owner中, 等应答发完后再读 */
+bool http_conn::advance() {
+    uint8_t deferred = 0;
+    while (true) {
+        uint8_t bits = (m_owner.exchange(OWNER_HELD, std::memory_order_acq_rel) & ~OWNER_HELD) | deferred;
+        deferred = 0;
+        if (bits & OWNER_HUP) {
+            close_conn();
+            return false;
+        }
+        if ((bits & OWNER_OUT) && bytes_to_send > 0 && !write()) {
+            close_conn();
+            return false;
+        }
+        if (bits & OWNER_IN) {
+            if (bytes_to_send > 0) {
+                deferred = OWNER_IN;
+            } else if (!read()) {
+                close_conn();
+                return false;
+            } else {
+                return true;
+            }
+        }
+        uint8_t held = OWNER_HELD;
+        if (m_owner.compare_exchange_strong(held, deferred, std::memory_order_acq_rel)) {
+            return false;
+        }
+    }
+}
+
+/* 空闲: 没有线程持有连接, 没有读到一半的请求, 也没有待发送的应答. 单次注册模式下主线程先取得连接,
+ * 这期间工作线程不会再拿到它; 经典模式下OWNER_HELD由主线程自己设置和清除(见hand_off).
+ * socket中已经有还没读的数据时不关闭(关闭会使内核回复RST), 这个请求照常处理, 应答后关闭.
+ * HTTP/2连接发送GOAWAY, 已有的流发完后关闭. 正在转发的连接和协程不在这里关闭, 它们在排空超时后随进程退出关闭 */
+bool http_conn::close_if_idle() {
+    uint8_t expected = 0;
+    if (!m_owner.compare_exchange_strong(expected, OWNER_HELD, std::memory_order_acquire)) {
+        return false;
+    }
+    if (m_h2 && !m_cold->m_coro) {
+        if (!m_h2->drain()) {
+            close_conn();
+            return true;
+        }
+        m_owner.store(0, std::memory_order_release);
+        return false;
+    }
+    char byte;
+    if (m_read_index == 0 && bytes_to_send == 0 && !m_h2 && !m_cold->m_upstream && !m_cold->m_coro && !zerocopy_pending()
+        && recv(m_sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && errno == EAGAIN) {
+        close_conn();
+        return true;
+    }
+    m_owner.store(0, std::memory_order_release);
+    return false;
 }
 
 // 非阻塞地写
 bool http_conn::write() {
+    // HTTP/2连接由会话负责发送
+    if (m_h2) {
+        return m_h2->write();
+    }
+    // 正在转发请求, 客户端可写了
+    if (m_cold->m_upstream) {
+        return proxy_event();
+    }
     printf(">>>>> 函数http_conn::write开始执行: \n");
     printf("写数据, 状态行和首部行: \n");
     printf("----------------------------------------------------\n");
-    printf("%s", m_write_buf);
+    printf("%s", m_cold->m_write_buf);
     printf("----------------------------------------------------\n");
 
-    int temp = 0;
-
     // 如果待发送的字节数为0, 则此次响应结束
     if (bytes_to_send == 0) {
-        modfd(m_epfd, m_sockfd, EPOLLIN);  // 重新开始读取客户端发来的数据
+        arm(EPOLLIN);  // 重新开始读取客户端发来的数据
         init();  // 重新初始化报文处理相关参数, 为下次处理报文做准备
         printf(">>>>> 函数http_conn::write执行完毕, 返回: true. \n");
         return true;
     }
 
-    while(1) {
+    int ret = send_response();
+    if (ret != 0) {
+        log_access(m_method, m_url, m_url ? strlen(m_url) : 0, m_cold->m_status, bytes_have_send, m_cold->m_start_time, 1);
+    }
+    if (ret == 0) {
+        // TCP写缓冲没有空间, 则等待下一轮EPOLLOUT事件
+        // 虽然在此期间，服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
+        arm(EPOLLOUT);
+        printf(">>>>> 函数http_conn::write执行完毕, 返回: true. \n");
+        return true;
+    }
+    if (ret < 0) {
+        // 写数据出现其他错误, 就不写了, 直接返回
+        unmap();
+        printf(">>>>> 函数http_conn::write执行完毕, 返回: false. \n");
+        return false;
+    }
+    // 数据都发送完了, 但以MSG_ZEROCOPY发送的部分还被内核引用着, 等完成通知(EPOLLERR)到达后再解除映射
+    if (zerocopy_pending()) {
+        m_transport->mod(m_sockfd, 0, m_generation);
+        printf(">>>>> 函数http_conn::write执行完毕, 等待MSG_ZEROCOPY完成通知. \n");
+        return true;
+    }
+    return finish_response();
+}
+
+bool http_conn::finish_response() {
+    unmap();
+    arm(EPOLLIN);
+    if (m_linger && !m_draining.load(std::memory_order_relaxed)) {  // 排空开始前收到的请求, 发完应答后同样关闭
+        init();
+        printf(">>>>> 函数http_conn::write执行完毕, 返回: true. \n");
+        return true;
+    } else {
+        printf(">>>>> 函数http_conn::write执行完毕, 返回: false. \n");
+        return false;
+    }
+}
+
+// 错误队列中有MSG_ZEROCOPY的完成通知. 经典模式下在这里推进发送, 协程模式下恢复协程
+bool http_conn::zerocopy_event(uint32_t events) {
+    if (!reap_zerocopy()) {
+        return false;
+    }
+    if (m_coroutine && in_coroutine()) {
+        resume();
+        return true;
+    }
+    // 1.应答还没发完: 等待(或者直接处理)EPOLLOUT
+    if (bytes_to_send > 0) {
+        if (events & EPOLLOUT) {
+            return write();
+        }
+        m_transport->mod(m_sockfd, EPOLLOUT, m_generation);
+        return true;
+    }
+    // 2.应答已发完, 还有发送没有完成
+    if (zerocopy_pending()) {
+        m_transport->mod(m_sockfd, 0, m_generation);
+        return true;
+    }
+    // 3.全部完成
+    return finish_response();
+}
+
+/* 每条完成通知是一个sock_extended_err, [ee_info, ee_data]为完成的发送编号区间.
+ * TCP的通知按编号顺序到达, 因此只需记录最大的编号. 若ee_code带有COPIED标志,
+ * 说明内核实际上复制了数据(例如发往本机回环地址), 此后本连接改回普通发送 */
+bool http_conn::reap_zerocopy() {
+    bool got = false;
+    while (true) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(m_sockfd, &msg, MSG_ERRQUEUE) == -1) {
+            // 错误队列为空. 若一条通知都没有读到, EPOLLERR来自真正的socket错误
+            return (errno == EAGAIN || errno == EWOULDBLOCK) && got;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                return false;
+            }
+            m_cold->m_zc_done = serr->ee_data + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                m_cold->m_zerocopy = false;
+                m_zerocopy_copied.fetch_add(1, std::memory_order_relaxed);
+            }
+            got = true;
+        }
+    }
+}
+
+/* 循环调用writev发送应答, 直至发完或TCP写缓冲已满.
+ * 返回1表示发完, 0表示遇到EAGAIN(m_iv已更新, 之后可以接着发), -1表示出错 */
+int http_conn::send_response() {
+    int temp = 0;
+    while (bytes_to_send > 0) {
         // 将应答报文写入通信文件描述符中
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if (m_cold->m_zerocopy && m_iv_count == 2 && m_iv[1].iov_len >= m_zerocopy_min) {
+            /* 应答内容较大: 以MSG_ZEROCOPY发送, 内核直接引用映射的文件页面(或资源仓库的内存)
+             * 而不复制. 这些内存在完成通知到达之前不能解除映射.
+             * 首部在冷数据块的m_write_buf中, 连接关闭时冷数据块会被回收复用, 不能让内核引用它:
+             * 首部先普通地(复制)发送, MSG_MORE使它与随后的内容合并成段, 只有内容以MSG_ZEROCOPY发送 */
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            if (m_iv[0].iov_len > 0) {
+                msg.msg_iov = m_iv;
+                msg.msg_iovlen = 1;
+                temp = sendmsg(m_sockfd, &msg, MSG_MORE | MSG_NOSIGNAL);
+            } else {
+                msg.msg_iov = m_iv + 1;
+                msg.msg_iovlen = 1;
+                temp = sendmsg(m_sockfd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+                if (temp >= 0) {
+                    m_cold->m_zc_sent++;
+                    m_zerocopy_sends.fetch_add(1, std::memory_order_relaxed);
+                } else if (errno == ENOBUFS) {
+                    // 被锁定的页面超出了optmem的限制, 这一次改为复制
+                    temp = m_transport->writev(m_sockfd, m_iv + 1, 1);
+                }
+            }
+        } else {
+            temp = m_transport->writev(m_sockfd, m_iv, m_iv_count);
+        }
+        WEBSERVER_PROBE(writev, m_sockfd, temp, temp < 0 ? bytes_to_send : bytes_to_send - temp);
         // 如果报错
         if (temp <= -1) {
-            // 如果报EAGAIN错误, 表明TCP写缓冲没有空间, 则等待下一轮EPOLLOUT事件
-            // 虽然在此期间，服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
-            if (errno == EAGAIN) {
-                modfd(m_epfd, m_sockfd, EPOLLOUT);
-                printf(">>>>> 函数http_conn::write执行完毕, 返回: true. \n");
-                return true;
-            }
-            // 如果是其他错误, 那说明写数据出现其他错误, 就不写了, 直接返回
-            unmap();
-            printf(">>>>> 函数http_conn::write执行完毕, 返回: false. \n");
-            return false;
+            // 如果报EAGAIN错误, 表明TCP写缓冲没有空间
+            return errno == EAGAIN ? 0 : -1;
         }
         // 如果不报错, 说明成功写入, 则更新相关变量
         bytes_to_send -= temp;
         bytes_have_send += temp;
-        if (bytes_have_send >= m_iv[0].iov_len) {  // 2.如果m_write_buf发完了, m_file_address发了点没发完
+        if (bytes_have_send >= m_write_index) {  // 2.如果m_write_buf发完了, m_file_address发了点没发完
             m_iv[0].iov_len = 0;
             m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_index);
             m_iv[1].iov_len = bytes_to_send;
         } else {  // 1.如果m_write_buf发了一部分, 还没发完
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
+            m_iv[0].iov_base = m_cold->m_write_buf + bytes_have_send;
             m_iv[0].iov_len = m_iv[0].iov_len - temp;
             // 也可以写成: m_iv[0].iov_len = m_write_index - bytes_have_send;
         }
+    }
+    // 3.数据都发送完了
+    return 1;
+}
 
-        if (bytes_to_send <= 0) {
-            // 3.如果数据都发送完了
-            unmap();
-            modfd(m_epfd, m_sockfd, EPOLLIN);
+// 写一条访问日志, 不做系统调用, 也不格式化字符串
+void http_conn::log_access(int method, const char* url, size_t url_len, int status, uint64_t bytes, uint64_t start, int protocol) {
+    if (!access_log::enabled()) {
+        return;
+    }
+    access_record rec;
+    rec.timestamp = access_log::now();
+    rec.bytes = bytes;
+    rec.latency = (rec.timestamp - start) / 1000;
+    rec.addr = m_cold->m_addr.sin_addr.s_addr;
+    rec.port = m_cold->m_addr.sin_port;
+    rec.status = status;
+    rec.method = method;
+    rec.protocol = protocol;
+    rec.url_len = url_len;
+    if (url_len > 0) {
+        memcpy(rec.url, url, url_len < access_record::URL_LEN ? url_len : access_record::URL_LEN);
+    }
+    if (url_len < access_record::URL_LEN) {
+        memset(rec.url + url_len, 0, access_record::URL_LEN - url_len);
+    }
+    access_log::append(rec);
+}
 
-            if (m_linger) {
-                init();
-                printf(">>>>> 函数http_conn::write执行完毕, 返回: true. \n");
-                return true;
-            } else {
-                printf(">>>>> 函数http_conn::write执行完毕, 返回: false. \n");
+// 以EPOLLONESHOT重新注册event事件. upstream为true时注册的是正在转发请求的上游fd
+void http_conn::rearm(int event, bool upstream) {
+    if (upstream) {
+        m_cold->m_upstream->arm(m_epfd, key() | UPSTREAM_KEY_FLAG, event);
+    } else {
+        m_transport->mod(m_sockfd, event, m_generation);
+    }
+}
+
+// 取一条到m_proxy_target的上游连接, 生成转发的请求
+bool http_conn::proxy_start() {
+    upstream_conn* up = proxy::acquire(m_cold->m_proxy_target);
+    if (!up) {
+        return false;
+    }
+    if (!up->start(m_url, m_cold->m_target, m_cold->m_host, m_cold->m_addr)) {
+        proxy::release(up, true);
+        return false;
+    }
+    m_cold->m_upstream = up;
+    return true;
+}
+
+// 推进转发, 转发结束(成功或失败)时归还上游连接
+int http_conn::proxy_step() {
+    while (true) {
+        upstream_conn* up = m_cold->m_upstream;
+        upstream_conn::STATUS st = up->step(m_sockfd, m_linger);
+        if (st < upstream_conn::DONE) {
+            return st;
+        }
+        bool retry = (st == upstream_conn::FAILED && up->reused);
+        if (st != upstream_conn::FAILED) {  // FAILED时改为回复502, 在发送502时记录
+            log_access(m_method, m_url, strlen(m_url), up->status, up->sent, m_cold->m_start_time, 1);
+        }
+        proxy::release(up, st == upstream_conn::DONE);
+        m_cold->m_upstream = NULL;
+        // 复用的空闲连接可能恰好在此时被上游关闭, 此时还没有向客户端发送任何数据, 换一条连接重试
+        if (retry && proxy_start()) {
+            continue;
+        }
+        return st;
+    }
+}
+
+/* 处理转发期间的事件. 经典模式下, 工作线程在proxy_start之后调用一次, 之后由主线程在上游fd的事件
+ * 和客户端的EPOLLOUT事件中调用; 协程模式下, 协程自己推进转发, 这里只需恢复协程 */
+bool http_conn::proxy_event() {
+    if (!m_cold->m_upstream) {
+        return true;  // 转发已经结束, 这是过期事件
+    }
+    if (m_coroutine && m_cold->m_coro) {
+        resume();
+        return true;
+    }
+    switch (proxy_step()) {
+        case upstream_conn::WAIT_UPSTREAM_IN:
+            rearm(EPOLLIN, true);
+            return true;
+        case upstream_conn::WAIT_UPSTREAM_OUT:
+            rearm(EPOLLOUT, true);
+            return true;
+        case upstream_conn::WAIT_CLIENT_OUT:
+            rearm(EPOLLOUT);
+            return true;
+        case upstream_conn::DONE:
+            if (!m_linger) {
+                return false;
+            }
+            init();  // 先初始化再注册EPOLLIN, 因为这里可能是工作线程
+            rearm(EPOLLIN);
+            return true;
+        case upstream_conn::FAILED:
+            // 还没有向客户端发送任何数据, 改为回复502, 由主线程发送
+            if (!process_write(BAD_GATEWAY)) {
                 return false;
             }
+            rearm(EPOLLOUT);
+            return true;
+        default:
+            return false;
+    }
+}
+
+#if HAS_COROUTINE
+// 恢复挂起的连接协程. 协程可能在执行中结束并关闭连接, 因此返回后不能再访问本对象的冷数据
+void http_conn::resume() {
+    std::coroutine_handle<>::from_address(m_cold->m_coro).resume();
+}
+
+// 协程结束(协程帧已销毁)后调用
+void http_conn::coroutine_exit() {
+    m_cold->m_coro = NULL;
+    if (!m_h2) {
+        close_conn();
+        return;
+    }
+    // 协程把连接交给了HTTP/2会话, 此后按经典模式处理. 帧的解析可能需要查找文件, 交给工作线程
+    if (!m_pool->append(this)) {
+        if (!m_h2->process()) {
+            close_conn();
+        }
+    }
+}
+
+/*
+ * 连接协程: 与经典模式的read() -> process() -> write()处理相同的请求, 但写成一个顺序的循环.
+ * 协程第一次被恢复, 以及每次从io_wait<EPOLLIN>返回时, fd上都有可读事件.
+ * 协程在主线程上被恢复; 只有需要文件系统调用时才切换到工作线程, 之后的发送也在工作线程上
+ * 直接进行, 不再经过主线程的EPOLLOUT事件. 协程结束(co_return)时, coroutine_exit关闭连接.
+ */
+conn_task<http_conn> http_conn::serve() {
+    while (true) {
+        // 1.读数据
+        if (!read()) {
+            co_return;
+        }
+        // 超过请求速率限制: 发送429应答后结束
+        if (!admit()) {
+            while (send_response() == 0) {
+                co_await io_wait<http_conn>{this, EPOLLOUT};
+            }
+            log_access(m_method, m_url, m_url ? strlen(m_url) : 0, m_cold->m_status, bytes_have_send, m_cold->m_start_time, 1);
+            co_return;
+        }
+        // 2.新连接的第一个请求以HTTP/2连接序言开头, 交给HTTP/2会话
+        if (m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0) {
+            int preface = http2_session::check_preface(m_cold->m_read_buf, m_read_index);
+            if (preface == 0) {  // 序言还没收全
+                co_await io_wait<http_conn>{this, EPOLLIN};
+                continue;
+            } else if (preface == 1) {
+                m_h2 = new http2_session(this);
+                m_h2->start();
+                co_return;
+            }
         }
+        // 3.解析HTTP请求, 请求不完整则继续等待数据
+        HTTP_CODE ret = process_read(false);
+        if (ret == NO_REQUEST) {
+            co_await io_wait<http_conn>{this, EPOLLIN};
+            continue;
+        }
+        // 4.查找资源: 保留路由和资源仓库在当前线程查找, 都未命中时切换到工作线程访问文件系统
+        if (ret == GET_REQUEST) {
+            ret = do_lookup();
+            if (ret == NO_REQUEST) {
+                co_await offload<http_conn, threadpool<http_conn> >{this, m_pool};
+                ret = do_file();
+            }
+            WEBSERVER_PROBE(lookup, m_sockfd, ret, ret == FILE_REQUEST ? m_cold->m_file_stat.st_size : 0);
+        }
+        // 5.转发给上游服务器, 等待上游或客户端就绪时挂起
+        if (ret == PROXY_REQUEST) {
+            ret = BAD_GATEWAY;
+            if (proxy_start()) {
+                int st;
+                while ((st = proxy_step()) < upstream_conn::DONE) {
+                    if (st == upstream_conn::WAIT_CLIENT_OUT) {
+                        co_await io_wait<http_conn>{this, EPOLLOUT};
+                    } else if (st == upstream_conn::WAIT_UPSTREAM_IN) {
+                        co_await io_wait<http_conn>{this, EPOLLIN, true};
+                    } else {
+                        co_await io_wait<http_conn>{this, EPOLLOUT, true};
+                    }
+                }
+                if (st == upstream_conn::ABORTED || (st == upstream_conn::DONE && !m_linger)) {
+                    co_return;
+                }
+                if (st == upstream_conn::DONE) {
+                    init();
+                    co_await io_wait<http_conn>{this, EPOLLIN};
+                    continue;
+                }
+            }
+        }
+        // 6.请求带有"Upgrade: h2c", 交给HTTP/2会话回复101并响应这个请求
+        if (m_cold->m_upgrade_h2c && ret != BAD_REQUEST) {
+            m_h2 = new http2_session(this);
+            if (m_h2->upgrade(m_cold->m_http2_settings, ret)) {
+                co_return;
+            }
+            delete m_h2;  // HTTP2-Settings非法, 仍按HTTP/1.1响应
+            m_h2 = NULL;
+        }
+        // 7.生成并发送应答, TCP写缓冲满时等待EPOLLOUT
+        if (!process_write(ret)) {
+            co_return;
+        }
+        int sent;
+        while ((sent = send_response()) == 0) {
+            co_await io_wait<http_conn>{this, EPOLLOUT};
+        }
+        // 以MSG_ZEROCOPY发送的内容在完成通知(EPOLLERR)到达之前不能解除映射
+        while (sent > 0 && zerocopy_pending()) {
+            co_await io_wait<http_conn>{this, 0};
+        }
+        log_access(m_method, m_url, m_url ? strlen(m_url) : 0, m_cold->m_status, bytes_have_send, m_cold->m_start_time, 1);
+        unmap();
+        if (sent < 0 || !m_linger) {
+            co_return;
+        }
+        // 8.保持连接, 等待下一个请求
+        init();
+        co_await io_wait<http_conn>{this, EPOLLIN};
     }
-}
\ No newline at end of file
+}
+#else
+// 编译器不支持协程时, main不允许开启协程模式, 下面的函数不会被调用
+void http_conn::resume() {}
+void http_conn::coroutine_exit() {}
+#endif
@@ -15,20 +15,79 @@
 #include <sys/epoll.h>
 #include <sys/uio.h>
 #include <string.h>
+#include <stdint.h>
+#include <atomic>
 #include "locker.h"
+#include "asset_store.h"
+#include "coroutine.h"
 
-class http_conn {
+class conn_table;
+class transport;
+class http2_session;
+struct upstream;
+class upstream_conn;
+template<typename T> class threadpool;
+
+/*
+ * epoll事件中携带的key: 低32位为文件描述符, 高32位为该fd所在槽位的代数(generation).
+ * fd被关闭后又被accept复用时, 槽位的代数会加1, 因此旧连接遗留在本轮events数组中
+ * 的事件可以通过代数不一致被识别出来并丢弃.
+ */
+inline uint64_t conn_key(int fd, uint32_t generation) {
+    return ((uint64_t)generation << 32) | (uint32_t)fd;
+}
+inline int key_fd(uint64_t key) {
+    return (int)(key & 0xffffffffu);
+}
+inline uint32_t key_generation(uint64_t key) {
+    return (uint32_t)(key >> 32);
+}
+// 上游连接(见proxy.h)的事件携带其客户端连接的key, 并置上这一位, 以便与客户端连接自己的事件区分
+const uint64_t UPSTREAM_KEY_FLAG = 1ull << 31;
+
+/*
+ * 连接对象分为冷热两部分: 
+ * 热数据(本类的成员)是每个事件都要访问的字段, 例如m_sockfd、各种索引、状态和bytes_to_send, 
+ * 它们被紧凑地放在两个cache line中, 所有连接的热数据在conn_table中连续存放;
+ * 冷数据(cold_data)是读写缓冲区、m_real_file、sockaddr_in和struct stat等大块数据, 
+ * 它们被放在类外, 只在连接建立时从conn_table的空闲链表中取出一块.
+ */
+class alignas(64) http_conn {
+    friend class http2_session;
 public: 
     // 属性
     static int m_epfd;  // 所有文件描述符均被添加到通过一个epoll实例
+    static transport* m_transport;  // 客户端连接的收发数据和事件注册都通过它进行(见transport.h)
     static int m_user_count;  // 记录用户的数量
+    static conn_table* m_table;  // 连接表, 冷数据块从这里分配
+    static bool m_coroutine;  // 是否使用协程模式(见coroutine.h)
+    static threadpool<http_conn>* m_pool;  // 协程模式下, 协程通过它切换到工作线程
+    static size_t m_zerocopy_min;  // 应答内容不小于该字节数时以MSG_ZEROCOPY发送, 0表示不使用
+    static size_t m_large_file;  // 不小于该字节数的文件的请求进入LANE_LARGE通道, 0表示不区分
+    static std::atomic<long> m_zerocopy_sends;  // 以MSG_ZEROCOPY发送的次数
+    static std::atomic<long> m_zerocopy_copied;  // 内核报告实际发生了复制的次数
+    static size_t m_prefetch_max;  // 工作线程在返回前预读进内存的最大字节数, 0表示不预读
+    static std::atomic<long> m_resident_hits;  // 映射时内容已全部在页缓存中的文件请求数
+    static std::atomic<long> m_resident_misses;  // 映射时有页面不在页缓存中的文件请求数
+    static std::atomic<long> m_prefetched_pages;  // 由工作线程预读的页面数
+    static bool m_register_once;  // 单次注册模式: 连接只注册一次(边沿触发的EPOLLIN|EPOLLOUT), 不再逐个请求重新注册
+    static std::atomic<bool> m_draining;  // 平滑升级后旧进程正在排空连接: 应答一律为Connection: close
     static const int FILENAME_LEN = 200;  // 文件名的最大长度
     static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区大小
     static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区大小
+    static const int ROUTE_BODY_SIZE = 512;  // 保留路由应答内容的最大长度
 
     // HTTP请求方法，这里只支持GET
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
     
+    /*
+        线程池中任务通道的分类, 由lane()在append之前决定
+        LANE_FAST   :   资源仓库命中或保留路由, 不需要文件系统调用
+        LANE_FILE   :   需要访问文件系统(以及HTTP/2、不完整的请求等不能提前判断的任务)
+        LANE_LARGE  :   上一次访问时不小于m_large_file字节的文件
+    */
+    enum LANE { LANE_FAST = 0, LANE_FILE, LANE_LARGE };
+    
     /*
         解析客户端请求时，主状态机的状态
         CHECK_STATE_REQUESTLINE: 当前正在分析请求行
@@ -46,10 +105,14 @@ public:
         NO_RESOURCE         :   表示服务器没有资源
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限
         FILE_REQUEST        :   文件请求,获取文件成功
+        ROUTE_REQUEST       :   请求的是保留路由(如/health、/stats), 应答内容已生成在m_route_body中
+        PROXY_REQUEST       :   请求需要转发给上游服务器, 匹配的代理规则在m_proxy_target中
+        BAD_GATEWAY         :   转发给上游服务器失败
+        TOO_MANY_REQUESTS   :   客户端地址超过了请求速率限制
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, ROUTE_REQUEST, PROXY_REQUEST, BAD_GATEWAY, TOO_MANY_REQUESTS, INTERNAL_ERROR, CLOSED_CONNECTION };
     
     /* 
         从状态机的三种可能状态，即行的读取状态，分别表示
@@ -59,8 +122,47 @@ public:
         这个状态, 是本类中parse_line()函数的返回值.
     */
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+
+    /*
+        单次注册模式下m_owner的各位(经典模式只使用OWNER_HELD, 见hand_off)
+        OWNER_HELD  :   有线程(主线程或工作线程)正在处理这个连接, 其他线程收到的事件只记下, 不处理
+        OWNER_IN    :   记下的EPOLLIN
+        OWNER_OUT   :   记下的EPOLLOUT
+        OWNER_HUP   :   记下的EPOLLRDHUP/EPOLLHUP/EPOLLERR
+    */
+    enum OWNER { OWNER_HELD = 1, OWNER_IN = 2, OWNER_OUT = 4, OWNER_HUP = 8 };
+
+    // 冷数据: 体积大, 但不是每个事件都访问, 存放在类外
+    struct cold_data {
+        sockaddr_in m_addr;  // 通信的socket地址
+        char m_read_buf[READ_BUFFER_SIZE];  // 读缓冲区
+        char m_write_buf[WRITE_BUFFER_SIZE];  // 写缓冲区
+        char m_real_file[FILENAME_LEN];  // 客户所请求的文件的完整路径, 等于doc_root + m_url
+        char m_url_key[FILENAME_LEN];  // 规范化后的URL(见url.h), m_url指向这里
+        char* m_target;  // 请求行中原始的目标URL(含查询串), 转发给上游时取其中的查询串
+        struct stat m_file_stat;  // 目标文件的状态. 通过该变量可判断文件是否存在, 是否为目录, 是否可读, 并获取文件大小等信息
+        char* m_version;  // HTTP协议版本，只支持HTTP1.1
+        char* m_host;  // 主机名
+        bool m_upgrade_h2c;  // 请求是否带有"Upgrade: h2c"
+        char* m_http2_settings;  // HTTP2-Settings首部的值
+        bool m_accept_gzip;  // 请求的Accept-Encoding是否接受gzip
+        bool m_admitted;  // 当前请求是否已经通过了限流检查(已取过令牌)
+        const char* m_mime;  // 应答内容的MIME类型
+        char m_route_body[ROUTE_BODY_SIZE];  // 保留路由的应答内容
+        int m_route_len;
+        const upstream* m_proxy_target;  // 请求匹配的代理规则
+        upstream_conn* m_upstream;  // 正在转发请求的上游连接, 没有转发时为NULL
+        uint64_t m_start_time;  // 读到请求第一个字节的时间(纳秒), 用于访问日志
+        int m_status;  // 应答状态码, 用于访问日志
+        void* m_coro;  // 协程模式下, 连接协程的协程帧(coroutine_handle::address()), 协程结束后为NULL
+        bool m_zerocopy;  // socket是否开启了SO_ZEROCOPY. 内核报告发送时发生了复制后, 本连接改回普通发送
+        uint32_t m_zc_sent;  // 以MSG_ZEROCOPY发送成功的次数, 内核按同样的顺序为每次发送编号
+        uint32_t m_zc_done;  // 已收到完成通知的发送次数
+        uint32_t m_capture_id;  // 流量录制中的连接序号, 不录制时为0
+        cold_data* m_next;  // 在conn_table的空闲链表中时, 指向下一个空闲块
+    };
 public:
-    http_conn() {}  // 构造函数
+    http_conn(): m_sockfd(-1), m_generation(0), m_owner(0), m_file_address(NULL), m_asset(NULL), m_h2(NULL), m_cold(NULL) {}  // 构造函数
     ~http_conn() {}  // 析构函数
 public:
     void init(int sockfd, const sockaddr_in& addr);  // 初始化连接相关的信息
@@ -68,12 +170,41 @@ public:
     bool read();  // 非阻塞地读数据
     void process();  // 处理客户端请求并响应
     bool write();  // 非阻塞地写数据
+    bool admit();  // read之后、交给线程池之前调用: 检查请求速率限制. 返回false表示已生成429应答, 应注册EPOLLOUT发送
+    static void reject(int fd);  // 连接数超过限制时, 在accept之后直接向fd发送429应答(尽力而为, 不等待)
+    void overload();  // 线程池的任务队列已满, 交不出请求时由主线程调用: 发送503应答并关闭连接
+    int lane();  // 线程池的分类函数: 选择本任务进入的通道(LANE)
+    int sockfd() const { return m_sockfd; }
+    uint32_t generation() const { return m_generation; }
+    uint64_t key() const { return conn_key(m_sockfd, m_generation); }  // 本连接在epoll中注册的key
+
+    // 下面这组函数用于协程模式
+    bool in_coroutine() const { return m_cold->m_coro != NULL; }  // 连接是否由协程处理
+    void resume();  // 恢复挂起的连接协程
+    void rearm(int event, bool upstream = false);  // 以EPOLLONESHOT重新注册event事件, 供io_wait使用
+    void coroutine_exit();  // 协程结束后调用: 关闭连接, 或交给HTTP/2会话
+    bool proxy_event();  // 转发请求期间, 上游fd的事件和客户端的EPOLLOUT事件由它处理. 返回false表示应关闭连接
+
+    // 下面这组函数用于MSG_ZEROCOPY发送
+    bool zerocopy_pending() const { return m_cold->m_zc_sent != m_cold->m_zc_done; }  // 是否有发送还在等待完成通知
+    bool zerocopy_event(uint32_t events);  // 错误队列中有完成通知(EPOLLERR)时由主线程调用. 返回false表示应关闭连接
+
+    // 下面这组函数用于单次注册模式
+    bool claim(uint32_t events);  // 主线程收到事件时调用: 把事件记在连接上. 返回true表示调用者取得了连接, 应调用advance
+    bool advance();  // 取得连接的线程调用: 处理记下的事件. 返回true表示读到了新的请求数据, 调用者仍持有连接; false表示已放手(或已关闭连接)
+
+    // 下面这组函数用于平滑升级(见handoff.h)
+    static bool warm(const char* url);  // 新进程开始服务之前调用: 预热url对应文件的元数据和页缓存. 文件不存在时返回false
+    bool close_if_idle();  // 排空开始时由主线程调用: 连接上没有正在处理的请求时关闭它, 返回true表示已关闭
+    // 经典模式下同样用OWNER_HELD标记连接在线程池中, 排空时据此判断连接是否空闲. 只由主线程调用
+    void hand_off() { m_owner.store(OWNER_HELD, std::memory_order_relaxed); }  // 交给线程池之前
+    void handed_back() { m_owner.store(0, std::memory_order_relaxed); }  // 又收到了连接的事件(EPOLLONESHOT, 工作线程已处理完)
     
 private:
+    // ---------- 热数据, 不超过128字节(两个cache line) ----------
     int m_sockfd;  // 这个HTTP任务对应的socket
-    sockaddr_in m_addr;  // 通信的socket地址
+    uint32_t m_generation;  // 槽位代数, 每次init(sockfd, addr)时加1
 
-    char m_read_buf[READ_BUFFER_SIZE];  // 读缓冲区
     int m_read_index;  // 标识读m_read_buf中已经读入的客户端数据的字节数
     int m_start_line;  // 当前正在解析的行的起始位置
     int m_checked_index;  // 当前正在分析的字符在读缓冲区的位置
@@ -81,34 +212,52 @@ private:
     CHECK_STATE m_check_state;  // 主状态机当前所处状态
     METHOD m_method;  // 请求方法
 
-    char m_real_file[FILENAME_LEN];  // 客户所请求的文件的完整路径, 等于doc_root + m_url
-    char* m_url;  // 所请求文件的名字
-    char* m_version;  // HTTP协议版本，只支持HTTP1.1
-    char* m_host;  // 主机名
     bool m_linger;  // 指示HTTP请求是否要保持连接
+    std::atomic<uint8_t> m_owner;  // 单次注册模式下连接的所有权和记下的事件(OWNER_*); 经典模式下标记连接在线程池中
     int m_content_length;  // HTTP请求体的长度
-    
-    char m_write_buf[WRITE_BUFFER_SIZE];  // 写缓冲区
     int m_write_index;  // 写缓冲区中待发送的字节数 = 写缓冲区中最后一个字符的下一个位置的索引
-    struct stat m_file_stat;  // 目标文件的状态. 通过该变量可判断文件是否存在, 是否为目录, 是否可读, 并获取文件大小等信息
-    char* m_file_address;  // 客户所请求的文件被mmap映射到内存中的起始位置
-    struct iovec m_iv[2];  // writev的输入参数, 保存两块分散内存的内容, 一个是m_write_buf, 保存应答报文的状态行和首部行, 一个是m_file_address, 保存应答报文的具体返回内容
     int m_iv_count;  // writev的输入参数, m_iv数组的长度
 
     int bytes_to_send;
     int bytes_have_send;
 
+    char* m_url;  // 所请求文件的名字
+    char* m_file_address;  // 客户所请求的文件被mmap映射到内存中的起始位置
+    const asset_store::asset* m_asset;  // 若响应来自预加载的资源仓库, 指向该资源(此时m_file_address指向仓库内存, 不需要munmap)
+    struct iovec m_iv[2];  // writev的输入参数, 保存两块分散内存的内容, 一个是m_write_buf, 保存应答报文的状态行和首部行, 一个是m_file_address, 保存应答报文的具体返回内容
+    http2_session* m_h2;  // 若连接已切换为HTTP/2, 指向其会话, 否则为NULL
+    cold_data* m_cold;  // 冷数据块, 连接建立时分配, 关闭时归还
+
     void init();  // 初始化其他信息
-    HTTP_CODE process_read();  // 解析HTTP请求报文
+    HTTP_CODE process_read(bool resolve = true);  // 解析HTTP请求报文, resolve为false时解析完请求后不查找资源, 返回GET_REQUEST
+    int send_response();  // 发送应答, 返回1表示发完, 0表示TCP写缓冲已满, -1表示出错
+    bool finish_response();  // 应答发完且内核不再引用应答内容: 解除映射, 准备处理下一个请求. 返回false表示应关闭连接
+    bool reap_zerocopy();  // 读出错误队列中的MSG_ZEROCOPY完成通知, 遇到真正的socket错误时返回false
+#if HAS_COROUTINE
+    conn_task<http_conn> serve();  // 连接协程
+#endif
     bool process_write(HTTP_CODE ret);  // 构造HTTP应答报文
+    bool process_request();  // process的主体: 解析请求并生成(单次注册模式下还直接发送)应答. 返回false表示已关闭连接
+    void arm(int event);  // 以EPOLLONESHOT重新注册event事件; 单次注册模式下什么也不做
 
     // 下面这组函数被process_read调用, 用以解析HTTP请求
     LINE_STATUS parse_line();  // 子函数: 从缓冲区中读取一行
     HTTP_CODE parse_request_line(char* text);  // 子函数: 解析请求首行
     HTTP_CODE parse_headers(char* text);  // 子函数: 解析请求头(首部行)
     HTTP_CODE parse_content(char* text);  // 子函数: 解析请求体
-    inline char* get_line() { return m_read_buf + m_start_line; }
+    inline char* get_line() { return m_cold->m_read_buf + m_start_line; }
     HTTP_CODE do_request();  // 子函数: 找到客户端所请求的文件, 将其映射到内存当中
+    HTTP_CODE do_lookup();  // do_request的前半部分: 查找保留路由和资源仓库, 不会阻塞, 都未命中时返回NO_REQUEST
+    HTTP_CODE do_file();  // do_request的后半部分: 在网站根目录下查找并映射文件, 会阻塞在文件系统调用上
+    void prefetch(int fd);  // 在工作线程中把刚映射的文件内容读进页缓存, 使主线程的writev不会因缺页而阻塞
+    HTTP_CODE do_route(int route);  // 子函数: 生成保留路由的应答内容
+
+    // 下面这组函数用于反向代理
+    bool proxy_start();  // 取一条上游连接并生成转发的请求, 失败返回false(应回复502)
+    int proxy_step();  // 推进转发, 返回upstream_conn::STATUS; 转发结束时归还上游连接
+
+    // 请求结束时写一条访问日志, protocol为1(HTTP/1.1)或2(HTTP/2)
+    void log_access(int method, const char* url, size_t url_len, int status, uint64_t bytes, uint64_t start, int protocol);
 
     // 下面这一组函数被process_write调用以填充HTTP应答
     void unmap();
@@ -122,4 +271,6 @@ private:
     bool add_blank_line();
 };
 
+static_assert(sizeof(http_conn) <= 128, "http_conn的热数据不应超过两个cache line");
+
 #endif
\ No newline at end of file
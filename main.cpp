@@ -6,13 +6,42 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <signal.h>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "conn_table.h"
+#include "asset_store.h"
+#include "proxy.h"
+#include "access_log.h"
+#include "neg_cache.h"
+#include "rate_limiter.h"
+#include "capture.h"
+#include "transport.h"
+#include "probes.h"
+#include "handoff.h"
+#include "hot_urls.h"
+#include "event_dispatcher.h"
 
 #define MAX_FD 65535  // 文件描述符的最大数量
 #define MAX_EVENT_NUMBER 10000  // epoll可检测事件的最大数量
+#define THREAD_NUMBER 8  // 线程池的线程数
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+// epoll实例的busy poll参数(Linux 6.9以上), 旧的头文件中没有
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
 
 // 添加信号捕捉
 void addsig(int sig, void(handler)(int)) {
@@ -23,134 +52,488 @@ void addsig(int sig, void(handler)(int)) {
     sigaction(sig, &sa, NULL);  // 注册sig信号的处理方法, 第三个参数一般传递NULL
 }
 
-// 向epoll实例添加文件描述符
-extern void addfd(int epfd, int fd, bool oneshot, bool edge);
+// 网站根目录
+extern const char* doc_root;
+
+// 收到SIGHUP时置1, 由主线程在事件循环中重新加载资源仓库
+static volatile sig_atomic_t reload_assets = 0;
+void sighup_handler(int sig) {
+    reload_assets = 1;
+}
+
+// 录制流量时, 收到SIGINT/SIGTERM后置1, 主线程退出事件循环并写出剩余的录制记录
+static volatile sig_atomic_t stop_server = 0;
+void stop_handler(int sig) {
+    stop_server = 1;
+}
+
+// 单调时钟, 单位微秒
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 排空: 关闭所有空闲连接(HTTP/2连接发送GOAWAY, 已有的流发完后关闭), 返回立即关闭的连接数.
+// 经典模式下工作线程处理完后重新注册EPOLLIN的连接, 要等到下一个事件才由主线程清除OWNER_HELD(见hand_off),
+// 没有新数据的连接(如空闲的HTTP/2会话)会一直显得不空闲. 只有主线程和正在处理任务的工作线程向线程池添加任务,
+// 因此线程池空闲时所有连接都不在工作线程中, 可以先把它们收回
+static int close_idle(conn_table* users, threadpool<http_conn>* pool) {
+    bool reclaim = !http_conn::m_register_once && pool->idle();
+    int closed = 0;
+    for (int fd = 0; fd < users->size(); fd++) {
+        http_conn& c = (*users)[fd];
+        if (c.sockfd() == -1) {
+            continue;
+        }
+        if (reclaim) {
+            c.handed_back();
+        }
+        if (c.close_if_idle()) {
+            closed++;
+        }
+    }
+    return closed;
+}
+
+// 打印用法
+static void usage(const char* prog) {
+    printf("按照如下格式运行: %s port_number [-m max_file_size] [-H] [-L] [-C] [-P prefix=upstream]... [-A log_dir] [-Z min_bytes] [-N ttl] [-k pack_file] [-c max_conns] [-r rate[/burst]] [-T capture_file] [-B large_bytes] [-W fast,file,large[/max_large]] [-F prefetch_bytes] [-S spin_us] [-E] [-U control_path] [-D drain_seconds]\n", prog);
+    printf("  -m max_file_size : 启动时把网站根目录下不超过该大小(字节)的文件预加载到内存, 收到SIGHUP时重新加载\n");
+    printf("  -H               : 预加载的内存使用大页\n");
+    printf("  -L               : 用mlock把预加载的内存锁定在物理内存中\n");
+    printf("  -C               : 协程模式, 每个连接作为一个C++20协程运行(需要以-std=c++20编译)\n");
+    printf("  -P prefix=upstream : 把URL以prefix开头的请求转发给上游, upstream为host:port或unix:/path, 可以指定多次\n");
+    printf("  -A log_dir       : 把二进制访问日志写到log_dir目录(需要以-lz链接), 用tools/access_log_decode解码\n");
+    printf("  -Z min_bytes     : 应答内容不小于min_bytes字节时以MSG_ZEROCOPY发送(需要Linux 4.14以上)\n");
+    printf("  -N ttl           : 否定缓存中不存在的路径的有效期(秒), 默认5, 0表示不使用否定缓存\n");
+    printf("  -k pack_file     : 从资源包(由tools/pack_build生成)提供资源, 代替-m; 收到SIGHUP时重新映射\n");
+    printf("  -c max_conns     : 每个客户端IP地址的最大并发连接数, 超过时回复429并关闭连接\n");
+    printf("  -r rate[/burst]  : 每个客户端IP地址每秒的请求数(允许突发burst个, 默认等于rate), 超过时回复429\n");
+    printf("  -T capture_file  : 把客户端连接和原始请求字节录制到capture_file, 用tools/replay重放; 以SIGINT/SIGTERM结束\n");
+    printf("  -B large_bytes   : 不小于该大小(字节)的文件的请求进入线程池的大文件通道, 默认1048576, 0表示不区分\n");
+    printf("  -W fast,file,large[/max_large] : 线程池三个通道(缓存命中/访问文件/大文件)的调度权重, 默认4,2,1;\n");
+    printf("                     max_large为同时处理大文件通道的最大线程数, 默认为线程数的一半\n");
+    printf("  -S spin_us       : 忙轮询模式: 主线程在最后一个事件之后spin_us微秒内以0超时调用epoll_wait, 工作线程处理完任务后自旋spin_us微秒再睡眠;\n");
+    printf("                     空闲超过spin_us后回到阻塞等待. 同时尝试开启socket和epoll的busy poll\n");
+    printf("  -F prefetch_bytes : 文件不在页缓存中时, 工作线程先把前prefetch_bytes字节读进内存再交给主线程发送, 默认67108864, 0表示不预读\n");
+    printf("  -E               : 单次注册模式: 连接只注册一次(边沿触发的EPOLLIN|EPOLLOUT), 工作线程处理完请求后直接发送,\n");
+    printf("                     keep-alive的请求不再需要epoll_ctl. 只支持HTTP/1.1, 不能与-C、-Z、-P同时使用\n");
+    printf("  -U control_path  : 平滑升级: 在Unix域套接字control_path上等待新进程. 以相同的-U启动新进程时, 它从旧进程接过监听套接字,\n");
+    printf("                     按旧进程的热点URL预热后开始服务, 旧进程停止accept并排空连接后退出(见handoff.h)\n");
+    printf("  -D drain_seconds : 平滑升级后旧进程排空连接的最长时间(秒), 默认30\n");
+}
+
+// 平滑升级: 按旧进程的热点URL列表(每行"计数 URL")预热, 并把计数记入本进程的热点URL. 返回预热的文件数
+static int prewarm(const std::string& hot) {
+    int warmed = 0;
+    size_t pos = 0;
+    while (pos < hot.size()) {
+        size_t end = hot.find('\n', pos);
+        if (end == std::string::npos) {
+            end = hot.size();
+        }
+        std::string line = hot.substr(pos, end - pos);
+        pos = end + 1;
+        size_t space = line.find(' ');
+        if (space == std::string::npos || line[space + 1] != '/') {
+            continue;
+        }
+        const char* url = line.c_str() + space + 1;
+        if (http_conn::warm(url)) {
+            hot_urls::record(url, line.size() - space - 1, strtoul(line.c_str(), NULL, 10));
+            warmed++;
+        }
+    }
+    return warmed;
+}
+
+// 向epoll实例添加文件描述符, 事件中携带的key由fd和槽位代数generation组成
+extern void addfd(int epfd, int fd, bool oneshot, bool edge, uint32_t generation = 0);
 // 从epoll实例删除文件描述符
 extern void removefd(int epfd, int fd);
 // 修改epoll实例中要检测的文件描述符的属性, 将原属性修改为event, 
 // 注意: 修改时无需添加EPOLLRDHUP, EPOLLONESHOT. 此函数会自动添加.
-extern void modfd(int epfd, int fd, int event);
+extern void modfd(int epfd, int fd, int event, uint32_t generation = 0);
 
 int main(int argc, char* argv[]) {
     // 1.从终端接收参数
     // 1-1 参数正确性判断
     if (argc <= 1) {
-        printf("按照如下格式运行: %s port_number\n", basename(argv[0]));
+        usage(basename(argv[0]));
         exit(-1);
     }
     // 1-2 参数接收
     // argv[0]: 程序名
     // argv[1]: 端口号
+    // 之后为可选参数, 见usage
     int port = atoi(argv[1]);
+    size_t asset_max_size = 0;  // 预加载文件的大小上限, 0表示不预加载
+    bool asset_huge = false;
+    bool asset_lock = false;
+    const char* log_dir = NULL;  // 访问日志目录, NULL表示不写访问日志
+    int neg_ttl = 5;  // 否定缓存的有效期(秒), 0表示不使用
+    const char* pack_path = NULL;  // 资源包, NULL表示不使用
+    int max_conns_per_ip = 0;  // 每个IP地址的最大连接数, 0表示不限
+    int rate = 0, burst = 0;  // 每个IP地址每秒的请求数和突发请求数, 0表示不限
+    const char* capture_path = NULL;  // 流量录制文件, NULL表示不录制
+    int lane_weight[3] = {4, 2, 1};  // 线程池各通道的调度权重
+    int max_large = THREAD_NUMBER / 2;  // 同时处理大文件通道的最大线程数
+    int spin_us = 0;  // 忙轮询的时间窗口(微秒), 0表示不忙轮询
+    bool has_proxy = false;  // 是否有代理规则
+    const char* control_path = NULL;  // 平滑升级的控制套接字, NULL表示不支持平滑升级
+    int drain_seconds = 30;  // 平滑升级后排空连接的最长时间
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "m:HLCP:A:Z:N:k:c:r:T:B:W:F:S:EU:D:")) != -1) {
+        switch (opt) {
+            case 'm': asset_max_size = strtoul(optarg, NULL, 10); break;
+            case 'H': asset_huge = true; break;
+            case 'L': asset_lock = true; break;
+            case 'C':
+#if HAS_COROUTINE
+                http_conn::m_coroutine = true;
+                break;
+#else
+                printf("当前编译器不支持C++20协程, 请以-std=c++20重新编译\n");
+                exit(-1);
+#endif
+            case 'P':
+                if (!proxy::add(optarg)) {
+                    printf("代理规则无效: %s\n", optarg);
+                    exit(-1);
+                }
+                has_proxy = true;
+                break;
+            case 'A': log_dir = optarg; break;
+            case 'Z': http_conn::m_zerocopy_min = strtoul(optarg, NULL, 10); break;
+            case 'N': neg_ttl = atoi(optarg); break;
+            case 'k': pack_path = optarg; break;
+            case 'c': max_conns_per_ip = atoi(optarg); break;
+            case 'T': capture_path = optarg; break;
+            case 'B': http_conn::m_large_file = strtoul(optarg, NULL, 10); break;
+            case 'F': http_conn::m_prefetch_max = strtoul(optarg, NULL, 10); break;
+            case 'S': spin_us = atoi(optarg); break;
+            case 'E': http_conn::m_register_once = true; break;
+            case 'U': control_path = optarg; break;
+            case 'D': drain_seconds = atoi(optarg); break;
+            case 'W': {
+                char* slash = strchr(optarg, '/');
+                if (sscanf(optarg, "%d,%d,%d", &lane_weight[0], &lane_weight[1], &lane_weight[2]) != 3) {
+                    usage(basename(argv[0]));
+                    exit(-1);
+                }
+                if (slash) {
+                    max_large = atoi(slash + 1);
+                }
+                break;
+            }
+            case 'r': {
+                char* slash = NULL;
+                rate = strtol(optarg, &slash, 10);
+                burst = *slash == '/' ? atoi(slash + 1) : rate;
+                break;
+            }
+            default: usage(basename(argv[0])); exit(-1);
+        }
+    }
+
+    // 单次注册模式下, 连接的所有权由m_owner标志管理, 协程、MSG_ZEROCOPY和反向代理仍依赖EPOLLONESHOT重新注册
+    if (http_conn::m_register_once && (http_conn::m_coroutine || http_conn::m_zerocopy_min > 0 || has_proxy)) {
+        printf("-E不能与-C、-Z、-P同时使用\n");
+        exit(-1);
+    }
 
     // 2.对SIGPIE信号进行处理
     addsig(SIGPIPE, SIG_IGN);
 
-    // 3.创建并初始化线程池
+    // 3.预加载静态资源(或者映射资源包), 并在收到SIGHUP时重新加载
+    if (asset_max_size > 0 || pack_path) {
+        asset_store* store = pack_path ? asset_store::load_pack(pack_path, asset_lock)
+            : asset_store::load(doc_root, asset_max_size, asset_huge, asset_lock);
+        if (!store) {
+            exit(-1);
+        }
+        asset_store::publish(store);
+        printf("资源预加载完成: %d 个文件, %zu 字节\n", store->count(), store->bytes());
+        addsig(SIGHUP, sighup_handler);
+    }
+
+    // 4.创建并初始化线程池, 以及访问日志的后台线程
+    // 创建线程前先阻塞SIGHUP(以及SIGINT、SIGTERM), 工作线程会继承这个信号掩码, 从而保证这些信号总是由主线程处理, 能够打断epoll_wait
+    sigset_t hup_mask;
+    sigemptyset(&hup_mask);
+    sigaddset(&hup_mask, SIGHUP);
+    sigaddset(&hup_mask, SIGINT);
+    sigaddset(&hup_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &hup_mask, NULL);
     threadpool<http_conn>* pool = NULL;
     try{
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(THREAD_NUMBER);
     } catch(...) {
         exit(-1);
     }
-
-    // 4.创建监听套接字
-    int lfd = socket(PF_INET, SOCK_STREAM, 0);
-    if (lfd == -1) {
-        perror("socket");
+    // 大文件通道限制线程数, 其余工作线程总能处理缓存命中的小请求
+    pool->set_lane(http_conn::LANE_FAST, lane_weight[0], 0);
+    pool->set_lane(http_conn::LANE_FILE, lane_weight[1], 0);
+    pool->set_lane(http_conn::LANE_LARGE, lane_weight[2], max_large > 0 ? max_large : 1);
+    // 忙轮询要占用CPU, 只有一个CPU时自旋的线程会和它等待的线程抢CPU, 反而增加延迟
+    if (spin_us > 0 && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        printf("只有一个CPU, 不使用忙轮询模式\n");
+        spin_us = 0;
+    }
+    pool->set_spin(spin_us);
+    if (log_dir && !access_log::open(log_dir)) {
+        printf("无法打开访问日志目录: %s\n", log_dir);
         exit(-1);
     }
+    if (capture_path) {
+        if (!capture::open(capture_path)) {
+            exit(-1);
+        }
+        addsig(SIGINT, stop_handler);
+        addsig(SIGTERM, stop_handler);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &hup_mask, NULL);
+    http_conn::m_pool = pool;  // 协程模式下, 连接协程通过线程池执行会阻塞的工作
 
-    // 5.设置端口复用
-    int reuse = 1;
-    setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
-
-    // 6.绑定
-    struct sockaddr_in saddr;
-    saddr.sin_family = AF_INET;
-    saddr.sin_port = htons(port);
-    saddr.sin_addr.s_addr = INADDR_ANY;
-    int ret = bind(lfd, (struct sockaddr*)&saddr, sizeof(saddr));
-    if (ret == -1) {
-        perror("bind");
-        exit(-1);
+    // 5.平滑升级: 有旧进程在运行时, 从它那里接过监听套接字和热点URL列表, 跳过6~8
+    int lfd = -1;
+    int upgrade_conn = -1;  // 与旧进程的控制连接
+    std::string hot;
+    if (control_path) {
+        upgrade_conn = handoff::take(control_path, &lfd, hot);
+        if (upgrade_conn == -2) {
+            printf("无法从旧进程接过监听套接字\n");
+            exit(-1);
+        }
     }
+    int reuse = 1;
+    if (upgrade_conn >= 0) {
+        printf("从旧进程接过监听套接字, 开始预热\n");
+    } else {
+        // 6.创建监听套接字, 设置端口复用
+        lfd = socket(PF_INET, SOCK_STREAM, 0);
+        if (lfd == -1) {
+            perror("socket");
+            exit(-1);
+        }
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
 
-    // 7.设置监听
-    ret = listen(lfd, 5);
-    if (ret == -1) {
-        perror("listen");
-        exit(-1);
-    } else if (ret == 0) {
-        printf("开始监听!\n");
+        // 7.绑定
+        struct sockaddr_in saddr;
+        saddr.sin_family = AF_INET;
+        saddr.sin_port = htons(port);
+        saddr.sin_addr.s_addr = INADDR_ANY;
+        int ret = bind(lfd, (struct sockaddr*)&saddr, sizeof(saddr));
+        if (ret == -1) {
+            perror("bind");
+            exit(-1);
+        }
+
+        // 8.设置监听
+        ret = listen(lfd, 5);
+        if (ret == -1) {
+            perror("listen");
+            exit(-1);
+        } else if (ret == 0) {
+            printf("开始监听!\n");
+        }
     }
 
-    // 8.创建epoll实例, 并将监听描述符加入epoll实例
+    // 9.创建epoll实例, 并将监听描述符加入epoll实例
     int epfd = epoll_create(1);
     if (epfd == -1) {
         perror("epoll");
         exit(-1);
     }
     addfd(epfd, lfd, false, false);  // lfd无需设为EPOLLONESHOT
+    // 忙轮询模式: 尽量让内核也在收包路径上忙轮询. 这些选项需要较新的内核(以及CAP_NET_ADMIN), 失败时忽略
+    if (spin_us > 0) {
+        setsockopt(lfd, SOL_SOCKET, SO_BUSY_POLL, &spin_us, sizeof(spin_us));
+        setsockopt(lfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &reuse, sizeof(reuse));
+        struct epoll_params params;
+        memset(&params, 0, sizeof(params));
+        params.busy_poll_usecs = spin_us;
+        params.busy_poll_budget = 8;
+        params.prefer_busy_poll = 1;
+        if (ioctl(epfd, EPIOCSPARAMS, &params) == -1) {
+            printf("epoll不支持busy poll参数, 只在用户态忙轮询\n");
+        }
+    }
+    // 否定缓存通过inotify得知网站根目录中出现了新文件, inotify的fd同样加入epoll实例
+    if (neg_ttl > 0 && neg_cache::open(doc_root, neg_ttl)) {
+        addfd(epfd, neg_cache::fd(), false, false);
+    }
+    // 收到SIGHUP时资源仓库在后台重新加载, 加载完成的通知同样通过epoll送达主线程
+    if (asset_max_size > 0 || pack_path) {
+        addfd(epfd, asset_store::reload_fd(), false, false);
+    }
+    // 按客户端IP地址限制连接数和请求速率
+    rate_limiter::enable(max_conns_per_ip, rate, burst);
     http_conn::m_epfd = epfd;  // 将http_conn的静态属性m_epfd初始化为epfd
+    socket_transport net(epfd);  // 客户端连接通过真实的socket收发
+    http_conn::m_transport = &net;
 
-    // 9.开始接受连接请求, 并读取数据、创建任务、
-    // 创建一个数组, 保存所有客户端的信息
-    // 注意, 该数组的元素为类类型, 在定义时即被默认初始化
-    http_conn* users = new http_conn[MAX_FD];
+    // 10.开始接受连接请求, 并读取数据、创建任务、
+    // 创建连接表, 保存所有客户端的信息, 以文件描述符为下标
+    conn_table* users = NULL;
+    try {
+        users = new conn_table(MAX_FD);
+    } catch(...) {
+        exit(-1);
+    }
+    http_conn::m_table = users;  // 将http_conn的静态属性m_table初始化为users
+    event_dispatcher dispatcher(users, &net, pool);
+    // 平滑升级: 预热完成后通知旧进程停止accept. 之后在控制套接字上等待下一次升级
+    if (upgrade_conn >= 0) {
+        int warmed = prewarm(hot);
+        handoff::ready(upgrade_conn);
+        printf("预热完成: %d 个文件, 旧进程开始排空连接\n", warmed);
+    }
+    int ctl = -1;  // 控制套接字
+    int ctl_conn = -1;  // 正在交接的新进程
+    uint64_t drain_deadline = 0;  // 排空的截止时间, 0表示没有在排空
+    uint64_t next_sweep = 0;  // 排空期间下一次检查空闲连接的时间
+    if (control_path) {
+        ctl = handoff::listen(control_path);
+        if (ctl == -1) {
+            exit(-1);
+        }
+        addfd(epfd, ctl, false, false);
+    }
     // 创建epoll_wait函数的传出参数
     epoll_event events[MAX_EVENT_NUMBER];
+    uint64_t last_active = 0;  // 忙轮询模式下, 最后一次收到事件的时间
     while(true) {
-        // 9-1 调用epoll_wait, 检测文件描述符的属性
-        int num = epoll_wait(epfd, events, MAX_EVENT_NUMBER, -1);
+        // 10-1 调用epoll_wait, 检测文件描述符的属性
+        // 忙轮询模式下, 最近spin_us微秒内有过事件时不睡眠, 以0超时反复检查; 空闲之后回到阻塞等待
+        // 排空期间每秒检查一次是否可以退出
+        int timeout = drain_deadline ? 1000 : -1;
+        if (spin_us > 0 && now_us() - last_active < (uint64_t)spin_us) {
+            timeout = 0;
+        }
+        int num = epoll_wait(epfd, events, MAX_EVENT_NUMBER, timeout);
+        if (spin_us > 0 && num > 0) {
+            last_active = now_us();
+        }
         if (num == -1 && errno != EINTR) {
             perror("epoll_wait");
             break;
         }
-        // 9-2 遍历检测到属性变化, 需要处理的文件描述符
+        if (stop_server) {
+            break;
+        }
+        if (drain_deadline && (http_conn::m_user_count == 0 || now_us() >= drain_deadline)) {
+            printf("排空结束, 剩余 %d 个连接\n", http_conn::m_user_count);
+            break;
+        }
+        // 排空开始时正在线程池中的连接之后才变为空闲(HTTP/2会话可能一直没有新的帧), 每秒再检查一次
+        if (drain_deadline && now_us() >= next_sweep) {
+            close_idle(users, pool);
+            next_sweep = now_us() + 1000000;
+        }
+        // 10-2 收到SIGHUP, 在后台线程中重新加载资源仓库(建好后通过reload_fd通知); 释放已无人使用的旧仓库
+        if (reload_assets) {
+            reload_assets = 0;
+            asset_store::reload(doc_root, pack_path, asset_max_size, asset_huge, asset_lock);
+        }
+        asset_store::reclaim();
+        // 10-3 遍历检测到属性变化, 需要处理的文件描述符
         for (int i = 0; i < num; i++) {
-            int sockfd = events[i].data.fd;
+            int sockfd = key_fd(events[i].data.u64);
             if (sockfd == lfd) {
-                // 9-2-1 如果是有客户端连接进来
+                // 10-3-1 如果是有客户端连接进来
                 // 接受连接请求
                 struct sockaddr_in caddr;
-                socklen_t caddr_len = sizeof(caddr_len);
-                int cfd = accept(lfd, (struct sockaddr*)&caddr, &caddr_len);
+                socklen_t caddr_len = sizeof(caddr);
+                int cfd = accept4(lfd, (struct sockaddr*)&caddr, &caddr_len, SOCK_NONBLOCK);  // 直接得到非阻塞的fd, 省去两次fcntl
                 if (cfd == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+                        continue;  // 平滑升级期间新旧进程共用监听套接字, 连接可能已被另一个进程取走
+                    }
                     perror("accept");
                     exit(-1);
                 }
+                WEBSERVER_PROBE(accept, cfd, caddr.sin_addr.s_addr, caddr.sin_port);
                 // 检查是否连接数已达上限, 若是, 则关掉新连接
                 if (http_conn::m_user_count >= MAX_FD) {
                     close(cfd);
                     // 待添加改进: 给客户端返回提示信息:"服务器正忙".
                     continue;
                 }
+                // 检查这个IP地址的连接数是否已达上限, 若是, 则回复429并关掉新连接
+                if (!rate_limiter::connect(caddr.sin_addr.s_addr)) {
+                    http_conn::reject(cfd);
+                    close(cfd);
+                    continue;
+                }
+                if (spin_us > 0) {
+                    setsockopt(cfd, SOL_SOCKET, SO_BUSY_POLL, &spin_us, sizeof(spin_us));
+                }
                 // 将新连接输入存入users
-                users[cfd].init(cfd, caddr);
-            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                // 9-2-2 如果对方异常断开, 或者发生错误
-                users[sockfd].close_conn();
-            } else if (events[i].events & EPOLLIN) {
-                // 9-2-3 如果需要读数据, 则一次性把所有数据都读完, 并向线程池添加新任务
-                if (users[sockfd].read()) {  // 如果成功读完, 则向线程池添加新任务
-                    pool->append(users + sockfd);  // append要求的输入是T*, 即http_conn*
-                } else {  // 如果读出现失败, 则直接关闭当前连接
-                    users[sockfd].close_conn();
+                (*users)[cfd].init(cfd, caddr);
+                continue;
+            }
+            if (sockfd == ctl) {
+                // 新进程连接进来, 交出监听套接字和热点URL列表, 等待它预热完成. 同时只与一个新进程交接
+                int conn = accept4(ctl, NULL, NULL, SOCK_CLOEXEC);
+                if (conn == -1) {
+                    continue;
+                }
+                if (ctl_conn == -1 && handoff::give(conn, lfd)) {
+                    ctl_conn = conn;
+                    addfd(epfd, ctl_conn, false, false);
+                } else {
+                    close(conn);
+                }
+                continue;
+            }
+            if (sockfd == ctl_conn) {
+                // 新进程回复就绪(或者断开了)
+                bool ready = handoff::is_ready(ctl_conn);
+                removefd(epfd, ctl_conn);
+                ctl_conn = -1;
+                if (!ready) {
+                    printf("新进程没有完成升级, 继续服务\n");
+                    continue;
                 }
-            } else if (events[i].events & EPOLLOUT) {
-                // 9-2-4 如果可以写数据了, 则一次性把所有数据都写完
-                if (!users[sockfd].write()) {  // 如果写出现失败, 也是直接关闭当前连接
-                    users[sockfd].close_conn();
+                // 新进程已经在accept了: 停止accept, 关闭空闲连接, 其余连接发完当前应答后关闭
+                removefd(epfd, lfd);
+                removefd(epfd, ctl);
+                lfd = ctl = -1;
+                http_conn::m_draining = true;
+                drain_deadline = now_us() + (uint64_t)drain_seconds * 1000000;
+                next_sweep = now_us() + 1000000;
+                int closed = close_idle(users, pool);
+                printf("开始排空: 关闭了 %d 个空闲连接, 还有 %d 个连接\n", closed, http_conn::m_user_count);
+                continue;
+            }
+            if ((asset_max_size > 0 || pack_path) && sockfd == asset_store::reload_fd()) {
+                // 后台加载的新仓库已经建好, 替换当前仓库
+                asset_store* store = asset_store::reloaded();
+                if (store) {
+                    printf("资源重新加载完成: %d 个文件, %zu 字节\n", store->count(), store->bytes());
                 }
+                continue;
             }
+            if (neg_cache::enabled() && sockfd == neg_cache::fd()) {
+                // 网站根目录有变化, 使否定缓存失效
+                neg_cache::on_notify();
+                continue;
+            }
+            // 10-3-2 客户端连接和上游连接的事件(见event_dispatcher.h)
+            dispatcher.handle(events[i].data.u64, events[i].events);
         }
     }
 
+    capture::close();
     close(epfd);
-    close(lfd);
-    delete[] users;
-    delete pool;
+    if (lfd != -1) {  // 排空结束时监听套接字已经交给了新进程
+        close(lfd);
+    }
+    delete pool;  // 先等工作线程全部退出, 它们的process()可能还在访问连接表
+    delete users;
 
     return 0;
 }
\ No newline at end of file
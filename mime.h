@@ -0,0 +1,64 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <string.h>
+#include "static_map.h"
+
+// 扩展名到MIME类型的映射表, 由static_map在编译期生成完美哈希
+struct mime_entry {
+    const char* key;  // 扩展名, 不含'.'
+    const char* type;
+};
+
+static constexpr mime_entry mime_table[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"xml", "application/xml"},
+    {"txt", "text/plain"},
+    {"csv", "text/csv"},
+    {"md", "text/markdown"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"png", "image/png"},
+    {"gif", "image/gif"},
+    {"bmp", "image/bmp"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"wasm", "application/wasm"},
+    {"mp3", "audio/mpeg"},
+    {"wav", "audio/wav"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+};
+
+static constexpr static_map<sizeof(mime_table) / sizeof(mime_table[0]), 128> mime_map(mime_table);
+
+// 未知扩展名使用的MIME类型
+static const char* const default_mime_type = "application/octet-stream";
+
+/* 根据URL的扩展名得到MIME类型.
+ * 只需定位最后一个'.', 若它之后还有'/', 说明'.'属于目录名, 文件没有扩展名. */
+inline const char* mime_type(const char* url) {
+    const char* dot = strrchr(url, '.');
+    if (!dot || strchr(dot, '/')) {
+        return default_mime_type;
+    }
+    int i = mime_map.find(dot + 1, strlen(dot + 1));
+    return i < 0 ? default_mime_type : mime_table[i].type;
+}
+
+#endif
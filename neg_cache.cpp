@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <map>
+#include <string>
+#include "neg_cache.h"
+
+int neg_cache::s_fd = -1;
+int neg_cache::s_ttl = 0;
+neg_cache::entry neg_cache::s_entries[BUCKETS][WAYS];
+locker neg_cache::s_locks[STRIPES];
+std::atomic<uint32_t> neg_cache::s_generation(1);  // 从1开始, 全零的空项总是无效
+std::atomic<long> neg_cache::s_hits(0);
+std::atomic<long> neg_cache::s_invalidations(0);
+
+// 监视描述符 -> 目录路径, 新建子目录时用来拼出它的完整路径. 只由主线程访问
+static std::map<int, std::string> s_watches;
+
+// 需要关心的变化: 目录中出现了新的文件或目录
+static const uint32_t WATCH_MASK = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+
+bool neg_cache::open(const char* root, int ttl) {
+    s_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (s_fd == -1) {
+        perror("inotify_init1");
+        return false;
+    }
+    if (!watch(root)) {
+        close(s_fd);
+        s_fd = -1;
+        return false;
+    }
+    s_ttl = ttl;
+    return true;
+}
+
+// 递归地监视目录. 根目录无法监视时返回false; 子目录失败(例如超出max_user_watches)只打印警告.
+// 不进入指向目录的符号链接; 同一个目录(例如bind mount形成的环)只遍历一次
+bool neg_cache::watch(const char* dir) {
+    int wd = inotify_add_watch(s_fd, dir, WATCH_MASK);
+    if (wd == -1) {
+        perror("inotify_add_watch");
+        return false;
+    }
+    // 同一个inode返回同一个监视描述符, 已经监视过的目录不再遍历
+    if (s_watches.count(wd)) {
+        return true;
+    }
+    s_watches[wd] = dir;
+    DIR* d = opendir(dir);
+    if (!d) {
+        return true;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        // 有的文件系统不填d_type, 用lstat判断, 同样不跟随符号链接
+        std::string path = std::string(dir) + "/" + ent->d_name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            watch(path.c_str());
+        }
+    }
+    closedir(d);
+    return true;
+}
+
+void neg_cache::on_notify() {
+    // inotify_event后面跟着变长的文件名, 缓冲区按inotify_event对齐
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+    while ((len = read(s_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            if (ev->mask & IN_IGNORED) {  // 目录被删除, 监视自动解除
+                s_watches.erase(ev->wd);
+                continue;
+            }
+            changed = true;  // 文件出现, 或者通知队列溢出(IN_Q_OVERFLOW)
+            // 新出现的子目录(里面可能已经有文件)也要监视
+            if ((ev->mask & IN_ISDIR) && ev->len > 0) {
+                std::map<int, std::string>::iterator it = s_watches.find(ev->wd);
+                if (it != s_watches.end()) {
+                    watch((it->second + "/" + ev->name).c_str());
+                }
+            }
+        }
+    }
+    // 先加好新目录的监视, 再使缓存失效: 失效之后插入的项不会错过这些目录中的变化
+    if (changed) {
+        s_generation.fetch_add(1, std::memory_order_acq_rel);
+        s_invalidations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool neg_cache::find(const char* url, size_t len) {
+    if (s_fd == -1 || len > URL_LEN) {
+        return false;
+    }
+    uint64_t h = hash(url, len);
+    int bucket = h & (BUCKETS - 1);
+    uint32_t gen = generation();
+    int64_t t = now();
+    bool found = false;
+    locker& lock = s_locks[bucket % STRIPES];
+    lock.lock();
+    for (int i = 0; i < WAYS; i++) {
+        const entry& e = s_entries[bucket][i];
+        if (e.hash == h && e.generation == gen && e.expires > t && e.len == len && memcmp(e.url, url, len) == 0) {
+            found = true;
+            break;
+        }
+    }
+    lock.unlock();
+    if (found) {
+        s_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    return found;
+}
+
+void neg_cache::insert(const char* url, size_t len, uint32_t generation) {
+    if (s_fd == -1 || len > URL_LEN || generation != neg_cache::generation()) {
+        return;
+    }
+    uint64_t h = hash(url, len);
+    int bucket = h & (BUCKETS - 1);
+    int64_t t = now();
+    locker& lock = s_locks[bucket % STRIPES];
+    lock.lock();
+    // 选择一项: 已有的同一URL或无效的项, 否则淘汰最早过期的一项
+    entry* victim = &s_entries[bucket][0];
+    for (int i = 0; i < WAYS; i++) {
+        entry& e = s_entries[bucket][i];
+        if ((e.hash == h && e.len == len && memcmp(e.url, url, len) == 0) || e.generation != generation || e.expires <= t) {
+            victim = &e;
+            break;
+        }
+        if (e.expires < victim->expires) {
+            victim = &e;
+        }
+    }
+    victim->hash = h;
+    victim->generation = generation;
+    victim->len = len;
+    victim->expires = t + s_ttl;
+    memcpy(victim->url, url, len);
+    lock.unlock();
+}
+
+// FNV-1a
+uint64_t neg_cache::hash(const char* s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+int64_t neg_cache::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
@@ -0,0 +1,74 @@
+#ifndef NEG_CACHE_H
+#define NEG_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "locker.h"
+
+/*
+ * 否定缓存: 记住最近确认过在网站根目录下不存在的URL.
+ * 扫描器和有问题的客户端会反复请求不存在的路径, 每个请求都要拼接m_real_file并stat一次.
+ * 命中否定缓存的请求在do_lookup中直接得到NO_RESOURCE, 不再访问文件系统.
+ * 1.容量固定: BUCKETS个桶, 每桶WAYS项, 桶满时淘汰最早过期的一项. 桶按哈希值分成STRIPES组,
+ *   每组一把锁;
+ * 2.每一项在ttl秒后过期;
+ * 3.用inotify监视网站根目录及其所有子目录, 任何目录中有文件或目录出现(新建、移入)时,
+ *   全局代数加1, 此前的所有项立即失效, 新部署的文件马上可以被访问. 新建的子目录会被加入监视.
+ *   根目录下指向其他位置的符号链接不在监视范围内, 它们的变化要等到项过期才能看到.
+ */
+class neg_cache {
+public:
+    static const int BUCKETS = 1024;  // 桶数, 必须是2的幂
+    static const int WAYS = 4;  // 每个桶的项数
+    static const int STRIPES = 64;  // 锁的数量
+    static const int URL_LEN = 104;  // 能被缓存的URL的最大长度(使每一项为128字节)
+
+    /* 开始监视root目录, 项的有效期为ttl秒. 失败(例如系统不支持inotify)时返回false,
+     * 此时否定缓存不启用 */
+    static bool open(const char* root, int ttl);
+    static bool enabled() {
+        return s_fd != -1;
+    }
+    // inotify的文件描述符, 由主线程加入epoll实例, 可读时调用on_notify()
+    static int fd() {
+        return s_fd;
+    }
+    // 读出所有目录变化通知, 有文件出现时使缓存失效. 只能在主线程中调用
+    static void on_notify();
+
+    // 当前代数. 查找文件之前读取, 文件不存在时与URL一起交给insert
+    static uint32_t generation() {
+        return s_generation.load(std::memory_order_acquire);
+    }
+    // url是否在缓存中(即最近确认过不存在)
+    static bool find(const char* url, size_t len);
+    // 记录url不存在. generation为查找文件之前读到的代数, 查找期间缓存被清空过时不会插入
+    static void insert(const char* url, size_t len, uint32_t generation);
+
+    static long hits() { return s_hits.load(std::memory_order_relaxed); }  // 命中次数
+    static long invalidations() { return s_invalidations.load(std::memory_order_relaxed); }  // 因目录变化而清空的次数
+
+private:
+    struct entry {
+        uint64_t hash;
+        uint32_t generation;  // 插入时的代数, 与当前代数不同时无效
+        uint32_t len;
+        int64_t expires;  // 过期时间(CLOCK_MONOTONIC_COARSE, 秒)
+        char url[URL_LEN];
+    };
+
+    static bool watch(const char* dir);  // 监视dir及其所有子目录
+    static uint64_t hash(const char* s, size_t len);
+    static int64_t now();
+
+    static int s_fd;
+    static int s_ttl;
+    static entry s_entries[BUCKETS][WAYS];
+    static locker s_locks[STRIPES];
+    static std::atomic<uint32_t> s_generation;
+    static std::atomic<long> s_hits;
+    static std::atomic<long> s_invalidations;
+};
+
+#endif
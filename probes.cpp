@@ -0,0 +1,12 @@
+#include "probes.h"
+
+#if HAS_PROBES
+/* 跟踪点的信号量. 放在.probes节中, 跟踪工具按照note中登记的地址找到它们,
+ * 挂载时加1, 卸载时减1 */
+extern "C" {
+#define WEBSERVER_PROBE_SEMAPHORE(name) \
+    __attribute__((section(".probes"), used)) volatile unsigned short webserver_##name##_semaphore = 0;
+WEBSERVER_PROBE_LIST(WEBSERVER_PROBE_SEMAPHORE)
+#undef WEBSERVER_PROBE_SEMAPHORE
+}
+#endif
@@ -0,0 +1,111 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * USDT(用户态静态跟踪点).
+ * 1.每个跟踪点在代码中只是一条nop指令, 并在ELF的.note.stapsdt节中登记它的地址和参数的位置,
+ *   格式与systemtap的<sys/sdt.h>相同, bpftrace/perf/bcc可以直接挂载, 例如:
+ *   bpftrace -e 'usdt:./server:webserver:read { printf("%d\n", arg0); }'
+ * 2.每个跟踪点有一个信号量(webserver_<名字>_semaphore), 跟踪工具挂载时会把它加1. 没有被跟踪时
+ *   只需判断一次信号量, 参数(包括时间戳)都不会被计算.
+ * 3.所有跟踪点的最后一个参数都是CLOCK_MONOTONIC时间戳(纳秒), 与bpftrace的nsecs一致.
+ * 编译时定义NO_PROBES, 或者在不支持的平台上, 跟踪点被编译为空语句.
+ * 跟踪点一览(参数不含最后的时间戳):
+ *   accept(fd, addr, port)              main: accept一个新连接, addr和port为网络字节序
+ *   read(fd, bytes, buffered)           http_conn::read读完一次, bytes为本次读到的字节数
+ *   enqueue(request, queue_len, lane)   threadpool::append把任务放入通道lane, queue_len为所有通道的任务总数
+ *   dequeue(request, queue_len, lane)   工作线程从通道lane中取出任务
+ *   parse(fd, code, checked)            process_read的结果(HTTP_CODE), checked为已解析的字节数
+ *   lookup(fd, code, size)              查找所请求的资源的结果(HTTP_CODE)及资源大小
+ *   writev(fd, sent, remaining)         每次writev, sent为本次写出的字节数(-1为出错), remaining为剩余字节数
+ * 示例脚本见tools/bpftrace.
+ */
+
+#define WEBSERVER_PROBE_LIST(X) \
+    X(accept) X(read) X(enqueue) X(dequeue) X(parse) X(lookup) X(writev)
+
+#if !defined(NO_PROBES) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+#define HAS_PROBES 1
+#else
+#define HAS_PROBES 0
+#endif
+
+#if HAS_PROBES
+
+#define WEBSERVER_PROBE_SEMAPHORE(name) extern "C" volatile unsigned short webserver_##name##_semaphore;
+WEBSERVER_PROBE_LIST(WEBSERVER_PROBE_SEMAPHORE)
+#undef WEBSERVER_PROBE_SEMAPHORE
+
+// 跟踪点的时间戳
+inline int64_t probe_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+// 跟踪点name是否正被跟踪
+#define WEBSERVER_PROBE_ENABLED(name) __builtin_expect(webserver_##name##_semaphore != 0, 0)
+
+/* 触发跟踪点name, 参数为1~3个整数或指针, 最后自动附加时间戳.
+ * 参数只在跟踪点被挂载时求值 */
+#define WEBSERVER_PROBE(name, ...) \
+    do { \
+        if (WEBSERVER_PROBE_ENABLED(name)) { \
+            PROBE_EMIT_(name, PROBE_NARG_(__VA_ARGS__), __VA_ARGS__, probe_now()); \
+        } \
+    } while (0)
+
+// 以下为实现细节: 生成nop和stapsdt note, 参数都转换为int64_t并放在寄存器中
+#define PROBE_NARG_(...) PROBE_NARG_N_(__VA_ARGS__, 3, 2, 1, 0)
+#define PROBE_NARG_N_(_1, _2, _3, N, ...) N
+#define PROBE_EMIT_(name, n, ...) PROBE_EMIT_N_(name, n, __VA_ARGS__)
+#define PROBE_EMIT_N_(name, n, ...) PROBE_EMIT##n##_(name, __VA_ARGS__)
+#define PROBE_EMIT1_(name, a, t) \
+    __asm__ __volatile__(PROBE_NOTE_(name, "-8@%0 -8@%1") :: "r"((int64_t)(a)), "r"(t))
+#define PROBE_EMIT2_(name, a, b, t) \
+    __asm__ __volatile__(PROBE_NOTE_(name, "-8@%0 -8@%1 -8@%2") :: "r"((int64_t)(a)), "r"((int64_t)(b)), "r"(t))
+#define PROBE_EMIT3_(name, a, b, c, t) \
+    __asm__ __volatile__(PROBE_NOTE_(name, "-8@%0 -8@%1 -8@%2 -8@%3") \
+        :: "r"((int64_t)(a)), "r"((int64_t)(b)), "r"((int64_t)(c)), "r"(t))
+
+/* note的布局: namesz, descsz, type(3), "stapsdt", 然后是跟踪点地址, .stapsdt.base的地址
+ * (用于在预链接后修正地址), 信号量地址, 提供者名, 跟踪点名, 参数描述 */
+#define PROBE_NOTE_(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte webserver_" #name "_semaphore\n" \
+    ".asciz \"webserver\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#else
+
+// 参数不会被求值, 只是让编译器认为它们被使用了
+template<typename... Args>
+inline void probe_unused(const Args&...) {}
+
+#define WEBSERVER_PROBE_ENABLED(name) 0
+#define WEBSERVER_PROBE(name, ...) do { if (0) probe_unused(__VA_ARGS__); } while (0)
+
+#endif
+
+#endif
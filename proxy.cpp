@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include "proxy.h"
+#include "locker.h"
+#include "url.h"
+
+upstream proxy::s_upstreams[proxy::MAX_UPSTREAMS];
+int proxy::s_count = 0;
+std::atomic<long> proxy::s_connects(0);
+std::atomic<long> proxy::s_reuses(0);
+
+// 一个线程的上游连接池: 每个上游一条空闲连接链表(后进先出, 最近用过的连接优先被复用)
+class upstream_pool {
+public:
+    upstream_pool() {
+        for (int i = 0; i < proxy::MAX_UPSTREAMS; i++) {
+            m_idle[i] = NULL;
+            m_count[i] = 0;
+        }
+    }
+    locker m_locker;  // 连接可能由主线程归还, 需要加锁
+    upstream_conn* m_idle[proxy::MAX_UPSTREAMS];
+    int m_count[proxy::MAX_UPSTREAMS];
+};
+
+// 当前线程的连接池, 第一次使用时创建, 之后一直存在(池中的连接会记录它)
+static thread_local upstream_pool* t_pool = NULL;
+
+bool proxy::add(const char* spec) {
+    if (s_count >= MAX_UPSTREAMS) {
+        return false;
+    }
+    const char* eq = strchr(spec, '=');
+    if (!eq || spec[0] != '/' || eq - spec >= (int)sizeof(s_upstreams[0].prefix)) {
+        return false;
+    }
+    upstream& up = s_upstreams[s_count];
+    memset(&up, 0, sizeof(up));
+    up.prefix_len = eq - spec;
+    memcpy(up.prefix, spec, up.prefix_len);
+    const char* addr = eq + 1;
+    if (strlen(addr) >= sizeof(up.name)) {
+        return false;
+    }
+    strcpy(up.name, addr);
+    if (strncmp(addr, "unix:", 5) == 0) {
+        // Unix域套接字
+        struct sockaddr_un* un = (struct sockaddr_un*)&up.addr;
+        if (strlen(addr + 5) >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, addr + 5);
+        up.addr_len = sizeof(struct sockaddr_un);
+    } else {
+        // host:port
+        const char* colon = strrchr(addr, ':');
+        if (!colon || colon == addr) {
+            return false;
+        }
+        char host[sizeof(up.name)];
+        memcpy(host, addr, colon - addr);
+        host[colon - addr] = '\0';
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* res = NULL;
+        if (getaddrinfo(host, colon + 1, &hints, &res) != 0 || !res) {
+            return false;
+        }
+        memcpy(&up.addr, res->ai_addr, res->ai_addrlen);
+        up.addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+    up.index = s_count++;
+    return true;
+}
+
+// 前缀只在路径段的边界上匹配: /api匹配/api、/api/x和/api?x, 不匹配/apiary.html. 以'/'结尾的前缀本身就是边界
+static bool prefix_match(const char* url, const upstream& up) {
+    if (strncmp(url, up.prefix, up.prefix_len) != 0) {
+        return false;
+    }
+    char next = url[up.prefix_len];
+    return (up.prefix_len > 0 && up.prefix[up.prefix_len - 1] == '/') || next == '\0' || next == '/' || next == '?';
+}
+
+const upstream* proxy::match(const char* url) {
+    const upstream* best = NULL;
+    for (int i = 0; i < s_count; i++) {
+        const upstream& up = s_upstreams[i];
+        if (prefix_match(url, up) && (!best || up.prefix_len > best->prefix_len)) {
+            best = &up;
+        }
+    }
+    return best;
+}
+
+upstream_conn* proxy::connect(const upstream* target) {
+    int fd = socket(target->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket(upstream)");
+        return NULL;
+    }
+    // 非阻塞连接, 连接建立之前发送请求会得到EAGAIN, 届时等待上游可写即可
+    if (::connect(fd, (struct sockaddr*)&target->addr, target->addr_len) == -1 && errno != EINPROGRESS) {
+        perror("connect(upstream)");
+        close(fd);
+        return NULL;
+    }
+    if (target->addr.ss_family != AF_UNIX) {
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    upstream_conn* c = new upstream_conn();
+    if (pipe2(c->pipe_fd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        close(fd);
+        delete c;
+        return NULL;
+    }
+    c->fd = fd;
+    c->target = target;
+    c->registered = false;
+    c->next = NULL;
+    s_connects.fetch_add(1, std::memory_order_relaxed);
+    return c;
+}
+
+void proxy::destroy(upstream_conn* c) {
+    close(c->fd);  // 同时会把fd从epoll实例中移除
+    close(c->pipe_fd[0]);
+    close(c->pipe_fd[1]);
+    delete c;
+}
+
+upstream_conn* proxy::acquire(const upstream* target) {
+    if (!t_pool) {
+        t_pool = new upstream_pool();
+    }
+    upstream_pool* pool = t_pool;
+    int i = target->index;
+    // 1.优先复用空闲连接. 空闲期间上游可能已经关闭了连接, 用MSG_PEEK检查一下
+    while (true) {
+        pool->m_locker.lock();
+        upstream_conn* c = pool->m_idle[i];
+        if (c) {
+            pool->m_idle[i] = c->next;
+            pool->m_count[i]--;
+        }
+        pool->m_locker.unlock();
+        if (!c) {
+            break;
+        }
+        char byte;
+        if (recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            c->reused = true;
+            s_reuses.fetch_add(1, std::memory_order_relaxed);
+            return c;
+        }
+        destroy(c);  // 已被上游关闭, 或者收到了不该有的数据
+    }
+    // 2.没有可用的空闲连接, 新建一条
+    upstream_conn* c = connect(target);
+    if (c) {
+        c->owner = pool;
+        c->reused = false;
+    }
+    return c;
+}
+
+void proxy::release(upstream_conn* c, bool keep) {
+    if (!keep || !c->reusable) {
+        destroy(c);
+        return;
+    }
+    upstream_pool* pool = c->owner;
+    int i = c->target->index;
+    pool->m_locker.lock();
+    if (pool->m_count[i] < MAX_IDLE) {
+        c->next = pool->m_idle[i];
+        pool->m_idle[i] = c;
+        pool->m_count[i]++;
+        c = NULL;
+    }
+    pool->m_locker.unlock();
+    if (c) {
+        destroy(c);  // 池已满
+    }
+}
+
+bool upstream_conn::start(const char* path, const char* raw_target, const char* host, const sockaddr_in& client) {
+    // 转发规范化的路径而不是原始目标: 例如"/public/..%2fapi/x"按"/api/x"匹配规则, 上游收到的也必须是"/api/x"
+    char url[BUF_SIZE];
+    if (url_encode_path(path, url, sizeof(url)) < 0) {
+        return false;
+    }
+    // 原始目标中'?'之后、'#'之前的查询串原样转发
+    size_t n = strcspn(raw_target, "?#");
+    const char* query = raw_target[n] == '?' ? raw_target + n : "";
+    int query_len = strcspn(query, "#");
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client.sin_addr, ip, sizeof(ip));
+    m_len = snprintf(m_buf, BUF_SIZE, "GET %s%.*s HTTP/1.0\r\nHost: %s\r\nConnection: keep-alive\r\nX-Forwarded-For: %s\r\n\r\n",
+        url, query_len, query, host ? host : target->name, ip);
+    if (m_len < 0 || m_len >= BUF_SIZE) {
+        return false;
+    }
+    m_state = SENDING;
+    m_off = 0;
+    m_head_len = 0;
+    m_sent = 0;
+    m_remaining = 0;
+    m_piped = 0;
+    reusable = true;
+    status = 0;
+    sent = 0;
+    return true;
+}
+
+void upstream_conn::arm(int epfd, uint64_t key, int event) {
+    struct epoll_event epev;
+    epev.data.u64 = key;
+    epev.events = event | EPOLLONESHOT | EPOLLET;
+    epoll_ctl(epfd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &epev);
+    registered = true;
+}
+
+upstream_conn::STATUS upstream_conn::step(int client_fd, bool& linger) {
+    STATUS ret;
+    switch (m_state) {
+        case SENDING: {
+            // 1.发送请求
+            while (m_off < m_len) {
+                int n = send(fd, m_buf + m_off, m_len - m_off, MSG_NOSIGNAL);
+                if (n == -1) {
+                    return (errno == EAGAIN || errno == EWOULDBLOCK) ? WAIT_UPSTREAM_OUT : FAILED;
+                }
+                m_off += n;
+            }
+            m_state = HEADERS;
+            m_len = 0;
+        }
+        // fall through
+        case HEADERS: {
+            // 2.读取并改写应答首部
+            ret = read_headers(linger);
+            if (ret != DONE) {
+                return ret;
+            }
+            m_state = RELAY_HEAD;
+        }
+        // fall through
+        case RELAY_HEAD: {
+            // 3.把改写后的首部和已经读到的部分应答体发给客户端
+            ret = relay_head(client_fd);
+            if (ret != DONE) {
+                return ret;
+            }
+            m_state = RELAY_BODY;
+        }
+        // fall through
+        case RELAY_BODY: {
+            // 4.用splice转发剩余的应答体
+            return relay_body(client_fd);
+        }
+    }
+    return ABORTED;
+}
+
+// 读取上游应答的首部, 生成发给客户端的首部. 返回DONE表示首部已经就绪
+upstream_conn::STATUS upstream_conn::read_headers(bool& linger) {
+    // 1.读到空行为止
+    char* end;
+    while (!(end = (char*)memmem(m_buf, m_len, "\r\n\r\n", 4))) {
+        if (m_len == BUF_SIZE) {
+            return FAILED;  // 首部过长
+        }
+        int n = recv(fd, m_buf + m_len, BUF_SIZE - m_len, 0);
+        if (n == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? WAIT_UPSTREAM_IN : FAILED;
+        } else if (n == 0) {
+            return FAILED;  // 上游在应答之前关闭了连接
+        }
+        m_len += n;
+    }
+    // 2.状态行: 统一改为HTTP/1.1
+    char* line = m_buf;
+    char* eol = (char*)memchr(line, '\r', end + 2 - line);
+    if (strncmp(line, "HTTP/1.", 7) != 0 || eol - line < 12) {
+        return FAILED;
+    }
+    status = atoi(line + 9);
+    m_head_len = snprintf(m_head, HEAD_SIZE, "HTTP/1.1%.*s\r\n", (int)(eol - line - 8), line + 8);
+    // 3.首部行: 去掉逐跳首部Connection和Keep-Alive, 记录Content-Length
+    m_remaining = -1;
+    bool upstream_close = false;
+    for (line = eol + 2; line < end + 2; line = eol + 2) {
+        eol = (char*)memchr(line, '\r', end + 2 - line);
+        int len = eol - line;
+        if (strncasecmp(line, "Connection:", 11) == 0) {
+            upstream_close = memmem(line, len, "close", 5) != NULL;
+            continue;
+        } else if (strncasecmp(line, "Keep-Alive:", 11) == 0) {
+            continue;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            m_remaining = strtoll(line + 15, NULL, 10);
+        }
+        if (m_head_len + len + 2 >= HEAD_SIZE) {
+            return FAILED;
+        }
+        memcpy(m_head + m_head_len, line, len);
+        memcpy(m_head + m_head_len + len, "\r\n", 2);
+        m_head_len += len + 2;
+    }
+    if (status < 200 || status == 204 || status == 304) {
+        m_remaining = 0;  // 这些应答没有应答体
+    }
+    // 4.应答体以上游关闭连接为结束时, 客户端只能通过关闭连接得知应答结束, 上游连接也不能复用
+    if (m_remaining < 0) {
+        linger = false;
+        reusable = false;
+    } else if (upstream_close) {
+        reusable = false;
+    }
+    int n = snprintf(m_head + m_head_len, HEAD_SIZE - m_head_len, "Connection: %s\r\n\r\n", linger ? "keep-alive" : "close");
+    if (n >= HEAD_SIZE - m_head_len) {
+        return FAILED;
+    }
+    m_head_len += n;
+    // 5.空行之后已经读到的数据是应答体的开头
+    m_off = end + 4 - m_buf;
+    if (m_remaining >= 0) {
+        if (m_len - m_off > m_remaining) {
+            m_len = m_off + m_remaining;  // 上游多发了数据, 连接的状态不可信, 不再复用
+            reusable = false;
+        }
+        m_remaining -= m_len - m_off;
+    }
+    m_sent = 0;
+    return DONE;
+}
+
+upstream_conn::STATUS upstream_conn::relay_head(int client_fd) {
+    int total = m_head_len + m_len - m_off;
+    while (m_sent < total) {
+        struct iovec iov[2];
+        int count = 0;
+        if (m_sent < m_head_len) {
+            iov[count].iov_base = m_head + m_sent;
+            iov[count++].iov_len = m_head_len - m_sent;
+            iov[count].iov_base = m_buf + m_off;
+            iov[count++].iov_len = m_len - m_off;
+        } else {
+            iov[count].iov_base = m_buf + m_off + (m_sent - m_head_len);
+            iov[count++].iov_len = total - m_sent;
+        }
+        int n = writev(client_fd, iov, count);
+        if (n == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? WAIT_CLIENT_OUT : ABORTED;
+        }
+        m_sent += n;
+        sent += n;
+    }
+    return DONE;
+}
+
+upstream_conn::STATUS upstream_conn::relay_body(int client_fd) {
+    while (true) {
+        // 1.先把管道中的数据发给客户端
+        if (m_piped > 0) {
+            ssize_t n = splice(pipe_fd[0], NULL, client_fd, NULL, m_piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == -1) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? WAIT_CLIENT_OUT : ABORTED;
+            }
+            m_piped -= n;
+            sent += n;
+            continue;
+        }
+        if (m_remaining == 0) {
+            return DONE;
+        }
+        // 2.管道已空, 再从上游搬一批数据进管道
+        size_t want = (m_remaining < 0 || m_remaining > SPLICE_CHUNK) ? SPLICE_CHUNK : m_remaining;
+        ssize_t n = splice(fd, NULL, pipe_fd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? WAIT_UPSTREAM_IN : ABORTED;
+        } else if (n == 0) {
+            // 上游关闭了连接: 若应答体没有给出长度, 这就是应答的结尾
+            return m_remaining < 0 ? DONE : ABORTED;
+        }
+        m_piped += n;
+        if (m_remaining > 0) {
+            m_remaining -= n;
+        }
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <atomic>
+
+/*
+ * 反向代理: URL以指定前缀开头的请求被转发给上游服务器(TCP或Unix域套接字).
+ * 1.连接池: 每个线程(工作线程, 协程模式下还有主线程)有自己的上游连接池, 按上游分别保存空闲的
+ *   长连接. 转发请求时优先复用空闲连接, 省去每个请求的connect和TCP握手; 转发结束后连接被
+ *   还给取出它的那个池. 连接可能在主线程上转发结束, 因此每个池有一把(几乎没有竞争的)锁.
+ * 2.非阻塞: 上游fd也注册在主线程的epoll实例中, 事件携带客户端连接的key并置上UPSTREAM_KEY_FLAG,
+ *   主线程据此找到客户端连接并推进转发(upstream_conn::step).
+ * 3.转发应答体: 用splice把数据从上游socket经管道直接搬到客户端socket, 不经过用户态缓冲区.
+ * 发往上游的请求使用HTTP/1.0并带上"Connection: keep-alive", 这样上游不会使用chunked编码,
+ * 应答体的长度要么由Content-Length给出, 要么以上游关闭连接为结束.
+ */
+
+class upstream_pool;
+
+// 一条代理规则: URL前缀 -> 上游地址
+struct upstream {
+    char prefix[64];  // URL前缀, 例如"/api"
+    int prefix_len;
+    char name[108];  // 上游地址的原文, 例如"127.0.0.1:8080"或"unix:/run/app.sock", 请求中没有Host首部时用作Host
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    int index;  // 规则的下标, 也是它在连接池中的下标
+};
+
+// 一条到上游的连接, 以及正在转发的一次请求的状态
+class upstream_conn {
+public:
+    static const int BUF_SIZE = 4096;  // 请求缓冲区和应答首部缓冲区的大小
+    static const int HEAD_SIZE = 2048;  // 改写后发给客户端的应答首部的最大长度
+    static const int SPLICE_CHUNK = 65536;  // 每次splice的最大字节数(管道的默认容量)
+
+    // step()的返回值. 小于DONE表示需要等待某个fd就绪
+    enum STATUS {
+        WAIT_UPSTREAM_IN = 0,  // 等待上游可读
+        WAIT_UPSTREAM_OUT,  // 等待上游可写(连接正在建立, 或请求还没发完)
+        WAIT_CLIENT_OUT,  // 等待客户端可写
+        DONE,  // 转发完成
+        FAILED,  // 还没有向客户端发送任何数据就失败了, 可以改为回复502
+        ABORTED  // 已经向客户端发送了部分应答后失败, 只能关闭客户端连接
+    };
+    enum STATE { SENDING = 0, HEADERS, RELAY_HEAD, RELAY_BODY };
+
+    /* 准备一次请求: 生成发往上游的请求报文.
+     * path为规范化的路径(与匹配代理规则时使用的相同), 重新编码后转发, 查询串取自客户端请求行中的原始目标raw_target;
+     * host为客户端请求的Host首部(可以为NULL), client为客户端地址, 用于X-Forwarded-For */
+    bool start(const char* path, const char* raw_target, const char* host, const sockaddr_in& client);
+    /* 推进转发, 直到需要等待或者结束. client_fd为客户端socket;
+     * linger为客户端连接是否保持, 若上游应答没有给出长度(以关闭连接结束), 会被改为false */
+    STATUS step(int client_fd, bool& linger);
+    // 以EPOLLONESHOT注册上游fd的event事件, key为客户端连接的key
+    void arm(int epfd, uint64_t key, int event);
+
+    int fd;
+    int pipe_fd[2];  // splice使用的管道
+    const upstream* target;
+    upstream_pool* owner;  // 取出本连接的池
+    bool reused;  // 本次请求是否复用了池中的空闲连接
+    bool registered;  // fd是否已加入epoll实例
+    bool reusable;  // 本次转发结束后能否放回池中
+    int status;  // 上游应答的状态码, 用于访问日志
+    uint64_t sent;  // 本次转发已发给客户端的字节数, 用于访问日志
+    upstream_conn* next;  // 在池中时, 指向下一个空闲连接
+
+private:
+    STATUS read_headers(bool& linger);
+    STATUS relay_head(int client_fd);
+    STATUS relay_body(int client_fd);
+
+    STATE m_state;
+    char m_buf[BUF_SIZE];  // SENDING: 请求报文; 之后: 上游的应答首部和紧随其后的部分应答体
+    int m_len;  // m_buf中的数据长度
+    int m_off;  // SENDING: 请求已发送的字节数; RELAY_HEAD: 应答体前缀在m_buf中的起点
+    char m_head[HEAD_SIZE];  // 改写后的应答首部
+    int m_head_len;
+    int m_sent;  // RELAY_HEAD: 首部和应答体前缀已发给客户端的字节数
+    int64_t m_remaining;  // 还需从上游读取的应答体字节数, -1表示读到上游关闭连接为止
+    int m_piped;  // 管道中还没有转发给客户端的字节数
+};
+
+class proxy {
+public:
+    static const int MAX_UPSTREAMS = 16;  // 代理规则的最大数量
+    static const int MAX_IDLE = 64;  // 每个池中每个上游最多保留的空闲连接数
+
+    /* 添加一条代理规则, spec的格式为"前缀=地址", 地址为"host:port"或"unix:/path".
+     * 格式错误或地址无法解析时返回false */
+    static bool add(const char* spec);
+    // 按URL查找代理规则(最长前缀优先, 前缀只在路径段的边界上匹配), 没有匹配的规则时返回NULL
+    static const upstream* match(const char* url);
+    // 从当前线程的连接池中取一条到target的连接, 池中没有可用连接时新建一条. 失败返回NULL
+    static upstream_conn* acquire(const upstream* target);
+    // 转发结束后归还连接. keep为false或连接不可复用时直接关闭
+    static void release(upstream_conn* c, bool keep);
+
+    static long connects() { return s_connects.load(std::memory_order_relaxed); }  // 新建的上游连接数
+    static long reuses() { return s_reuses.load(std::memory_order_relaxed); }  // 复用空闲连接的次数
+
+private:
+    static upstream_conn* connect(const upstream* target);
+    static void destroy(upstream_conn* c);
+
+    static upstream s_upstreams[MAX_UPSTREAMS];
+    static int s_count;
+    static std::atomic<long> s_connects;
+    static std::atomic<long> s_reuses;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include <time.h>
+#include "rate_limiter.h"
+
+bool rate_limiter::s_enabled = false;
+int rate_limiter::s_max_conns = 0;
+uint64_t rate_limiter::s_interval = 0;
+uint64_t rate_limiter::s_tolerance = 0;
+rate_limiter::slot rate_limiter::s_slots[SLOTS];
+std::atomic<long> rate_limiter::s_rejected_conns(0);
+std::atomic<long> rate_limiter::s_rejected_requests(0);
+std::atomic<long> rate_limiter::s_untracked(0);
+
+void rate_limiter::enable(int max_conns, int rate, int burst) {
+    s_max_conns = max_conns;
+    if (rate > 0) {
+        s_interval = 1000000 / rate;
+        s_tolerance = s_interval * (burst > 1 ? burst - 1 : 0);
+    }
+    s_enabled = max_conns > 0 || rate > 0;
+}
+
+// 单调时钟(粗粒度, 不进入内核), 单位微秒
+uint64_t rate_limiter::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+rate_limiter::slot* rate_limiter::find(uint32_t addr, uint64_t now) {
+    // 斐波那契散列, 取高16位作为起始槽位
+    uint32_t h = (uint32_t)(((uint64_t)addr * 0x9E3779B97F4A7C15ull) >> 48);
+    uint64_t claimed = (uint64_t)addr << 32;
+    slot* victim = NULL;
+    uint64_t victim_owner = 0;
+    uint64_t victim_tat = UINT64_MAX;
+    for (int i = 0; i < PROBES; i++) {
+        slot* s = s_slots + ((h + i) & (SLOTS - 1));
+        uint64_t o = s->owner.load(std::memory_order_acquire);
+        // 1.空槽: 占用它. 被别的线程抢先时, o被更新为新的值, 继续按下面的规则检查
+        if (o == 0) {
+            if (s->owner.compare_exchange_strong(o, claimed, std::memory_order_acq_rel)) {
+                s->tat.store(now, std::memory_order_relaxed);
+                return s;
+            }
+        }
+        // 2.找到了addr的槽位
+        if ((uint32_t)(o >> 32) == addr) {
+            return s;
+        }
+        // 3.记下没有活动连接、最久没有请求的槽位
+        if ((uint32_t)o == 0) {
+            uint64_t t = s->tat.load(std::memory_order_relaxed);
+            if (t < victim_tat) {
+                victim = s;
+                victim_owner = o;
+                victim_tat = t;
+            }
+        }
+    }
+    // 4.淘汰选中的槽位. CAS失败说明它在此期间被使用了, 这次不做限制
+    if (victim && victim->owner.compare_exchange_strong(victim_owner, claimed, std::memory_order_acq_rel)) {
+        victim->tat.store(now, std::memory_order_relaxed);
+        return victim;
+    }
+    s_untracked.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+}
+
+bool rate_limiter::connect(uint32_t addr) {
+    if (!s_enabled || s_max_conns == 0 || addr == 0) {
+        return true;
+    }
+    // 槽位在find之后被淘汰(只可能发生在它没有活动连接时)的话, 重新查找
+    for (int retry = 0; retry < 4; retry++) {
+        slot* s = find(addr, now());
+        if (!s) {
+            return true;
+        }
+        uint64_t o = s->owner.load(std::memory_order_acquire);
+        while ((uint32_t)(o >> 32) == addr) {
+            if ((uint32_t)o >= (uint32_t)s_max_conns) {
+                s_rejected_conns.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (s->owner.compare_exchange_weak(o, o + 1, std::memory_order_acq_rel)) {
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+void rate_limiter::disconnect(uint32_t addr) {
+    if (!s_enabled || s_max_conns == 0 || addr == 0) {
+        return;
+    }
+    uint32_t h = (uint32_t)(((uint64_t)addr * 0x9E3779B97F4A7C15ull) >> 48);
+    for (int i = 0; i < PROBES; i++) {
+        slot* s = s_slots + ((h + i) & (SLOTS - 1));
+        uint64_t o = s->owner.load(std::memory_order_acquire);
+        if ((uint32_t)(o >> 32) != addr) {
+            continue;
+        }
+        // 连接数不会减到0以下(connect时表已满而没有被计数的连接)
+        while ((uint32_t)(o >> 32) == addr && (uint32_t)o > 0) {
+            if (s->owner.compare_exchange_weak(o, o - 1, std::memory_order_acq_rel)) {
+                break;
+            }
+        }
+        return;
+    }
+}
+
+bool rate_limiter::request(uint32_t addr) {
+    if (!s_enabled || s_interval == 0 || addr == 0) {
+        return true;
+    }
+    uint64_t t = now();
+    slot* s = find(addr, t);
+    if (!s) {
+        return true;
+    }
+    // GCRA: TAT超前当前时间超过容差时拒绝, 否则把TAT推后一个间隔
+    uint64_t tat = s->tat.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t base = tat > t ? tat : t;
+        if (base - t > s_tolerance) {
+            s_rejected_requests.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (s->tat.compare_exchange_weak(tat, base + s_interval, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * 按客户端IPv4地址限流: 限制每个地址的并发连接数, 以及每秒的请求数.
+ * 1.固定大小的开放寻址哈希表, 每个地址一个槽位, 全部操作都是无锁的(CAS), 每次查找最多探测PROBES个槽位,
+ *   因此开销与客户端数量无关;
+ * 2.请求速率用令牌桶限制, 以GCRA的形式实现: 槽位只保存一个"理论到达时间"(TAT), 每个请求把它推后
+ *   1/rate秒, TAT超前当前时间不超过(burst-1)/rate秒时放行. 这与容量为burst、每秒补充rate个令牌的
+ *   令牌桶等价, 但只需对一个64位字做CAS;
+ * 3.近似LRU复用: 探测范围内没有空槽时, 淘汰其中没有活动连接且TAT最早(最久没有请求)的槽位.
+ *   有活动连接的槽位不会被淘汰, 以保证连接关闭时能减到正确的计数上. 探测范围内的槽位都有活动连接时
+ *   不做限制(放行), 并计入untracked.
+ */
+class rate_limiter {
+public:
+    static const int SLOTS = 65536;  // 槽位数, 必须是2的幂
+    static const int PROBES = 8;  // 每次查找最多探测的槽位数
+
+    /* 开启限流. max_conns: 每个地址的最大并发连接数, 0表示不限;
+     * rate/burst: 每个地址每秒的请求数和允许的突发请求数, rate为0表示不限 */
+    static void enable(int max_conns, int rate, int burst);
+    static bool enabled() {
+        return s_enabled;
+    }
+    // accept之后调用: 地址addr(网络字节序)的连接数加1. 超过上限时返回false, 连接应被拒绝
+    static bool connect(uint32_t addr);
+    // 连接关闭时调用, 与返回true的connect配对
+    static void disconnect(uint32_t addr);
+    // 收到请求时调用: 取一个令牌, 超过速率时返回false, 请求应被拒绝
+    static bool request(uint32_t addr);
+
+    static long rejected_connections() { return s_rejected_conns.load(std::memory_order_relaxed); }
+    static long rejected_requests() { return s_rejected_requests.load(std::memory_order_relaxed); }
+    static long untracked() { return s_untracked.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(16) slot {
+        std::atomic<uint64_t> owner;  // 高32位为地址, 低32位为当前连接数; 0表示空槽
+        std::atomic<uint64_t> tat;  // 理论到达时间(微秒)
+    };
+
+    static slot* find(uint32_t addr, uint64_t now);  // 查找或占用addr的槽位, 没有可用槽位时返回NULL
+    static uint64_t now();
+
+    static bool s_enabled;
+    static int s_max_conns;
+    static uint64_t s_interval;  // 两个请求之间的间隔(微秒), 0表示不限速率
+    static uint64_t s_tolerance;  // TAT允许超前当前时间的量(微秒)
+    static slot s_slots[SLOTS];
+    static std::atomic<long> s_rejected_conns;
+    static std::atomic<long> s_rejected_requests;
+    static std::atomic<long> s_untracked;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef STATIC_MAP_H
+#define STATIC_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 编译期生成的完美哈希表, 用于MIME类型表、保留路由表等固定不变的小表.
+ * 构造函数是constexpr的: 编译器在编译期逐个尝试种子, 直到找到一个使所有键落在不同槽位的种子.
+ * 因此运行时的查找只需: 对键做一次哈希 -> 取一个槽位 -> 比较一次字符串, 没有探测循环,
+ * 也不做任何内存分配. 键的比较不区分大小写.
+ * 模板参数: N为条目数, SLOTS为槽位数(必须是2的幂, 一般取N的4倍以上以便快速找到种子).
+ */
+namespace static_map_detail {
+
+// 把大写字母转为小写, 没有分支
+constexpr unsigned char fold(unsigned char c) {
+    return c | ((unsigned)(c - 'A') < 26u ? 0x20 : 0);
+}
+
+constexpr uint32_t hash(const char* s, size_t len, uint32_t seed) {
+    uint32_t h = seed;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ fold(s[i])) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr size_t length(const char* s) {
+    size_t n = 0;
+    while (s[n]) {
+        n++;
+    }
+    return n;
+}
+
+constexpr bool equal(const char* a, const char* b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (fold(a[i]) != fold(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace static_map_detail
+
+template <size_t N, size_t SLOTS>
+class static_map {
+    static_assert((SLOTS & (SLOTS - 1)) == 0, "SLOTS必须是2的幂");
+    static_assert(N <= SLOTS, "槽位数不能少于条目数");
+public:
+    // entries为条目数组, 每个条目需要有名为key的const char*成员; 查找结果为条目在数组中的下标
+    template <typename T>
+    constexpr static_map(const T (&entries)[N]): m_seed(0), m_keys{}, m_lens{}, m_index{} {
+        uint32_t seed = 2166136261u;
+        while (!try_seed(entries, seed)) {
+            seed = seed * 1103515245u + 12345u;
+        }
+        m_seed = seed;
+        for (size_t i = 0; i < N; i++) {
+            size_t len = static_map_detail::length(entries[i].key);
+            uint32_t slot = static_map_detail::hash(entries[i].key, len, seed) & (SLOTS - 1);
+            m_keys[slot] = entries[i].key;
+            m_lens[slot] = len;
+            m_index[slot] = i + 1;
+        }
+    }
+
+    // 查找长度为len的键s, 返回条目下标, 找不到返回-1
+    int find(const char* s, size_t len) const {
+        uint32_t slot = static_map_detail::hash(s, len, m_seed) & (SLOTS - 1);
+        if (m_lens[slot] != len || !static_map_detail::equal(m_keys[slot], s, len)) {
+            return -1;  // 空槽位的长度为0, 空键也不会误匹配到它(m_index为0时返回-1)
+        }
+        return (int)m_index[slot] - 1;
+    }
+
+private:
+    template <typename T>
+    static constexpr bool try_seed(const T (&entries)[N], uint32_t seed) {
+        bool used[SLOTS] = {};
+        for (size_t i = 0; i < N; i++) {
+            size_t len = static_map_detail::length(entries[i].key);
+            uint32_t slot = static_map_detail::hash(entries[i].key, len, seed) & (SLOTS - 1);
+            if (used[slot]) {
+                return false;
+            }
+            used[slot] = true;
+        }
+        return true;
+    }
+
+    uint32_t m_seed;
+    const char* m_keys[SLOTS];
+    size_t m_lens[SLOTS];
+    uint32_t m_index[SLOTS];  // 条目下标+1, 0表示空槽位
+};
+
+#endif
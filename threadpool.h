@@ -2,10 +2,14 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 #include <list>
+#include <atomic>
 #include "locker.h"
 #include <exception>
 #include <cstdio>
+#include "probes.h"
 
 /*
 问题辨析: 
@@ -31,19 +35,50 @@ threadpool的成员的, 如何解决该问题呢?
 
 /*
 * 线程池类: 定义为模板类, 利于代码复用, 模板参数T是任务类. 
+* 任务队列分为LANES个通道(lane), 由任务类的分类函数T::lane()在append时决定任务进入哪个通道,
+* 避免少数耗时很长的任务(如冷的大文件)排在大量短任务前面, 造成队头阻塞:
+* 1.工作线程按平滑加权轮询(smooth weighted round-robin)从非空的通道中取任务, 每个通道得到的
+*   调度次数与它的权重成正比, 同一通道内仍是先进先出;
+* 2.每个通道可以限制同时处理它的任务的线程数, 使慢任务不能占满所有工作线程;
+* 3.开启自旋(set_spin)后, 工作线程处理完一个任务后先自旋等待新任务一段时间, 没有等到再睡眠,
+*   以CPU换取唤醒延迟. 负载下降时线程自然回到睡眠, 不会一直空转.
+* 从append到工作线程取出任务的时间(唤醒延迟)记入直方图, 由wake_percentile读出.
 */
 template<typename T>
 class threadpool {
 public: 
+    static const int LANES = 3;  // 任务队列的通道数
+
     // 有参构造
     threadpool(int thread_number = 8, int max_requests = 10000);
     // 析构函数
     ~threadpool();
-    /* 向工作队列中添加任务 */
+    /* 向工作队列中添加任务, 通道由request->lane()决定 */
     bool append(T* request);
+    /* 设置通道lane的调度权重, 以及同时处理该通道任务的最大线程数(0表示不限) */
+    void set_lane(int lane, int weight, int limit);
+    /* 工作线程没有任务时, 先自旋us微秒再睡眠. 0表示直接睡眠 */
+    void set_spin(int us) { m_spin_ns = (uint64_t)us * 1000; }
+    /* 唤醒延迟(纳秒)的p分位数(0 < p < 1), 近似到直方图桶的下界 */
+    uint64_t wake_percentile(double p) const;
+    /* 队列为空且没有工作线程在处理任务时返回true. 如果除调用者外只有正在处理任务的线程会append,
+       返回true后这一结论保持到调用者下次append */
+    bool idle();
 private: 
     static void* worker(void* arg);
     void run();
+    int pick();  // 选出下一个取任务的通道, 没有可取的任务时返回-1. 调用者持有m_queuelocker
+    void spin();  // 不持有锁地自旋, 直到队列中有任务或超过m_spin_ns
+    static uint64_t now();
+    // 唤醒延迟直方图: 每个2的幂区间再分成4个桶, 误差不超过25%
+    static int wake_bucket(uint64_t ns);
+    static uint64_t bucket_floor(int bucket);
+
+    struct task {
+        T* request;
+        uint64_t enqueued;  // 放入队列的时间(纳秒)
+    };
+    static const int WAKE_BUCKETS = 256;
 private:
     // 线程数量
     int m_thread_number;
@@ -51,14 +86,29 @@ private:
     pthread_t* m_threads;
     // 请求队列中允许的待处理请求的最大数量
     int m_max_requests;
-    // 请求队列
-    std::list<T*> m_workqueue;
+    // 请求队列, 每个通道一个
+    std::list<task> m_workqueue[LANES];
+    // 所有通道中的任务总数. 在锁内修改, 自旋的线程在锁外读取
+    std::atomic<int> m_queued;
+    // 通道的调度权重, 以及加权轮询的当前值
+    int m_weight[LANES];
+    int m_current[LANES];
+    // 同时处理各通道任务的最大线程数, 以及正在处理的线程数
+    int m_limit[LANES];
+    int m_busy[LANES];
     // 互斥锁(请求队列是所有线程共享的, 因此需要互斥锁, 控制各线程对请求队列资源的访问)
     locker m_queuelocker;
-    // 信号量(用来判断是否有任务需要处理)
-    sem m_queuestat;
-    // 是否结束线程的标志
+    // 条件变量(用来等待有可取的任务). 通道有线程数限制时, 队列非空也不一定能取任务, 因此不用信号量
+    cond m_queuestat;
+    // 是否结束线程的标志, 以及还没有退出的工作线程数(析构时等待它变为0)
     bool m_stop;
+    int m_alive;
+    cond m_exitstat;
+    // 自旋时间(纳秒), 以及正在自旋的线程数(在锁内修改)
+    uint64_t m_spin_ns;
+    int m_spinning;
+    // 唤醒延迟直方图
+    std::atomic<long> m_wake_hist[WAKE_BUCKETS];
 };
 
 // 语法提醒: 这是类成员函数的类外实现, 需要加上模板声明
@@ -66,14 +116,28 @@ private:
 template<typename T>
 threadpool<T>::threadpool(int thread_number, int max_requests): 
     m_thread_number(thread_number), 
+    m_threads(NULL),
     m_max_requests(max_requests), 
+    m_queued(0),
     m_stop(false), 
-    m_threads(NULL) 
+    m_alive(thread_number),
+    m_spin_ns(0),
+    m_spinning(0)
 {
     // 1.错误检查
     if ((thread_number <= 0) || (max_requests <= 0)) {
         throw std::exception();
     }
+    // 默认各通道权重相同, 不限制线程数
+    for (int i = 0; i < LANES; i++) {
+        m_weight[i] = 1;
+        m_current[i] = 0;
+        m_limit[i] = 0;
+        m_busy[i] = 0;
+    }
+    for (int i = 0; i < WAKE_BUCKETS; i++) {
+        m_wake_hist[i].store(0);
+    }
     // 2.在堆区创建线程池数组
     m_threads = new pthread_t[m_thread_number];
     if (!m_threads) {  // 如果创建未成功, 抛出异常
@@ -100,8 +164,17 @@ threadpool<T>::threadpool(int thread_number, int max_requests):
 // 析构函数类外实现
 template<typename T>
 threadpool<T>::~threadpool() {
-    delete[] m_threads;
+    // 唤醒所有睡眠的工作线程, 等它们都退出run()之后才能销毁锁和条件变量. 线程是分离的, 不能join
+    m_queuelocker.lock();
     m_stop = true;
+    m_queuelocker.unlock();
+    m_queuestat.broadcast();
+    m_queuelocker.lock();
+    while (m_alive > 0) {
+        m_exitstat.wait(m_queuelocker.get());
+    }
+    m_queuelocker.unlock();
+    delete[] m_threads;
 }
 
 /*
@@ -110,23 +183,129 @@ append函数类外实现
 */
 template<typename T>
 bool threadpool<T>::append(T* request) {
-    // 1.要访问任务队列资源, 先获取互斥锁
+    // 1.对任务分类, 决定进入哪个通道. 分类不需要持有锁
+    int lane = request->lane();
+    if (lane < 0 || lane >= LANES) {
+        lane = 0;
+    }
+    // 2.要访问任务队列资源, 先获取互斥锁
     m_queuelocker.lock();
-    if (m_workqueue.size() >= m_max_requests) {
+    if (m_queued.load(std::memory_order_relaxed) >= m_max_requests) {
         // 如果队列中的任务数已超出最大允许量, 则不向其中添加任务
         m_queuelocker.unlock();
         return false;
     }
-    // 2.向队列中添加任务
-    m_workqueue.push_back(request);
-    // 3.释放互斥锁
+    // 3.向队列中添加任务
+    task t = {request, now()};
+    m_workqueue[lane].push_back(t);
+    m_queued.fetch_add(1, std::memory_order_relaxed);
+    WEBSERVER_PROBE(enqueue, request, m_queued.load(std::memory_order_relaxed), lane);
+    // 自旋的线程会在重新获取锁后取走任务, 它们取不完时才需要唤醒睡眠的线程
+    bool wake = m_spinning < m_queued.load(std::memory_order_relaxed);
+    // 4.释放互斥锁
     m_queuelocker.unlock();
-    // 4.通过信号量来通知一个线程可以从任务队列中获取并处理任务了
-    m_queuestat.post();
+    // 5.通过条件变量来通知一个线程可以从任务队列中获取并处理任务了
+    if (wake) {
+        m_queuestat.signal(m_queuelocker.get());
+    }
 
     return true;
 }
 
+template<typename T>
+void threadpool<T>::set_lane(int lane, int weight, int limit) {
+    m_queuelocker.lock();
+    m_weight[lane] = weight > 0 ? weight : 1;
+    m_limit[lane] = limit;
+    m_queuelocker.unlock();
+}
+
+/*
+pick函数类外实现
+功能: 平滑加权轮询. 每次调度时, 每个可取任务的通道的当前值加上自己的权重, 选出当前值最大的通道,
+再把它的当前值减去所有参与者的权重之和. 这样各通道被选中的次数与权重成正比, 且相互交错.
+*/
+template<typename T>
+int threadpool<T>::pick() {
+    int best = -1;
+    int total = 0;
+    for (int i = 0; i < LANES; i++) {
+        if (m_workqueue[i].empty() || (m_limit[i] > 0 && m_busy[i] >= m_limit[i])) {
+            continue;
+        }
+        m_current[i] += m_weight[i];
+        total += m_weight[i];
+        if (best < 0 || m_current[i] > m_current[best]) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        m_current[best] -= total;
+    }
+    return best;
+}
+
+template<typename T>
+uint64_t threadpool<T>::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+template<typename T>
+int threadpool<T>::wake_bucket(uint64_t ns) {
+    if (ns < 4) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return msb * 4 + ((ns >> (msb - 2)) & 3) - 4;
+}
+
+template<typename T>
+uint64_t threadpool<T>::bucket_floor(int bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    int msb = (bucket + 4) / 4;
+    return (uint64_t)(4 + (bucket + 4) % 4) << (msb - 2);
+}
+
+template<typename T>
+uint64_t threadpool<T>::wake_percentile(double p) const {
+    long total = 0;
+    for (int i = 0; i < WAKE_BUCKETS; i++) {
+        total += m_wake_hist[i].load(std::memory_order_relaxed);
+    }
+    long rank = (long)(p * total);
+    long seen = 0;
+    for (int i = 0; i < WAKE_BUCKETS; i++) {
+        seen += m_wake_hist[i].load(std::memory_order_relaxed);
+        if (seen > rank) {
+            return bucket_floor(i);
+        }
+    }
+    return 0;
+}
+
+/*
+spin的类外实现.
+功能: 调用者已释放锁. 只读取原子的任务计数, 不竞争锁, 直到有任务或者超时.
+*/
+template<typename T>
+void threadpool<T>::spin() {
+    uint64_t deadline = now() + m_spin_ns;
+    while (m_queued.load(std::memory_order_relaxed) == 0) {
+        for (int i = 0; i < 64; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        if (now() >= deadline) {
+            return;
+        }
+    }
+}
+
 /*
 worker的类外实现.
 功能: 子线程的回调函数, 工作线程
@@ -144,6 +323,17 @@ void* threadpool<T>::worker(void* arg) {
     return pool;  // 这里的返回值没什么用
 }
 
+template<typename T>
+bool threadpool<T>::idle() {
+    m_queuelocker.lock();
+    bool idle = m_queued.load(std::memory_order_relaxed) == 0;
+    for (int lane = 0; lane < LANES; lane++) {
+        idle = idle && m_busy[lane] == 0;
+    }
+    m_queuelocker.unlock();
+    return idle;
+}
+
 /*
 run的类外实现. 
 功能: 从任务队列中获取任务, 并且处理任务. 
@@ -152,28 +342,56 @@ template<typename T>
 void threadpool<T>::run() {
     while(!m_stop) {
         // 1.获取任务
-        // 1-1 执行信号量的wait操作, 保证任务队列中有任务供获取, 然后获取锁
-        m_queuestat.wait();
+        // 1-1 获取锁, 等待有可取的任务(队列非空, 且所在通道的线程数没有达到上限).
+        // 开启自旋时先释放锁自旋一次, 重新获取锁后再检查, 仍然没有任务才睡眠
         m_queuelocker.lock();
-        // 1-2 获取任务
-        // 如果没有任务就释放锁(本段代码实无必要, 可删除)
-        if (m_workqueue.empty()) {
+        int lane;
+        bool spun = m_spin_ns == 0;
+        while (!m_stop && (lane = pick()) < 0) {
+            if (!spun) {
+                m_spinning++;
+                m_queuelocker.unlock();
+                spin();
+                spun = true;
+                m_queuelocker.lock();
+                m_spinning--;
+                continue;
+            }
+            m_queuestat.wait(m_queuelocker.get());
+        }
+        if (m_stop) {
             m_queuelocker.unlock();
-            continue;
+            break;
         }
-        // 如果有任务就获取任务
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
+        // 1-2 获取任务
+        task t = m_workqueue[lane].front();
+        T* request = t.request;
+        m_workqueue[lane].pop_front();
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
+        m_busy[lane]++;
+        m_wake_hist[wake_bucket(now() - t.enqueued)].fetch_add(1, std::memory_order_relaxed);
+        WEBSERVER_PROBE(dequeue, request, m_queued.load(std::memory_order_relaxed), lane);
         // 1-3 释放锁
         m_queuelocker.unlock();
         // 2.处理任务
-        // 如果任务为NULL就不处理
-        if (!request) {
-            continue;
-        }
         // 如果任务不是NULL就处理
-        request->process();
+        if (request) {
+            request->process();
+        }
+        // 3.通道的线程数有上限时, 被它挡住的任务现在可以取了, 唤醒一个线程
+        m_queuelocker.lock();
+        m_busy[lane]--;
+        bool wake = m_limit[lane] > 0 && !m_workqueue[lane].empty();
+        m_queuelocker.unlock();
+        if (wake) {
+            m_queuestat.signal(m_queuelocker.get());
+        }
     }
+    // 在锁内减计数并通知: 析构函数要重新拿到锁才能看到m_alive为0, 那时本线程已经不再访问线程池的成员
+    m_queuelocker.lock();
+    m_alive--;
+    m_exitstat.signal(m_queuelocker.get());
+    m_queuelocker.unlock();
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,126 @@
+/*
+ * 访问日志解码工具: 把服务器写的二进制访问日志转换为文本或JSON, 每条记录一行.
+ * 编译: g++ -O2 tools/access_log_decode.cpp -lz -o access_log_decode
+ * 用法: access_log_decode [-j] [-r] file...
+ *   -j : 输出JSON(每行一个对象), 默认输出文本
+ *   -r : 输入是环文件(ring.<n>.seg, 或重启时保留下来的ring.<n>.<时间>.seg), 用于服务器崩溃后找回还没被压缩的记录.
+ *        环文件中可能有一部分记录已经被压缩进日志文件, 两者会有重复
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "../access_log.h"
+
+static const char* method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
+
+// 把URL按JSON字符串的规则转义后输出
+static void print_json_string(const char* s, int len) {
+    putchar('"');
+    for (int i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_record(const access_record& r, bool json) {
+    // 1.时间: UTC, 精确到微秒
+    char when[64];
+    time_t sec = r.timestamp / 1000000000ull;
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    int n = strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(when + n, sizeof(when) - n, ".%06uZ", (unsigned)(r.timestamp % 1000000000ull / 1000));
+    // 2.客户端地址
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = r.addr;
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    const char* method = r.method < sizeof(method_names) / sizeof(method_names[0]) ? method_names[r.method] : "-";
+    const char* protocol = r.protocol == 2 ? "HTTP/2" : "HTTP/1.1";
+    int url_len = r.url_len < access_record::URL_LEN ? r.url_len : access_record::URL_LEN;
+    bool truncated = r.url_len > access_record::URL_LEN;
+    if (json) {
+        printf("{\"time\":\"%s\",\"client\":\"%s:%u\",\"method\":\"%s\",\"url\":", when, ip, ntohs(r.port), method);
+        print_json_string(r.url, url_len);
+        printf(",\"url_truncated\":%s,\"protocol\":\"%s\",\"status\":%u,\"bytes\":%llu,\"latency_us\":%u}\n",
+            truncated ? "true" : "false", protocol, r.status, (unsigned long long)r.bytes, r.latency);
+    } else {
+        printf("%s %s:%u %s %.*s%s %s %u %llu %uus\n", when, ip, ntohs(r.port), method,
+            url_len > 0 ? url_len : 1, url_len > 0 ? r.url : "-", truncated ? "..." : "", protocol,
+            r.status, (unsigned long long)r.bytes, r.latency);
+    }
+}
+
+// 解码一个文件, 成功返回true
+static bool decode(const char* path, bool json, bool raw) {
+    // gzread也能读取未压缩的文件(环文件)
+    gzFile in = gzopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "无法打开 %s\n", path);
+        return false;
+    }
+    if (!raw) {
+        access_log_header header;
+        if (gzread(in, &header, sizeof(header)) != (int)sizeof(header) || memcmp(header.magic, "WSACCLOG", 8) != 0) {
+            fprintf(stderr, "%s 不是访问日志文件\n", path);
+            gzclose(in);
+            return false;
+        }
+        if (header.version != access_log::VERSION || header.record_size != sizeof(access_record)) {
+            fprintf(stderr, "%s 的版本(%u)或记录大小(%u)不受支持\n", path, header.version, header.record_size);
+            gzclose(in);
+            return false;
+        }
+    }
+    access_record r;
+    int n;
+    while ((n = gzread(in, &r, sizeof(r))) == (int)sizeof(r)) {
+        if (raw && r.timestamp == 0) {
+            continue;  // 环文件中的空槽位
+        }
+        print_record(r, json);
+    }
+    bool ok = n == 0;
+    if (!ok) {
+        fprintf(stderr, "%s 的结尾不完整(服务器可能仍在写入)\n", path);
+    }
+    gzclose(in);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    bool json = false;
+    bool raw = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "jr")) != -1) {
+        switch (opt) {
+            case 'j': json = true; break;
+            case 'r': raw = true; break;
+            default:
+                printf("按照如下格式运行: %s [-j] [-r] file...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        printf("按照如下格式运行: %s [-j] [-r] file...\n", argv[0]);
+        return 1;
+    }
+    int ret = 0;
+    for (int i = optind; i < argc; i++) {
+        if (!decode(argv[i], json, raw)) {
+            ret = 1;
+        }
+    }
+    return ret;
+}
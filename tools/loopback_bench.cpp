@@ -0,0 +1,210 @@
+/*
+ * 内存回环基准测试: 不经过内核, 通过memory_transport(见transport.h)把请求直接送进服务器的
+ * read() -> process() -> write(), 测量解析、线程池和应答的用户态开销.
+ * 编译(在仓库根目录): g++ -std=c++20 -O2 -pthread tools/loopback_bench.cpp $(ls *.cpp | grep -v main.cpp) -lz -o loopback_bench
+ * 用法: loopback_bench [-c conns] [-n requests] [-u url] [-w threads] [-C] [-E] [-m max_file_size] [-k pack_file]
+ *   -c conns      : 并发的keep-alive连接数, 默认64
+ *   -n requests   : 请求总数, 默认1000000
+ *   -u url        : 请求的URL, 默认/health(保留路由, 不访问文件系统)
+ *   -w threads    : 线程池的线程数, 默认4; 0表示在事件循环中直接调用process(), 结果可以逐次复现
+ *   -C            : 协程模式(与服务器的-C相同)
+ *   -E            : 单次注册模式(与服务器的-E相同)
+ *   -m max_file_size, -k pack_file : 与服务器的同名选项相同, 从资源仓库提供资源
+ * 事件循环与服务器主线程的相同, 只是事件来自内存管道. 每个连接同时只有一个请求, 收到完整的应答后
+ * 发出下一个. 延迟从请求写入管道开始, 到应答被客户端一侧读完为止.
+ * 服务器的调试输出(printf)在测试期间被重定向到/dev/null, 但格式化的开销仍然计算在内.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../http_conn.h"
+#include "../conn_table.h"
+#include "../threadpool.h"
+#include "../transport.h"
+#include "../asset_store.h"
+#include "../event_dispatcher.h"
+
+#define MAX_EVENT_NUMBER 10000
+
+extern const char* doc_root;
+
+// 客户端一侧每个连接的状态
+struct client {
+    int quota;  // 还要发出的请求数
+    uint64_t sent_at;  // 当前请求写入管道的时间
+    std::string buf;  // 收到但还不完整的应答
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char* prog) {
+    printf("用法: %s [-c conns] [-n requests] [-u url] [-w threads] [-C] [-E] [-m max_file_size] [-k pack_file]\n", prog);
+}
+
+// 从buf中取出一个完整的应答, 返回它的长度(不完整时返回0), status为状态码
+static size_t parse_response(const std::string& buf, int* status) {
+    size_t head = buf.find("\r\n\r\n");
+    if (head == std::string::npos) {
+        return 0;
+    }
+    head += 4;
+    *status = atoi(buf.c_str() + 9);  // "HTTP/1.1 200"
+    size_t length = 0;
+    const char* p = strcasestr(buf.c_str(), "\r\nContent-Length:");
+    if (p && (size_t)(p - buf.c_str()) < head) {
+        length = strtoul(p + 17, NULL, 10);
+    }
+    return buf.size() >= head + length ? head + length : 0;
+}
+
+int main(int argc, char* argv[]) {
+    // 1.参数
+    int conns = 64;
+    long total = 1000000;
+    const char* url = "/health";
+    int threads = 4;
+    size_t asset_max_size = 0;
+    const char* pack_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:u:w:CEm:k:")) != -1) {
+        switch (opt) {
+            case 'c': conns = atoi(optarg); break;
+            case 'n': total = atol(optarg); break;
+            case 'u': url = optarg; break;
+            case 'w': threads = atoi(optarg); break;
+            case 'C':
+#if HAS_COROUTINE
+                http_conn::m_coroutine = true;
+                break;
+#else
+                printf("当前编译器不支持C++20协程, 请以-std=c++20重新编译\n");
+                exit(-1);
+#endif
+            case 'E': http_conn::m_register_once = true; break;
+            case 'm': asset_max_size = strtoul(optarg, NULL, 10); break;
+            case 'k': pack_path = optarg; break;
+            default: usage(basename(argv[0])); exit(-1);
+        }
+    }
+    if (conns <= 0 || conns > MAX_EVENT_NUMBER || total < conns || (http_conn::m_register_once && http_conn::m_coroutine)) {
+        usage(basename(argv[0]));
+        exit(-1);
+    }
+    bool inline_process = threads == 0;
+
+    // 2.与服务器相同的初始化, 但传输层换成内存管道. 服务器的调试输出很多, 测试期间丢弃
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (!freopen("/dev/null", "w", stdout)) {
+        perror("freopen");
+        exit(-1);
+    }
+    if (asset_max_size > 0 || pack_path) {
+        asset_store* store = pack_path ? asset_store::load_pack(pack_path, false)
+            : asset_store::load(doc_root, asset_max_size, false, false);
+        if (!store) {
+            exit(-1);
+        }
+        asset_store::publish(store);
+    }
+    // 内联模式下仍然创建一个线程, 协程模式和/stats需要线程池
+    threadpool<http_conn>* pool = new threadpool<http_conn>(inline_process ? 1 : threads);
+    http_conn::m_pool = pool;
+    memory_transport pipes(conns);
+    http_conn::m_transport = &pipes;
+    conn_table* users = new conn_table(conns);
+    http_conn::m_table = users;
+
+    std::string request = std::string("GET ") + url + " HTTP/1.1\r\nHost: loopback\r\nConnection: keep-alive\r\n\r\n";
+    std::vector<client> clients(conns);
+    std::vector<uint32_t> latency;
+    latency.reserve(total);
+    long non2xx = 0;
+
+    // 3.建立连接, 每个连接发出第一个请求
+    uint64_t start = now_ns();
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < conns; i++) {
+        int fd = pipes.open();
+        (*users)[fd].init(fd, addr);
+        clients[fd].quota = total / conns + (i < total % conns ? 1 : 0) - 1;
+        clients[fd].sent_at = now_ns();
+        pipes.client_write(fd, request.data(), request.size());
+    }
+
+    // 4.事件循环: 服务器一侧的处理与main.cpp相同(见event_dispatcher.h); 之后客户端一侧读取应答, 发出下一个请求
+    event_dispatcher dispatcher(users, &pipes, pool, inline_process);
+    epoll_event events[MAX_EVENT_NUMBER];
+    int ready[MAX_EVENT_NUMBER];
+    char chunk[64 * 1024];
+    long done = 0;
+    while (http_conn::m_user_count > 0) {  // 所有请求完成后客户端关闭连接, 服务器关闭全部连接后结束
+        int num = pipes.wait(events, MAX_EVENT_NUMBER, 100);
+        for (int i = 0; i < num; i++) {
+            dispatcher.handle(events[i].data.u64, events[i].events);
+        }
+        int n = pipes.readable(ready, MAX_EVENT_NUMBER);
+        for (int i = 0; i < n; i++) {
+            int fd = ready[i];
+            client& c = clients[fd];
+            size_t got;
+            while ((got = pipes.client_read(fd, chunk, sizeof(chunk))) > 0) {
+                c.buf.append(chunk, got);
+            }
+            int status;
+            size_t len;
+            while ((len = parse_response(c.buf, &status)) > 0) {
+                c.buf.erase(0, len);
+                latency.push_back(now_ns() - c.sent_at);
+                done++;
+                if (status < 200 || status >= 300) {
+                    non2xx++;
+                }
+                if (c.quota > 0) {
+                    c.quota--;
+                    c.sent_at = now_ns();
+                    pipes.client_write(fd, request.data(), request.size());
+                } else {
+                    pipes.client_close(fd);
+                }
+            }
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    // 5.报告
+    if (done < total) {
+        printf("只完成了 %ld / %ld 个请求\n", done, total);
+    }
+    std::sort(latency.begin(), latency.end());
+    double seconds = elapsed / 1e9;
+    printf("%ld 个请求, %d 个连接, %s, 用时 %.3f 秒\n", done, conns,
+        inline_process ? "内联处理" : "线程池处理", seconds);
+    printf("吞吐量: %.0f 请求/秒, 非2xx应答: %ld\n", done / seconds, non2xx);
+    if (!latency.empty()) {
+        printf("延迟(微秒): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+            latency[latency.size() * 50 / 100] / 1e3, latency[latency.size() * 90 / 100] / 1e3,
+            latency[latency.size() * 99 / 100] / 1e3, latency[latency.size() * 999 / 1000] / 1e3,
+            latency.back() / 1e3);
+    }
+    delete pool;
+    delete users;
+    return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * 资源包生成工具: 把目录下的所有文件打包成一个资源包(格式见asset_pack.h), 由服务器的-k选项使用.
+ * 编译: g++ -O2 tools/pack_build.cpp -lz -o pack_build
+ * 用法: pack_build [-g] doc_root output.pack
+ *   -g : 为每个文件生成gzip预压缩版本, 压缩后至少小10%时才保留
+ * 与服务器一样, 只打包Others可读的普通文件. 输出先写到临时文件, 完成后rename为output.pack,
+ * 因此可以直接覆盖服务器正在使用的包, 然后向服务器发送SIGHUP.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "../asset_pack.h"
+#include "../mime.h"
+
+// 遍历时收集到的文件
+struct file_entry {
+    std::string path;  // 文件的完整路径
+    std::string url;  // 对应的URL
+    size_t size;
+    time_t mtime;
+};
+
+static bool by_url(const file_entry& a, const file_entry& b) {
+    return a.url < b.url;
+}
+
+static uint64_t align_up(uint64_t n, uint64_t a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+// 递归遍历目录, 收集Others可读的普通文件
+static void collect(const std::string& dir, const std::string& url, std::vector<file_entry>& out) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "无法打开目录 %s\n", dir.c_str());
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        std::string path = dir + "/" + ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            collect(path, url + "/" + ent->d_name, out);
+        } else if (S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)) {
+            file_entry e;
+            e.path = path;
+            e.url = url + "/" + ent->d_name;
+            e.size = st.st_size;
+            e.mtime = st.st_mtime;
+            out.push_back(e);
+        }
+    }
+    closedir(d);
+}
+
+// 读入整个文件, 大小与遍历时不一致(文件在此期间被改动)时返回false
+static bool read_file(const file_entry& f, std::vector<char>& data) {
+    data.resize(f.size);
+    int fd = open(f.path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < f.size) {
+        ssize_t n = read(fd, data.data() + done, f.size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    char extra;
+    bool ok = done == f.size && read(fd, &extra, 1) == 0;
+    close(fd);
+    return ok;
+}
+
+// 以gzip格式压缩
+static bool gzip(const std::vector<char>& in, std::vector<char>& out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&zs, in.size()) + 32);
+    zs.next_in = (Bytef*)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef*)out.data();
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+static bool write_at(int fd, const void* buf, size_t len, uint64_t offset) {
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bool precompress = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "g")) != -1) {
+        switch (opt) {
+            case 'g': precompress = true; break;
+            default:
+                printf("按照如下格式运行: %s [-g] doc_root output.pack\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        printf("按照如下格式运行: %s [-g] doc_root output.pack\n", argv[0]);
+        return 1;
+    }
+    std::string root = argv[optind];
+    while (root.size() > 1 && root[root.size() - 1] == '/') {
+        root.erase(root.size() - 1);
+    }
+    const char* output = argv[optind + 1];
+
+    // 1.收集文件, 按URL排序
+    std::vector<file_entry> files;
+    collect(root, "", files);
+    std::sort(files.begin(), files.end(), by_url);
+
+    // 2.生成字符串区: URL, 以及去重后的MIME类型
+    std::vector<pack_entry> entries(files.size());
+    std::string strings;
+    std::map<std::string, uint32_t> mimes;
+    for (size_t i = 0; i < files.size(); i++) {
+        pack_entry& e = entries[i];
+        memset(&e, 0, sizeof(e));
+        e.url = strings.size();
+        e.url_len = files[i].url.size();
+        strings.append(files[i].url);
+        strings.push_back('\0');
+        std::string mime = mime_type(files[i].url.c_str());
+        std::map<std::string, uint32_t>::iterator it = mimes.find(mime);
+        if (it == mimes.end()) {
+            it = mimes.insert(std::make_pair(mime, (uint32_t)strings.size())).first;
+            strings.append(mime);
+            strings.push_back('\0');
+        }
+        e.mime = it->second;
+        e.mtime = files[i].mtime;
+    }
+
+    pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, 8);
+    header.version = PACK_VERSION;
+    header.count = files.size();
+    header.strings = sizeof(pack_header) + sizeof(pack_entry) * files.size();
+    header.strings_len = strings.size();
+    header.data = align_up(header.strings + header.strings_len, PACK_ALIGN);
+
+    // 3.写入内容块, 每块都从页边界开始
+    std::string tmp = std::string(output) + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    uint64_t offset = header.data;
+    uint64_t raw_bytes = 0, gz_bytes = 0;
+    int gz_count = 0;
+    bool ok = true;
+    std::vector<char> data, packed;
+    for (size_t i = 0; i < files.size() && ok; i++) {
+        pack_entry& e = entries[i];
+        if (!read_file(files[i], data)) {
+            fprintf(stderr, "读取 %s 失败(文件可能正在被修改)\n", files[i].path.c_str());
+            ok = false;
+            break;
+        }
+        e.offset = offset;
+        e.length = data.size();
+        ok = write_at(fd, data.data(), data.size(), offset);
+        offset = align_up(offset + data.size(), PACK_ALIGN);
+        raw_bytes += data.size();
+        if (precompress && data.size() > 0 && gzip(data, packed) && packed.size() < data.size() / 10 * 9) {
+            e.gz_offset = offset;
+            e.gz_length = packed.size();
+            ok = ok && write_at(fd, packed.data(), packed.size(), offset);
+            offset = align_up(offset + packed.size(), PACK_ALIGN);
+            gz_bytes += packed.size();
+            gz_count++;
+        }
+    }
+
+    // 4.最后写入文件头、索引和字符串区. 文件大小补齐到页边界
+    header.size = offset;
+    ok = ok && ftruncate(fd, offset) == 0
+        && write_at(fd, &header, sizeof(header), 0)
+        && write_at(fd, entries.data(), sizeof(pack_entry) * entries.size(), sizeof(header))
+        && write_at(fd, strings.data(), strings.size(), header.strings)
+        && fsync(fd) == 0;
+    close(fd);
+    // 5.原子地替换旧的包
+    if (!ok || rename(tmp.c_str(), output) != 0) {
+        perror("写入资源包失败");
+        unlink(tmp.c_str());
+        return 1;
+    }
+    printf("%s: %zu 个文件, 内容 %llu 字节, %d 个gzip版本共 %llu 字节, 包大小 %llu 字节\n", output, files.size(),
+        (unsigned long long)raw_bytes, gz_count, (unsigned long long)gz_bytes, (unsigned long long)header.size);
+    return 0;
+}
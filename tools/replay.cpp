@@ -0,0 +1,489 @@
+/*
+ * 流量重放工具: 把服务器-T选项录制的流量按原来的时序重放给服务器, 按URL分类报告延迟分位数.
+ * 编译: g++ -O2 tools/replay.cpp -o replay
+ * 用法: replay [-s speed] [-a addr] [-p] [-t timeout] capture_file port
+ *   -s speed   : 重放速度的倍数, 默认1(原速), 2表示所有时间间隔缩短一半, 0表示不等待, 尽快发送
+ *   -a addr    : 服务器的IPv4地址, 默认127.0.0.1
+ *   -p         : 按URL的第一级目录(如/images/)分类, 默认按扩展名(如.jpg)分类
+ *   -t timeout : 最后一条记录重放之后, 等待剩余应答的最长时间(秒), 默认5
+ * 录制中的每个连接都用一个新连接重放, 连接内的数据保持原来的顺序和时间间隔.
+ * 一个请求的延迟从它的最后一个字节被send出去开始, 到收到完整的应答为止.
+ * HTTP/2连接(以及升级到h2c的连接)照常重放, 但不统计延迟.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include "../capture.h"
+
+// 录制中的一条记录
+struct event {
+    uint64_t time;
+    uint32_t conn;
+    uint16_t type;
+    uint16_t len;
+    const char* data;
+};
+
+// 已发出、还没有收到应答的请求
+struct pending {
+    std::string url_class;
+    uint64_t end;  // 请求最后一个字节在连接输出流中的位置
+    uint64_t sent_at;  // 最后一个字节被send出去的时间, 0表示还没有发出
+};
+
+// 重放中的一个连接
+struct replay_conn {
+    int fd;
+    bool started;  // 已经发起了连接
+    bool connected;
+    bool closing;  // 录制中的连接已经关闭, 收完所有应答后关闭
+    bool done;  // 已关闭
+    bool h2;  // HTTP/2连接, 不解析请求和应答
+    std::string out;  // 还没有发出的数据
+    uint64_t out_total;  // 累计交给本连接的字节数
+    uint64_t sent_total;  // 累计send出去的字节数
+    std::string req;  // 正在解析的请求头
+    uint64_t req_body;  // 请求体还没有读到的字节数
+    std::deque<pending> waiting;
+    std::string in;  // 正在解析的应答头
+    uint64_t resp_body;  // 应答体还没有收到的字节数
+    bool in_body;
+    int status;
+};
+
+// 每类URL的统计
+struct url_stats {
+    std::vector<uint32_t> latency;  // 微秒
+    long non2xx;
+};
+
+static bool by_prefix = false;
+static std::map<std::string, url_stats> stats;
+static long requests_failed = 0;  // 连接断开时还没有收到应答的请求
+static long h2_conns = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// URL的分类: 按扩展名, 或者按第一级目录. 没有扩展名(或者在根目录下)的URL自成一类
+static std::string classify(std::string url) {
+    size_t q = url.find('?');
+    if (q != std::string::npos) {
+        url.erase(q);
+    }
+    if (by_prefix) {
+        size_t slash = url.find('/', 1);
+        return slash == std::string::npos ? "/" : url.substr(0, slash + 1);
+    }
+    size_t slash = url.rfind('/');
+    size_t dot = url.rfind('.');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+        return url.substr(dot);
+    }
+    return url.size() > 40 ? url.substr(0, 40) : url;
+}
+
+// 在头部块中查找Content-Length
+static uint64_t content_length(const std::string& head) {
+    size_t pos = 0;
+    while ((pos = head.find("\r\n", pos)) != std::string::npos) {
+        pos += 2;
+        if (strncasecmp(head.c_str() + pos, "Content-Length:", 15) == 0) {
+            return strtoull(head.c_str() + pos + 15, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+// 解析交给连接的数据, 找出其中的请求, 记录每个请求在输出流中的结束位置
+static void parse_requests(replay_conn& c, const char* data, int len) {
+    if (c.h2) {
+        return;
+    }
+    if (c.out_total == (uint64_t)len && len >= 3 && memcmp(data, "PRI", 3) == 0) {
+        c.h2 = true;
+        h2_conns++;
+        return;
+    }
+    uint64_t base = c.out_total - len;  // data在输出流中的位置
+    int i = 0;
+    while (i < len) {
+        if (c.req_body > 0) {
+            uint64_t n = std::min<uint64_t>(c.req_body, len - i);
+            c.req_body -= n;
+            i += n;
+            if (c.req_body == 0) {
+                c.waiting.back().end = base + i;
+            }
+            continue;
+        }
+        c.req.push_back(data[i++]);
+        size_t n = c.req.size();
+        if (n >= 4 && memcmp(c.req.data() + n - 4, "\r\n\r\n", 4) == 0) {
+            // 请求行: 方法 URL 版本
+            pending p;
+            size_t sp1 = c.req.find(' ');
+            size_t sp2 = sp1 == std::string::npos ? std::string::npos : c.req.find(' ', sp1 + 1);
+            p.url_class = sp2 == std::string::npos ? "(bad)" : classify(c.req.substr(sp1 + 1, sp2 - sp1 - 1));
+            p.end = base + i;
+            p.sent_at = 0;
+            c.req_body = content_length(c.req);
+            c.waiting.push_back(p);
+            c.req.clear();
+        }
+    }
+}
+
+// 一个应答收完了, 与最早的未应答请求配对
+static void response_done(replay_conn& c, uint64_t now) {
+    if (c.waiting.empty()) {
+        return;
+    }
+    pending& p = c.waiting.front();
+    url_stats& s = stats[p.url_class];
+    if (p.sent_at) {
+        s.latency.push_back((now - p.sent_at) / 1000);
+    }
+    if (c.status < 200 || c.status >= 300) {
+        s.non2xx++;
+    }
+    c.waiting.pop_front();
+}
+
+// 解析收到的应答
+static void parse_responses(replay_conn& c, const char* data, int len, uint64_t now) {
+    int i = 0;
+    while (i < len && !c.h2) {
+        if (c.in_body) {
+            uint64_t n = std::min<uint64_t>(c.resp_body, len - i);
+            c.resp_body -= n;
+            i += n;
+            if (c.resp_body == 0) {
+                c.in_body = false;
+                response_done(c, now);
+            }
+            continue;
+        }
+        c.in.push_back(data[i++]);
+        size_t n = c.in.size();
+        if (n >= 4 && memcmp(c.in.data() + n - 4, "\r\n\r\n", 4) == 0) {
+            c.status = c.in.size() > 12 ? atoi(c.in.c_str() + 9) : 0;
+            if (c.status == 101) {  // 升级到h2c, 之后不再解析
+                c.h2 = true;
+                h2_conns++;
+                c.waiting.clear();
+                break;
+            }
+            c.resp_body = content_length(c.in);
+            c.in.clear();
+            if (c.resp_body == 0) {
+                response_done(c, now);
+            } else {
+                c.in_body = true;
+            }
+        }
+    }
+}
+
+static void close_conn(replay_conn& c) {
+    if (c.fd != -1) {
+        close(c.fd);
+        c.fd = -1;
+    }
+    if (!c.h2) {
+        requests_failed += c.waiting.size();
+    }
+    c.waiting.clear();
+    c.done = true;
+}
+
+// 录制中的连接已经关闭, 且所有应答都已收到时, 关闭重放的连接
+static void maybe_close(replay_conn& c) {
+    if (c.closing && !c.done && c.out.empty() && (c.waiting.empty() || c.h2)) {
+        close_conn(c);
+    }
+}
+
+// 尽量发送缓存的数据
+static void flush_out(replay_conn& c) {
+    if (!c.connected || c.done) {
+        return;
+    }
+    while (!c.out.empty()) {
+        ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(c);
+            }
+            break;
+        }
+        c.out.erase(0, n);
+        c.sent_total += n;
+    }
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < c.waiting.size() && c.waiting[i].end <= c.sent_total; i++) {
+        if (!c.waiting[i].sent_at) {
+            c.waiting[i].sent_at = now;
+        }
+    }
+    maybe_close(c);
+}
+
+static bool load(const char* path, std::vector<char>& file, std::vector<event>& events, uint32_t& max_conn) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        file.insert(file.end(), buf, buf + n);
+    }
+    fclose(fp);
+    capture_header header;
+    if (file.size() < sizeof(header)) {
+        fprintf(stderr, "%s: 文件太短\n", path);
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, "WSCAPTUR", 8) != 0 || header.version != capture::VERSION
+        || header.record_size != sizeof(capture_record)) {
+        fprintf(stderr, "%s: 不是录制文件, 或者版本不匹配\n", path);
+        return false;
+    }
+    max_conn = 0;
+    size_t pos = sizeof(header);
+    while (pos + sizeof(capture_record) <= file.size()) {
+        capture_record rec;
+        memcpy(&rec, file.data() + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (pos + rec.len > file.size()) {
+            break;  // 最后一条记录不完整(服务器没有正常退出)
+        }
+        event e = {rec.time, rec.conn, rec.type, rec.len, file.data() + pos};
+        events.push_back(e);
+        max_conn = std::max(max_conn, rec.conn);
+        pos += rec.len;
+    }
+    return true;
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(p * sorted.size());
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static void print_row(const char* name, std::vector<uint32_t>& lat, long non2xx) {
+    std::sort(lat.begin(), lat.end());
+    printf("%-24s %8zu %8ld %10u %10u %10u %10u %10u\n", name, lat.size(), non2xx, percentile(lat, 0.5),
+        percentile(lat, 0.9), percentile(lat, 0.99), percentile(lat, 0.999), lat.empty() ? 0 : lat.back());
+}
+
+static bool by_count(const std::pair<std::string, url_stats*>& a, const std::pair<std::string, url_stats*>& b) {
+    return a.second->latency.size() > b.second->latency.size();
+}
+
+int main(int argc, char* argv[]) {
+    double speed = 1;
+    const char* addr = "127.0.0.1";
+    int timeout = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:a:pt:")) != -1) {
+        switch (opt) {
+            case 's': speed = atof(optarg); break;
+            case 'a': addr = optarg; break;
+            case 'p': by_prefix = true; break;
+            case 't': timeout = atoi(optarg); break;
+            default:
+                printf("按照如下格式运行: %s [-s speed] [-a addr] [-p] [-t timeout] capture_file port\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        printf("按照如下格式运行: %s [-s speed] [-a addr] [-p] [-t timeout] capture_file port\n", argv[0]);
+        return 1;
+    }
+
+    // 1.读入录制文件
+    std::vector<char> file;
+    std::vector<event> events;
+    uint32_t max_conn;
+    if (!load(argv[optind], file, events, max_conn)) {
+        return 1;
+    }
+    std::vector<replay_conn> conns(max_conn + 1);
+    for (size_t i = 0; i < conns.size(); i++) {
+        replay_conn& c = conns[i];
+        c.fd = -1;
+        c.started = c.connected = c.closing = c.done = c.h2 = c.in_body = false;
+        c.out_total = c.sent_total = c.req_body = c.resp_body = 0;
+        c.status = 0;
+    }
+    struct sockaddr_in saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, addr, &saddr.sin_addr) != 1) {
+        fprintf(stderr, "地址不合法: %s\n", addr);
+        return 1;
+    }
+    // 同时打开的连接数可能很多, 把文件描述符的上限提到最高
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // 2.事件循环: 到了时间的记录依次重放, 其余时间等待套接字事件, 或者等待定时器到达下一条记录的时间
+    int epfd = epoll_create1(0);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = UINT64_MAX;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+    uint64_t start = now_ns();
+    uint64_t deadline = 0;  // 所有记录重放完之后, 等待应答的截止时间
+    size_t next = 0;
+    long opened = 0, connect_failed = 0;
+    epoll_event events_out[1024];
+    char buf[65536];
+    while (true) {
+        uint64_t now = now_ns();
+        // 2-1 重放到了时间的记录
+        while (next < events.size() && start + (uint64_t)(speed > 0 ? events[next].time / speed : 0) <= now) {
+            const event& e = events[next++];
+            replay_conn& c = conns[e.conn];
+            if (e.type == capture::OPEN) {
+                c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+                c.started = true;
+                opened++;
+                if (c.fd == -1 || (connect(c.fd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1 && errno != EINPROGRESS)) {
+                    perror("connect");
+                    connect_failed++;
+                    close_conn(c);
+                    continue;
+                }
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.u64 = e.conn;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+            } else if (e.type == capture::DATA && c.started && !c.done) {
+                c.out.append(e.data, e.len);
+                c.out_total += e.len;
+                parse_requests(c, e.data, e.len);
+                flush_out(c);
+            } else if (e.type == capture::CLOSE && c.started) {
+                c.closing = true;
+                maybe_close(c);
+            }
+        }
+        // 2-2 所有记录都重放完了, 等待剩余的连接结束
+        int timeout_ms = -1;
+        if (next == events.size()) {
+            bool all_done = true;
+            for (size_t i = 0; i < conns.size() && all_done; i++) {
+                all_done = !conns[i].started || conns[i].done;
+            }
+            if (all_done) {
+                break;
+            }
+            if (deadline == 0) {
+                deadline = now + timeout * 1000000000ull;
+            } else if (now >= deadline) {
+                break;
+            }
+            timeout_ms = (deadline - now) / 1000000 + 1;
+        } else {
+            uint64_t due = start + (uint64_t)(speed > 0 ? events[next].time / speed : 0);
+            struct itimerspec its;
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = due / 1000000000ull;
+            its.it_value.tv_nsec = due % 1000000000ull;
+            timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+        }
+        // 2-3 处理套接字事件
+        int num = epoll_wait(epfd, events_out, 1024, timeout_ms);
+        now = now_ns();
+        for (int i = 0; i < num; i++) {
+            if (events_out[i].data.u64 == UINT64_MAX) {
+                uint64_t expirations;
+                while (read(tfd, &expirations, sizeof(expirations)) > 0) {
+                }
+                continue;
+            }
+            replay_conn& c = conns[events_out[i].data.u64];
+            if (c.done) {
+                continue;
+            }
+            if (!c.connected && (events_out[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    connect_failed++;
+                    close_conn(c);
+                    continue;
+                }
+                c.connected = true;
+            }
+            if (events_out[i].events & EPOLLIN) {
+                ssize_t n;
+                while ((n = recv(c.fd, buf, sizeof(buf), 0)) > 0) {
+                    parse_responses(c, buf, n, now);
+                }
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    close_conn(c);
+                    continue;
+                }
+            }
+            if (events_out[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                close_conn(c);
+                continue;
+            }
+            flush_out(c);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    double recorded = events.empty() ? 0 : events.back().time / 1e9;
+
+    // 3.报告: 按请求数从多到少列出每类URL的延迟分位数, 最后一行是全部请求
+    std::vector<std::pair<std::string, url_stats*> > rows;
+    std::vector<uint32_t> all;
+    long all_non2xx = 0;
+    for (std::map<std::string, url_stats>::iterator it = stats.begin(); it != stats.end(); ++it) {
+        rows.push_back(std::make_pair(it->first, &it->second));
+        all.insert(all.end(), it->second.latency.begin(), it->second.latency.end());
+        all_non2xx += it->second.non2xx;
+    }
+    std::sort(rows.begin(), rows.end(), by_count);
+    printf("连接 %ld 个(连接失败 %ld, HTTP/2 %ld), 请求 %zu 个(未收到应答 %ld), 录制时长 %.3f 秒, 重放用时 %.3f 秒, %.1f 请求/秒\n",
+        opened, connect_failed, h2_conns, all.size(), requests_failed, recorded, elapsed, elapsed > 0 ? all.size() / elapsed : 0);
+    printf("%-24s %8s %8s %10s %10s %10s %10s %10s\n", "class", "count", "non2xx", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for (size_t i = 0; i < rows.size(); i++) {
+        print_row(rows[i].first.c_str(), rows[i].second->latency, rows[i].second->non2xx);
+    }
+    print_row("ALL", all, all_non2xx);
+    close(tfd);
+    close(epfd);
+    return requests_failed > 0 || connect_failed > 0 ? 2 : 0;
+}
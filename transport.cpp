@@ -0,0 +1,263 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "transport.h"
+#include "http_conn.h"
+
+extern void removefd(int epfd, int fd);
+extern void modfd(int epfd, int fd, int event, uint32_t generation);
+
+void socket_transport::add(int fd, uint32_t generation, bool once) {
+    // fd由accept4创建时已经是非阻塞的, 这里只有一次epoll_ctl
+    struct epoll_event epev;
+    epev.data.u64 = conn_key(fd, generation);
+    if (once) {
+        epev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    } else {
+        epev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;  // 需要检测cfd的EPOLLONESHOT事件; 对cfd使用边沿触发
+    }
+    epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &epev);
+}
+
+void socket_transport::mod(int fd, int event, uint32_t generation) {
+    modfd(m_epfd, fd, event, generation);
+}
+
+void socket_transport::remove(int fd) {
+    removefd(m_epfd, fd);
+}
+
+ssize_t socket_transport::recv(int fd, void* buf, size_t len) {
+    return ::recv(fd, buf, len, 0);
+}
+
+ssize_t socket_transport::writev(int fd, const struct iovec* iov, int count) {
+    return ::writev(fd, iov, count);
+}
+
+void socket_transport::shutdown_write(int fd) {
+    shutdown(fd, SHUT_WR);
+}
+
+bool socket_transport::enable_zerocopy(int fd) {
+    int on = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+}
+
+memory_transport::memory_transport(int max_fd): m_pipes(max_fd) {
+    for (size_t i = 0; i < m_pipes.size(); i++) {
+        pipe& p = m_pipes[i];
+        p.in_off = p.out_off = 0;
+        p.generation = 0;
+        p.event = 0;
+        p.armed = p.once = p.used = p.open = p.peer_closed = p.readable = false;
+    }
+}
+
+void memory_transport::check(int fd) {
+    pipe& p = m_pipes[fd];
+    if (!p.open || !p.armed) {
+        return;
+    }
+    uint32_t events = 0;
+    if ((p.event & EPOLLIN) && p.in.size() > p.in_off) {
+        events |= EPOLLIN;
+    }
+    if ((p.event & EPOLLOUT) && p.out.size() - p.out_off < OUT_LIMIT) {
+        events |= EPOLLOUT;
+    }
+    if (p.peer_closed) {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (!events) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = conn_key(fd, p.generation);
+    m_ready.push_back(ev);
+    p.armed = p.once;
+    if (m_ready.size() == 1 && m_readable.empty()) {
+        m_ready_cond.signal(m_lock.get());
+    }
+}
+
+void memory_transport::add(int fd, uint32_t generation, bool once) {
+    m_lock.lock();
+    pipe& p = m_pipes[fd];
+    p.open = true;
+    p.generation = generation;
+    p.event = once ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    p.armed = true;
+    p.once = once;
+    check(fd);
+    m_lock.unlock();
+}
+
+void memory_transport::mod(int fd, int event, uint32_t generation) {
+    m_lock.lock();
+    pipe& p = m_pipes[fd];
+    p.generation = generation;
+    p.event = event;
+    p.armed = true;
+    p.once = false;
+    check(fd);
+    m_lock.unlock();
+}
+
+void memory_transport::remove(int fd) {
+    m_lock.lock();
+    pipe& p = m_pipes[fd];
+    p.open = false;
+    p.armed = false;
+    m_lock.unlock();
+}
+
+ssize_t memory_transport::recv(int fd, void* buf, size_t len) {
+    m_lock.lock();
+    pipe& p = m_pipes[fd];
+    size_t n = p.in.size() - p.in_off;
+    if (n == 0) {
+        bool closed = p.peer_closed;
+        m_lock.unlock();
+        if (closed) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, p.in.data() + p.in_off, n);
+    p.in_off += n;
+    if (p.in_off == p.in.size()) {  // 全部读完, 保留容量以便复用
+        p.in.clear();
+        p.in_off = 0;
+    }
+    m_lock.unlock();
+    return n;
+}
+
+ssize_t memory_transport::writev(int fd, const struct iovec* iov, int count) {
+    m_lock.lock();
+    pipe& p = m_pipes[fd];
+    if (p.peer_closed) {
+        m_lock.unlock();
+        errno = EPIPE;
+        return -1;
+    }
+    size_t room = OUT_LIMIT - (p.out.size() - p.out_off);
+    if (room == 0) {
+        m_lock.unlock();
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t done = 0;
+    for (int i = 0; i < count && done < room; i++) {
+        size_t n = iov[i].iov_len < room - done ? iov[i].iov_len : room - done;
+        p.out.append((const char*)iov[i].iov_base, n);
+        done += n;
+    }
+    if (done > 0 && !p.readable) {
+        p.readable = true;
+        m_readable.push_back(fd);
+        if (m_ready.empty() && m_readable.size() == 1) {  // 应答可能由工作线程写出(协程模式), 同样唤醒wait
+            m_ready_cond.signal(m_lock.get());
+        }
+    }
+    m_lock.unlock();
+    return done;
+}
+
+int memory_transport::open() {
+    int fd = -1;
+    m_lock.lock();
+    for (size_t i = 0; i < m_pipes.size(); i++) {
+        pipe& p = m_pipes[i];
+        if (!p.used && !p.open) {
+            p.in.clear();
+            p.out.clear();
+            p.in_off = p.out_off = 0;
+            p.armed = false;
+            p.used = true;
+            p.peer_closed = false;
+            fd = i;
+            break;
+        }
+    }
+    m_lock.unlock();
+    return fd;
+}
+
+void memory_transport::client_write(int fd, const char* buf, size_t len) {
+    m_lock.lock();
+    m_pipes[fd].in.append(buf, len);
+    check(fd);
+    m_lock.unlock();
+}
+
+size_t memory_transport::client_read(int fd, char* buf, size_t len) {
+    m_lock.lock();
+    pipe& p = m_pipes[fd];
+    size_t n = p.out.size() - p.out_off;
+    bool full = n >= OUT_LIMIT;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, p.out.data() + p.out_off, n);
+    p.out_off += n;
+    if (p.out_off == p.out.size()) {
+        p.out.clear();
+        p.out_off = 0;
+    }
+    if (n > 0 && (full || !p.once)) {
+        check(fd);  // 应答缓冲区有了空间, 可能满足EPOLLOUT. 以once注册的连接只在缓冲区由满变为不满时(边沿)报告
+    }
+    m_lock.unlock();
+    return n;
+}
+
+void memory_transport::client_close(int fd) {
+    m_lock.lock();
+    pipe& p = m_pipes[fd];
+    p.used = false;
+    p.peer_closed = true;
+    check(fd);
+    m_lock.unlock();
+}
+
+int memory_transport::wait(struct epoll_event* events, int max, int timeout_ms) {
+    m_lock.lock();
+    if (m_ready.empty() && m_readable.empty() && timeout_ms > 0) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += timeout_ms / 1000;
+        t.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (t.tv_nsec >= 1000000000L) {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000L;
+        }
+        while (m_ready.empty() && m_readable.empty() && m_ready_cond.timedwait(m_lock.get(), t)) {
+        }
+    }
+    int n = m_ready.size() < (size_t)max ? m_ready.size() : max;
+    memcpy(events, m_ready.data(), n * sizeof(struct epoll_event));
+    m_ready.erase(m_ready.begin(), m_ready.begin() + n);
+    m_lock.unlock();
+    return n;
+}
+
+int memory_transport::readable(int* fds, int max) {
+    m_lock.lock();
+    int n = m_readable.size() < (size_t)max ? m_readable.size() : max;
+    for (int i = 0; i < n; i++) {
+        fds[i] = m_readable[i];
+        m_pipes[fds[i]].readable = false;
+    }
+    m_readable.erase(m_readable.begin(), m_readable.begin() + n);
+    m_lock.unlock();
+    return n;
+}
@@ -0,0 +1,104 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <string>
+#include <vector>
+#include "locker.h"
+
+/*
+ * 传输层: 客户端连接的收发数据和事件注册都通过它进行(http_conn::m_transport).
+ * 1.socket_transport: 真实的socket和epoll实例, 服务器使用;
+ * 2.memory_transport: 进程内的内存管道, 没有内核参与. 基准测试(tools/loopback_bench)用它把请求
+ *   直接送进read() -> process() -> write(), 测量的只有用户态的解析、线程池和应答的开销.
+ * 事件的语义与modfd相同: 边沿触发加EPOLLONESHOT, 事件的key为conn_key(fd, generation).
+ * 以once注册的连接(单次注册模式)则同时检测EPOLLIN和EPOLLOUT, 边沿触发, 不使用EPOLLONESHOT, 之后不再mod.
+ * 反向代理的上游连接、splice和MSG_ZEROCOPY只用于真实的socket.
+ */
+class transport {
+public:
+    virtual ~transport() {}
+    virtual void add(int fd, uint32_t generation, bool once) = 0;  // 注册新连接(非阻塞的fd), 检测EPOLLIN; once见下
+    virtual void mod(int fd, int event, uint32_t generation) = 0;  // 重新注册event事件
+    virtual void remove(int fd) = 0;  // 注销并关闭连接
+    virtual ssize_t recv(int fd, void* buf, size_t len) = 0;  // 与recv(2)相同, 没有数据时返回-1且errno为EAGAIN
+    virtual ssize_t writev(int fd, const struct iovec* iov, int count) = 0;  // 与writev(2)相同
+    virtual void shutdown_write(int fd) = 0;  // 关闭写方向(shutdown(SHUT_WR)), 之后仍然可以读
+    virtual bool enable_zerocopy(int fd) = 0;  // 尝试开启SO_ZEROCOPY
+};
+
+class socket_transport : public transport {
+public:
+    socket_transport(int epfd): m_epfd(epfd) {}
+    void add(int fd, uint32_t generation, bool once);
+    void mod(int fd, int event, uint32_t generation);
+    void remove(int fd);
+    ssize_t recv(int fd, void* buf, size_t len);
+    ssize_t writev(int fd, const struct iovec* iov, int count);
+    void shutdown_write(int fd);
+    bool enable_zerocopy(int fd);
+private:
+    int m_epfd;
+};
+
+/*
+ * 内存管道: 每个连接有两个方向的缓冲区. 客户端一侧(基准测试)用client_write写入请求、
+ * client_read取出应答; 服务器一侧(http_conn)通过transport接口读写.
+ * 1.就绪事件: 注册的事件满足条件时放入就绪队列并解除注册(EPOLLONESHOT), 由wait取出.
+ *   EPOLLIN: 有未读的请求数据; EPOLLOUT: 应答缓冲区未满; 客户端关闭后报告EPOLLRDHUP.
+ *   以once注册的连接不解除注册, 客户端写入数据、取走应答或关闭时(相当于边沿)报告当前满足的事件.
+ * 2.应答缓冲区最多OUT_LIMIT字节, 写满后writev返回EAGAIN, 客户端读走数据后才再次可写,
+ *   这样大应答同样会经过EPOLLOUT的路径.
+ * 所有操作都在一把锁下进行: 主线程读写, 工作线程在process()中调用mod.
+ */
+class memory_transport : public transport {
+public:
+    static const size_t OUT_LIMIT = 256 * 1024;
+
+    memory_transport(int max_fd);
+    void add(int fd, uint32_t generation, bool once);
+    void mod(int fd, int event, uint32_t generation);
+    void remove(int fd);
+    ssize_t recv(int fd, void* buf, size_t len);
+    ssize_t writev(int fd, const struct iovec* iov, int count);
+    void shutdown_write(int fd) {}  // 客户端一侧不区分应答是否结束, 不需要处理
+    bool enable_zerocopy(int fd) { return false; }
+
+    // 下面这组函数供客户端一侧使用
+    int open();  // 新建一个连接, 返回服务器一侧的fd(在[0, max_fd)之间), 没有空闲的fd时返回-1
+    void client_write(int fd, const char* buf, size_t len);  // 写入请求数据
+    size_t client_read(int fd, char* buf, size_t len);  // 取出应答数据, 返回取出的字节数
+    void client_close(int fd);  // 客户端关闭连接. 服务器一侧remove之后fd才能被open复用
+    int wait(struct epoll_event* events, int max, int timeout_ms);  // 取出就绪事件, 与epoll_wait相同; 有新应答数据时也会返回
+    int readable(int* fds, int max);  // 取出自上次调用以来有新应答数据的连接
+
+private:
+    struct pipe {
+        std::string in;  // 请求数据(客户端 -> 服务器)
+        size_t in_off;  // in中已被recv读走的字节数
+        std::string out;  // 应答数据(服务器 -> 客户端)
+        size_t out_off;  // out中已被client_read取走的字节数
+        uint32_t generation;
+        int event;  // 注册的事件
+        bool armed;  // 是否处于注册状态. 事件触发后解除(EPOLLONESHOT), 再次mod时恢复
+        bool once;  // 以once注册: 事件触发后不解除注册
+        bool used;  // 客户端一侧是否在使用
+        bool open;  // 服务器一侧是否在使用
+        bool peer_closed;  // 客户端是否已关闭
+        bool readable;  // 是否已在m_readable中
+    };
+
+    void check(int fd);  // 调用者持有锁: 检查注册的事件是否满足, 满足则放入就绪队列
+
+    std::vector<pipe> m_pipes;
+    std::vector<struct epoll_event> m_ready;  // 就绪队列
+    std::vector<int> m_readable;  // 有新应答数据的连接
+    locker m_lock;
+    cond m_ready_cond;
+};
+
+#endif
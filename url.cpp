@@ -0,0 +1,155 @@
+#include <string.h>
+#include "url.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;  // 转为小写
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * 结束当前段(dst[seg, o)): 空段(连续的'/')忽略, "."段删除, ".."段连同前一段一起删除.
+ * slash为true时段后面还有'/'. 返回false表示".."超出了根目录, 或者dst已满.
+ */
+static inline bool end_segment(char* dst, int& o, int& seg, int limit, bool slash) {
+    int n = o - seg;
+    if (n == 1 && dst[seg] == '.') {
+        o = seg;
+        return true;
+    }
+    if (n == 2 && dst[seg] == '.' && dst[seg + 1] == '.') {
+        if (seg == 1) {  // 已经在根目录
+            return false;
+        }
+        int prev = seg - 1;  // 前一段后面的'/'
+        while (dst[prev - 1] != '/') {
+            prev--;
+        }
+        o = seg = prev;
+        return true;
+    }
+    if (slash && n > 0) {
+        if (o >= limit) {
+            return false;
+        }
+        dst[o++] = '/';
+        seg = o;
+    }
+    return true;
+}
+
+int url_normalize(const char* src, size_t len, char* dst, size_t cap) {
+    if (len == 0 || src[0] != '/' || cap < 2) {
+        return -1;
+    }
+    const unsigned char* s = (const unsigned char*)src;
+    int limit = (int)cap - 1;  // 留一个字节给'\0'
+    dst[0] = '/';
+    int o = 1;
+    int seg = 1;  // 当前段在dst中的起始位置
+    size_t i = 1;
+    while (i < len) {
+#ifdef __SSE2__
+        /*
+         * 整块复制的条件: 块中没有需要逐字节处理的字符, 块内(含块尾与下一个字节)没有"//"和"/.";
+         * 并且块开头的字符不会改变当前段的处理方式: 当前段是普通段, 或者块不以'.'、'/'开头.
+         * 多读的一个字节(i + 16)用于检查跨块尾的"/."和"//".
+         */
+        if (i + 17 <= len && o + 16 <= limit) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+            __m128i next = _mm_loadu_si128((const __m128i*)(s + i + 1));
+            __m128i slash = _mm_cmpeq_epi8(x, _mm_set1_epi8('/'));
+            __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('%')), _mm_cmpeq_epi8(x, _mm_set1_epi8('?'))),
+                _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('#')), _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f))));
+            // x <= 0x1f(无符号比较): 控制字符
+            special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1f)), x));
+            __m128i dot_or_slash = _mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8('.')),
+                                                _mm_cmpeq_epi8(next, _mm_set1_epi8('/')));
+            special = _mm_or_si128(special, _mm_and_si128(slash, dot_or_slash));
+            int n = o - seg;
+            bool normal = n > 2 || (n == 2 && !(dst[seg] == '.' && dst[seg + 1] == '.'))
+                          || (n == 1 && dst[seg] != '.');
+            if (_mm_movemask_epi8(special) == 0 && (normal || (s[i] != '.' && s[i] != '/'))) {
+                _mm_storeu_si128((__m128i*)(dst + o), x);
+                int mask = _mm_movemask_epi8(slash);
+                if (mask) {
+                    seg = o + (31 - __builtin_clz(mask)) + 1;
+                }
+                o += 16;
+                i += 16;
+                continue;
+            }
+        }
+#endif
+        unsigned char c = s[i++];
+        if (c == '?' || c == '#') {
+            break;
+        }
+        if (c == '%') {
+            int hi = i + 1 < len ? hex_value(s[i]) : -1;
+            int lo = hi >= 0 ? hex_value(s[i + 1]) : -1;
+            if (lo < 0) {
+                return -1;
+            }
+            c = (unsigned char)(hi << 4 | lo);
+            i += 2;
+        }
+        if (c < 0x20 || c == 0x7f) {  // 包括解码出的NUL
+            return -1;
+        }
+        if (c == '/') {
+            if (!end_segment(dst, o, seg, limit, true)) {
+                return -1;
+            }
+            continue;
+        }
+        if (o >= limit) {
+            return -1;
+        }
+        dst[o++] = c;
+    }
+    if (!end_segment(dst, o, seg, limit, false)) {
+        return -1;
+    }
+    dst[o] = '\0';
+    return o;
+}
+
+// RFC 3986中可以不编码出现在路径中的字符: unreserved、sub-delims、':'、'@'和'/'
+static inline bool path_char(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return true;
+    }
+    return c && strchr("-._~!$&'()*+,;=:@/", c) != NULL;
+}
+
+int url_encode_path(const char* path, char* dst, size_t cap) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t o = 0;
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        if (path_char(*p)) {
+            if (o + 1 >= cap) {
+                return -1;
+            }
+            dst[o++] = *p;
+        } else {
+            if (o + 3 >= cap) {
+                return -1;
+            }
+            dst[o++] = '%';
+            dst[o++] = hex[*p >> 4];
+            dst[o++] = hex[*p & 15];
+        }
+    }
+    dst[o] = '\0';
+    return o;
+}
@@ -0,0 +1,24 @@
+#ifndef URL_H
+#define URL_H
+
+#include <stddef.h>
+
+/*
+ * URL规范化: 把请求目标(origin-form, 以'/'开头)转换为规范的路径, 作为文件查找和各种缓存的键.
+ * 等价的URL(如"/a%20b.html"与"/a b.html", "/index.html?v=3"与"/index.html", "/images/../index.html"
+ * 与"/index.html")得到相同的键, 共享缓存项. 一遍扫描完成以下处理:
+ * 1.在第一个'?'或'#'处结束, 去掉查询串和片段;
+ * 2.解码%XX. 解码出的'/'与字面的'/'相同, 解码出NUL、控制字符, 或%后不是两个十六进制数字时, 视为非法;
+ * 3.合并连续的'/', 去掉"."段, ".."段删除前一段; ".."超出根目录时视为非法(路径穿越).
+ * 支持SSE2时, 每次检查16个字节: 不含'%'、'?'、'#'、控制字符, 也不含"//"和"/."的块直接整块复制,
+ * 只有含这些字符的块才逐字节处理. 常见的URL大部分都走整块复制.
+ */
+
+// 规范化src(长度len), 结果写入dst(容量cap, 以'\0'结尾). 返回规范路径的长度, 非法或超出cap时返回-1
+int url_normalize(const char* src, size_t len, char* dst, size_t cap);
+
+// 把规范路径path重新编码为请求目标中的路径: pchar和'/'之外的字节(空格、'?'、'#'、'%'、非ASCII等)编码为%XX.
+// 结果写入dst(容量cap, 以'\0'结尾), 返回长度, 超出cap时返回-1. 转发给上游时使用, 使上游看到的路径与匹配时的相同
+int url_encode_path(const char* path, char* dst, size_t cap);
+
+#endif